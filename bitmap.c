@@ -0,0 +1,490 @@
+#include <stdint.h>
+#include <string.h>
+
+#include "bitmap.h"
+
+#if defined(__GNUC__) && defined(__x86_64__)
+#include <immintrin.h>
+#define HAVE_AVX2_DISPATCH 1
+#endif
+
+/*
+Returns 64 bits of the bitmap starting at word index word, in bitmap bit order.
+Bits at or past nbits read as set, so callers never see them as free.
+*/
+static uint64_t load_word(const unsigned char *bitmap, unsigned long word, unsigned long nbits){
+    uint64_t value = ~0ULL;
+    unsigned long first_bit = word * 64;
+    unsigned long valid = nbits - first_bit;
+    if(valid >= 64){
+        memcpy(&value, bitmap + word * 8, 8);
+    }else{
+        memcpy(&value, bitmap + word * 8, (valid + 7) / 8);
+    }
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+    value = __builtin_bswap64(value);
+#endif
+    if(valid < 64){
+        value |= ~0ULL << valid;
+    }
+    return value;
+}
+
+#ifdef HAVE_AVX2_DISPATCH
+//Set once before main, threads only ever read them.
+static int has_avx2;
+static int has_popcnt;
+
+/*
+Detects the CPU features the scanners dispatch on. It runs as a constructor,
+before any thread can be started, so scanners shared between threads never
+race on the flags.
+*/
+__attribute__((constructor))
+static void detect_cpu_features(void){
+    //Constructors may run before libgcc has looked at the CPU.
+    __builtin_cpu_init();
+    has_avx2 = __builtin_cpu_supports("avx2") ? 1 : 0;
+    has_popcnt = __builtin_cpu_supports("popcnt") ? 1 : 0;
+}
+
+/*
+Skips 256-bit chunks that are entirely set, starting at word w and stopping
+before word limit. Returns the first word that may hold a clear bit.
+*/
+__attribute__((target("avx2")))
+static unsigned long skip_full_words_avx2(const unsigned char *bitmap, unsigned long w, unsigned long limit){
+    const __m256i ones = _mm256_set1_epi32(-1);
+    while(w + 4 <= limit){
+        __m256i chunk = _mm256_loadu_si256((const __m256i *)(bitmap + w * 8));
+        if(!_mm256_testc_si256(chunk, ones)){
+            break;
+        }
+        w += 4;
+    }
+    return w;
+}
+#endif
+
+/*
+Returns the first word at or after w, and before the last whole word of the
+bitmap, that is not entirely set. Without AVX2 this is the word-by-word loop's
+job, so w comes straight back.
+*/
+static unsigned long skip_full_words(const unsigned char *bitmap, unsigned long w, unsigned long nbits){
+#ifdef HAVE_AVX2_DISPATCH
+    if(has_avx2){
+        return skip_full_words_avx2(bitmap, w, nbits / 64);
+    }
+#endif
+    return w;
+}
+
+/*
+Returns the first clear bit in [from, to), or -1.
+*/
+static long find_zero_range(const unsigned char *bitmap, unsigned long nbits, unsigned long from, unsigned long to){
+    if(from >= to){
+        return -1;
+    }
+    unsigned long w = from / 64;
+    unsigned long last = (to + 63) / 64;
+    uint64_t free_bits = ~load_word(bitmap, w, nbits) & (~0ULL << (from % 64));
+    while(!free_bits){
+        w = skip_full_words(bitmap, w + 1, nbits);
+        if(w >= last){
+            return -1;
+        }
+        free_bits = ~load_word(bitmap, w, nbits);
+    }
+    unsigned long bit = w * 64 + __builtin_ctzll(free_bits);
+    return bit < to ? (long)bit : -1;
+}
+
+/*
+Returns the first clear bit at or after start, wrapping around to the bits
+before start if needed.
+*/
+long bitmap_find_zero(const unsigned char *bitmap, unsigned long nbits, unsigned long start){
+    if(start >= nbits){
+        start = 0;
+    }
+    long bit = find_zero_range(bitmap, nbits, start, nbits);
+    if(bit < 0){
+        bit = find_zero_range(bitmap, nbits, 0, start);
+    }
+    return bit;
+}
+
+/*
+Returns the first set bit in [from, to), or -1. Does not wrap.
+*/
+long bitmap_find_one(const unsigned char *bitmap, unsigned long nbits, unsigned long from, unsigned long to){
+    if(to > nbits){
+        to = nbits;
+    }
+    if(from >= to){
+        return -1;
+    }
+    unsigned long w = from / 64;
+    unsigned long last = (to + 63) / 64;
+    uint64_t used_bits = load_word(bitmap, w, nbits) & (~0ULL << (from % 64));
+    while(!used_bits){
+        w++;
+        if(w >= last){
+            return -1;
+        }
+        used_bits = load_word(bitmap, w, nbits);
+    }
+    unsigned long bit = w * 64 + __builtin_ctzll(used_bits);
+    return bit < to ? (long)bit : -1;
+}
+
+/*
+Collects up to count clear bits from [from, to) into out, returns how many.
+*/
+static unsigned long collect_zeros_range(const unsigned char *bitmap, unsigned long nbits, unsigned long from, unsigned long to, unsigned long count, unsigned long *out){
+    unsigned long found = 0;
+    if(from >= to){
+        return 0;
+    }
+    unsigned long w = from / 64;
+    unsigned long last = (to + 63) / 64;
+    uint64_t free_bits = ~load_word(bitmap, w, nbits) & (~0ULL << (from % 64));
+    while(found < count){
+        while(free_bits && found < count){
+            unsigned long bit = w * 64 + __builtin_ctzll(free_bits);
+            if(bit >= to){
+                return found;
+            }
+            out[found++] = bit;
+            free_bits &= free_bits - 1;
+        }
+        w = skip_full_words(bitmap, w + 1, nbits);
+        if(w >= last){
+            break;
+        }
+        free_bits = ~load_word(bitmap, w, nbits);
+    }
+    return found;
+}
+
+/*
+Finds up to count clear bits at or after start (wrapping), in bit order, and
+stores them in out. The bitmap is not modified. Returns how many were found.
+*/
+unsigned long bitmap_find_zeros(const unsigned char *bitmap, unsigned long nbits, unsigned long start, unsigned long count, unsigned long *out){
+    if(start >= nbits){
+        start = 0;
+    }
+    unsigned long found = collect_zeros_range(bitmap, nbits, start, nbits, count, out);
+    if(found < count){
+        found += collect_zeros_range(bitmap, nbits, 0, start, count - found, out + found);
+    }
+    return found;
+}
+
+/*
+Returns the first bit of a run of run clear bits lying entirely in [from, to).
+*/
+static long find_zero_run_range(const unsigned char *bitmap, unsigned long nbits, unsigned long from, unsigned long to, unsigned long run){
+    while(from + run <= to){
+        long candidate = find_zero_range(bitmap, nbits, from, to);
+        if(candidate < 0 || candidate + run > to){
+            return -1;
+        }
+        long used = bitmap_find_one(bitmap, nbits, candidate, candidate + run);
+        if(used < 0){
+            return candidate;
+        }
+        //The run is broken at used, nothing before it can start a long enough one.
+        from = used + 1;
+    }
+    return -1;
+}
+
+/*
+Returns the first bit of a run of run contiguous clear bits at or after start,
+wrapping to runs that begin before start. Runs never wrap past the end.
+*/
+long bitmap_find_zero_run(const unsigned char *bitmap, unsigned long nbits, unsigned long start, unsigned long run){
+    if(run == 0 || run > nbits){
+        return -1;
+    }
+    if(start >= nbits){
+        start = 0;
+    }
+    long bit = find_zero_run_range(bitmap, nbits, start, nbits, run);
+    if(bit < 0){
+        unsigned long to = start + run - 1;
+        bit = find_zero_run_range(bitmap, nbits, 0, to < nbits ? to : nbits, run);
+    }
+    return bit;
+}
+
+#ifdef HAVE_AVX2_DISPATCH
+/*
+Counts the set bits in the first bytes bytes, a multiple of 32. Each nibble
+is looked up in a 16 entry table with pshufb, and the per byte counts are
+summed into 64-bit lanes with sad.
+*/
+__attribute__((target("avx2")))
+static unsigned long count_ones_avx2(const unsigned char *bitmap, unsigned long bytes){
+    const __m256i table = _mm256_setr_epi8(0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4,
+                                           0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4);
+    const __m256i low_nibbles = _mm256_set1_epi8(0x0f);
+    __m256i total = _mm256_setzero_si256();
+    for(unsigned long b = 0; b < bytes; b += 32){
+        __m256i chunk = _mm256_loadu_si256((const __m256i *)(bitmap + b));
+        __m256i low = _mm256_shuffle_epi8(table, _mm256_and_si256(chunk, low_nibbles));
+        __m256i high = _mm256_shuffle_epi8(table, _mm256_and_si256(_mm256_srli_epi16(chunk, 4), low_nibbles));
+        total = _mm256_add_epi64(total, _mm256_sad_epu8(_mm256_add_epi8(low, high), _mm256_setzero_si256()));
+    }
+    return _mm256_extract_epi64(total, 0) + _mm256_extract_epi64(total, 1)
+        + _mm256_extract_epi64(total, 2) + _mm256_extract_epi64(total, 3);
+}
+
+/*
+Counts the set bits in the first words 64-bit words with the POPCNT
+instruction, for CPUs that have it but not AVX2.
+*/
+__attribute__((target("popcnt")))
+static unsigned long count_ones_popcnt(const unsigned char *bitmap, unsigned long words){
+    unsigned long ones = 0;
+    for(unsigned long w = 0; w < words; w++){
+        uint64_t value;
+        memcpy(&value, bitmap + w * 8, 8);
+        ones += __builtin_popcountll(value);
+    }
+    return ones;
+}
+#endif
+
+/*
+Returns the number of clear bits among the first nbits. Whole words are
+counted with AVX2 or POPCNT when the CPU has them, only the last partial
+word goes through load_word.
+*/
+unsigned long bitmap_count_zero(const unsigned char *bitmap, unsigned long nbits){
+    unsigned long whole = nbits / 64;
+    unsigned long ones = 0, w = 0;
+#ifdef HAVE_AVX2_DISPATCH
+    if(has_avx2){
+        w = whole / 4 * 4;
+        ones = count_ones_avx2(bitmap, w * 8);
+    }
+    if(has_popcnt){
+        ones += count_ones_popcnt(bitmap + w * 8, whole - w);
+        w = whole;
+    }
+#endif
+    for(; w < whole; w++){
+        ones += __builtin_popcountll(load_word(bitmap, w, nbits));
+    }
+    unsigned long zeros = whole * 64 - ones;
+    if(nbits % 64){
+        zeros += __builtin_popcountll(~load_word(bitmap, whole, nbits));
+    }
+    return zeros;
+}
+
+#ifdef HAVE_AVX2_DISPATCH
+/*
+Returns the first 32-byte chunk at or after byte b, and before byte limit,
+that has a bit set, or where the whole chunks ran out.
+*/
+__attribute__((target("avx2")))
+static unsigned long skip_clear_chunks_avx2(const unsigned char *bitmap, unsigned long b, unsigned long limit){
+    while(b + 32 <= limit){
+        __m256i chunk = _mm256_loadu_si256((const __m256i *)(bitmap + b));
+        if(!_mm256_testz_si256(chunk, chunk)){
+            break;
+        }
+        b += 32;
+    }
+    return b;
+}
+#endif
+
+/*
+Returns 1 if none of the first nbits are set, 0 otherwise. Run over a whole
+data block it tells whether the block holds nothing but zeros.
+*/
+int bitmap_all_clear(const unsigned char *bitmap, unsigned long nbits){
+    unsigned long bytes = nbits / 8;
+    unsigned long b = 0;
+#ifdef HAVE_AVX2_DISPATCH
+    if(has_avx2){
+        b = skip_clear_chunks_avx2(bitmap, b, bytes);
+    }
+#endif
+    for(; b + 8 <= bytes; b += 8){
+        uint64_t value;
+        memcpy(&value, bitmap + b, 8);
+        if(value){
+            return 0;
+        }
+    }
+    for(; b < bytes; b++){
+        if(bitmap[b]){
+            return 0;
+        }
+    }
+    return nbits % 8 == 0 || (bitmap[bytes] & ((1u << (nbits % 8)) - 1)) == 0;
+}
+
+/*
+Sets (value 1) or clears (value 0) the masked bits of byte, returning how many
+of them changed. Atomic, so threads changing other bits of the byte don't
+undo each other.
+*/
+static unsigned long update_byte(unsigned char *byte, unsigned char mask, int value){
+    unsigned char old;
+    if(value){
+        old = __atomic_fetch_or(byte, mask, __ATOMIC_ACQ_REL);
+        return __builtin_popcount(mask & ~old);
+    }
+    old = __atomic_fetch_and(byte, (unsigned char)~mask, __ATOMIC_ACQ_REL);
+    return __builtin_popcount(mask & old);
+}
+
+/*
+Sets or clears count bits starting at bit from: bytes up to the first word
+boundary, then whole 64-bit words, then the bytes left over. Returns how many
+bits changed state. Each byte or word changes atomically, the range as a
+whole does not.
+*/
+static unsigned long update_range(unsigned char *bitmap, unsigned long from, unsigned long count, int value){
+    unsigned long changed = 0;
+    unsigned long to = from + count;
+    //Leading bits inside a partial byte, then whole bytes up to a word boundary.
+    while(from < to && (from % 64) != 0){
+        unsigned long end = (from / 8 + 1) * 8;
+        if(end > to){
+            end = to;
+        }
+        unsigned char mask = (unsigned char)(((1u << (end - from)) - 1) << (from % 8));
+        changed += update_byte(&bitmap[from / 8], mask, value);
+        from = end;
+    }
+    //Whole words are swapped in, bitmaps sit at block boundaries so they are aligned.
+    uint64_t fill = value ? ~0ULL : 0;
+    while(to - from >= 64){
+        uint64_t word = __atomic_exchange_n((uint64_t *)(bitmap + from / 8), fill, __ATOMIC_ACQ_REL);
+        changed += __builtin_popcountll(word ^ fill);
+        from += 64;
+    }
+    while(from < to){
+        unsigned long end = (from / 8 + 1) * 8;
+        if(end > to){
+            end = to;
+        }
+        unsigned char mask = (unsigned char)(((1u << (end - from)) - 1) << (from % 8));
+        changed += update_byte(&bitmap[from / 8], mask, value);
+        from = end;
+    }
+    return changed;
+}
+
+/*
+Sets count bits starting at bit from. Returns how many were clear before.
+*/
+unsigned long bitmap_set_range(unsigned char *bitmap, unsigned long from, unsigned long count){
+    return update_range(bitmap, from, count, 1);
+}
+
+/*
+Clears count bits starting at bit from. Returns how many were set before.
+*/
+unsigned long bitmap_clear_range(unsigned char *bitmap, unsigned long from, unsigned long count){
+    return update_range(bitmap, from, count, 0);
+}
+
+/*
+Returns the mask of the bits of word word (in memory order) that fall in
+[from, to).
+*/
+static uint64_t range_mask(unsigned long word, unsigned long from, unsigned long to){
+    unsigned long first = word * 64;
+    uint64_t mask = ~0ULL;
+    if(from > first){
+        mask &= ~0ULL << (from - first);
+    }
+    if(to < first + 64){
+        mask &= ~0ULL >> (first + 64 - to);
+    }
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+    mask = __builtin_bswap64(mask);
+#endif
+    return mask;
+}
+
+/*
+Sets count bits starting at bit from, but only if all of them are clear,
+with a compare-and-swap per 64-bit word. If another thread got to any of them
+first, the words already taken are given back. Returns 1 if the bits were
+claimed, 0 if nothing changed. The bitmap must be 8-byte aligned.
+*/
+int bitmap_claim_range(unsigned char *bitmap, unsigned long from, unsigned long count){
+    unsigned long to = from + count;
+    unsigned long first_word = from / 64;
+    unsigned long last_word = (to + 63) / 64;
+    uint64_t *words = (uint64_t *)bitmap;
+    for(unsigned long w = first_word; w < last_word; w++){
+        uint64_t mask = range_mask(w, from, to);
+        uint64_t old = __atomic_load_n(&words[w], __ATOMIC_RELAXED);
+        int taken = 0;
+        do{
+            if(old & mask){
+                taken = 1;
+                break;
+            }
+        }while(!__atomic_compare_exchange_n(&words[w], &old, old | mask, 1, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED));
+        if(taken){
+            for(unsigned long undo = first_word; undo < w; undo++){
+                __atomic_fetch_and(&words[undo], ~range_mask(undo, from, to), __ATOMIC_ACQ_REL);
+            }
+            return 0;
+        }
+    }
+    return 1;
+}
+
+/*
+Finds a clear bit at or after start (wrapping) and claims it. Threads racing
+for the same bit each end up with a different one. Returns the bit, or -1 if
+the bitmap is full.
+*/
+long bitmap_claim_zero(unsigned char *bitmap, unsigned long nbits, unsigned long start){
+    for(unsigned long attempt = 0; attempt < nbits; attempt++){
+        long bit = bitmap_find_zero(bitmap, nbits, start);
+        if(bit < 0){
+            return -1;
+        }
+        unsigned char mask = 1 << (bit % 8);
+        if(!(__atomic_fetch_or(&bitmap[bit / 8], mask, __ATOMIC_ACQ_REL) & mask)){
+            return bit;
+        }
+        start = bit + 1;
+    }
+    return -1;
+}
+
+/*
+Finds run contiguous clear bits at or after start (wrapping, as
+bitmap_find_zero_run) and claims them all. Returns the first bit, or -1 if
+there is no such run.
+*/
+long bitmap_claim_zero_run(unsigned char *bitmap, unsigned long nbits, unsigned long start, unsigned long run){
+    for(unsigned long attempt = 0; attempt < nbits; attempt++){
+        long bit = bitmap_find_zero_run(bitmap, nbits, start, run);
+        if(bit < 0){
+            return -1;
+        }
+        if(bitmap_claim_range(bitmap, bit, run)){
+            return bit;
+        }
+        start = bit + 1;
+    }
+    return -1;
+}
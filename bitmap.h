@@ -0,0 +1,36 @@
+#ifndef BITMAP_FUNCTIONS
+#define BITMAP_FUNCTIONS
+
+/*
+Search engine for the on-disk inode and block bitmaps. A bitmap is the raw byte
+array from the image (bit i lives in byte i / 8 at position i % 8) and nbits is
+the number of valid bits in it; anything past nbits is treated as in use.
+Bitmaps are scanned 64 bits at a time, with AVX2 used to skip over full
+stretches when the CPU has it.
+
+Searches take a start bit and wrap around to bit 0, so keeping the bit after
+the last hit as a cursor gives next-fit allocation. They return the bit index
+found, or -1 if there is none.
+
+bitmap_set_range and bitmap_clear_range change a run of bits a whole 64-bit
+word at a time and return how many bits actually flipped, which is what the
+free counters have to move by.
+
+The claim functions are for allocators shared between threads: a bit is only
+handed out by the thread whose atomic update flipped it, so two threads racing
+for the same free bit each get a different one.
+*/
+
+long bitmap_find_zero(const unsigned char*, unsigned long, unsigned long);
+long bitmap_find_one(const unsigned char*, unsigned long, unsigned long, unsigned long);
+unsigned long bitmap_find_zeros(const unsigned char*, unsigned long, unsigned long, unsigned long, unsigned long*);
+long bitmap_find_zero_run(const unsigned char*, unsigned long, unsigned long, unsigned long);
+unsigned long bitmap_count_zero(const unsigned char*, unsigned long);
+int bitmap_all_clear(const unsigned char*, unsigned long);
+unsigned long bitmap_set_range(unsigned char*, unsigned long, unsigned long);
+unsigned long bitmap_clear_range(unsigned char*, unsigned long, unsigned long);
+int bitmap_claim_range(unsigned char*, unsigned long, unsigned long);
+long bitmap_claim_zero(unsigned char*, unsigned long, unsigned long);
+long bitmap_claim_zero_run(unsigned char*, unsigned long, unsigned long, unsigned long);
+
+#endif
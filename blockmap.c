@@ -0,0 +1,294 @@
+#include "helper.h"
+
+/*
+Splits logical block index of a file into the i_block slot it starts from,
+written to offsets[0], and the pointer to follow inside each index block on the
+way down, written to offsets[1] onwards. Returns the number of index blocks on
+the path (0 for a direct block), or -EFBIG past the triple indirect range.
+*/
+int block_map_path(unsigned int index, unsigned int *offsets){
+    unsigned long per_block = EXT2_ADDR_PER_BLOCK;
+    if(index < EXT2_NDIR_BLOCKS){
+        offsets[0] = index;
+        return 0;
+    }
+    index -= EXT2_NDIR_BLOCKS;
+    if(index < per_block){
+        offsets[0] = EXT2_IND_BLOCK;
+        offsets[1] = index;
+        return 1;
+    }
+    index -= per_block;
+    if(index < per_block * per_block){
+        offsets[0] = EXT2_DIND_BLOCK;
+        offsets[1] = index / per_block;
+        offsets[2] = index % per_block;
+        return 2;
+    }
+    index -= per_block * per_block;
+    if(index < per_block * per_block * per_block){
+        offsets[0] = EXT2_TIND_BLOCK;
+        offsets[1] = index / (per_block * per_block);
+        offsets[2] = (index / per_block) % per_block;
+        offsets[3] = index % per_block;
+        return 3;
+    }
+    return -EFBIG;
+}
+
+/*
+Returns how many index blocks a file with data blocks 0 to blocks - 1 has.
+*/
+unsigned int index_blocks_needed(unsigned int blocks){
+    unsigned long per_block = EXT2_ADDR_PER_BLOCK;
+    unsigned long left = blocks;
+    unsigned int needed = 0;
+    if(left <= EXT2_NDIR_BLOCKS){
+        return 0;
+    }
+    left -= EXT2_NDIR_BLOCKS;
+    //Single indirect.
+    needed++;
+    if(left <= per_block){
+        return needed;
+    }
+    left -= per_block;
+    //Double indirect, and the single indirect blocks under it.
+    unsigned long double_part = left < per_block * per_block ? left : per_block * per_block;
+    needed += 1 + (double_part + per_block - 1) / per_block;
+    if(left <= per_block * per_block){
+        return needed;
+    }
+    left -= per_block * per_block;
+    //Triple indirect, its double indirect blocks and their single indirect blocks.
+    needed += 1 + (left + per_block * per_block - 1) / (per_block * per_block) + (left + per_block - 1) / per_block;
+    return needed;
+}
+
+/*
+Returns the block number holding block index of the file at inode inode_num,
+or 0 if the file does not reach that far.
+*/
+unsigned int get_file_block(ext2_fs *fs, int inode_num, unsigned int index){
+    struct ext2_inode *inode = get_inode(fs, inode_num);
+    unsigned int offsets[4];
+    int depth = block_map_path(index, offsets);
+    if(depth < 0){
+        return 0;
+    }
+    unsigned int block = inode->i_block[offsets[0]];
+    for(int level = 1; level <= depth && block != 0; level++){
+        if(block >= fs->geometry.blocks_count){
+            return 0;
+        }
+        block = ((unsigned int*)get_block(fs, block))[offsets[level]];
+    }
+    return block;
+}
+
+/*
+Fast symbolic links keep their target in i_block instead of a block map.
+*/
+static int is_fast_symlink(struct ext2_inode *inode){
+    return (inode->i_mode & 0xf000) == EXT2_S_IFLNK && inode->i_blocks == 0;
+}
+
+static int block_map_valid(ext2_fs *fs, unsigned int block_num){
+    return block_num != 0 && block_num < fs->geometry.blocks_count;
+}
+
+/*
+Returns one past the last logical block mapped under index block block_num,
+which sits levels above the data and maps logical blocks from first on, or 0
+if nothing under it is mapped.
+*/
+static unsigned long last_mapped_under(ext2_fs *fs, unsigned int block_num, int levels, unsigned long first){
+    unsigned long per_block = EXT2_ADDR_PER_BLOCK;
+    if(!block_map_valid(fs, block_num)){
+        return 0;
+    }
+    unsigned int *pointers = (unsigned int*)get_block(fs, block_num);
+    unsigned long span = 1;
+    for(int level = 1; level < levels; level++){
+        span *= per_block;
+    }
+    for(long i = per_block - 1; i >= 0; i--){
+        if(levels == 1){
+            if(block_map_valid(fs, pointers[i])){
+                return first + i + 1;
+            }
+        }else{
+            unsigned long end = last_mapped_under(fs, pointers[i], levels - 1, first + i * span);
+            if(end){
+                return end;
+            }
+        }
+    }
+    return 0;
+}
+
+/*
+Returns one past the last mapped logical block of inode inode_num, 0 if it
+has none. Sparse files can have holes before that, so this is where the next
+block appended goes rather than how many blocks are allocated. The map is
+searched from its far end down, skipping anything not there.
+*/
+unsigned int count_file_blocks(ext2_fs *fs, int inode_num){
+    struct ext2_inode *inode = get_inode(fs, inode_num);
+    unsigned long per_block = EXT2_ADDR_PER_BLOCK;
+    if(is_fast_symlink(inode)){
+        return 0;
+    }
+    unsigned long first[3] = {EXT2_NDIR_BLOCKS, EXT2_NDIR_BLOCKS + per_block, EXT2_NDIR_BLOCKS + per_block + per_block * per_block};
+    for(int levels = 3; levels >= 1; levels--){
+        unsigned long end = last_mapped_under(fs, inode->i_block[EXT2_IND_BLOCK + levels - 1], levels, first[levels - 1]);
+        if(end){
+            return end;
+        }
+    }
+    for(int i = EXT2_NDIR_BLOCKS - 1; i >= 0; i--){
+        if(block_map_valid(fs, inode->i_block[i])){
+            return i + 1;
+        }
+    }
+    return 0;
+}
+
+/*
+Returns how many index blocks inode inode_num is still missing for logical
+blocks start to start + count - 1 to be mapped. For a map with no holes that
+ends at start this is index_blocks_needed(start + count) -
+index_blocks_needed(start). Only one logical block per bottom level index
+block is looked at, since the rest share its path.
+*/
+unsigned int index_blocks_missing(ext2_fs *fs, int inode_num, unsigned int start, unsigned int count){
+    struct ext2_inode *inode = get_inode(fs, inode_num);
+    unsigned long per_block = EXT2_ADDR_PER_BLOCK;
+    unsigned long logical = start, end = (unsigned long)start + count;
+    unsigned int offsets[4], previous[4];
+    int previous_depth = -1;
+    unsigned int missing = 0;
+    while(logical < end){
+        int depth = block_map_path(logical, offsets);
+        if(depth < 0){
+            break;
+        }
+        unsigned int node = inode->i_block[offsets[0]];
+        for(int level = 1; level <= depth; level++){
+            if(block_map_valid(fs, node)){
+                node = ((unsigned int*)get_block(fs, node))[offsets[level]];
+            }else if(depth != previous_depth || memcmp(offsets, previous, sizeof(unsigned int) * level) != 0){
+                //Not there, and not already counted for the previous path either.
+                missing++;
+            }
+        }
+        memcpy(previous, offsets, sizeof(offsets));
+        previous_depth = depth;
+        logical += depth == 0 ? EXT2_NDIR_BLOCKS - logical : per_block - offsets[depth];
+    }
+    return missing;
+}
+
+/*
+Starts iter at logical block 0 of inode inode_num. flags is a mix of
+BLOCK_MAP_INDEX and BLOCK_MAP_PREFETCH.
+*/
+void block_map_iter_init(BlockMapIter *iter, ext2_fs *fs, int inode_num, int flags){
+    iter->fs = fs;
+    iter->inode = get_inode(fs, inode_num);
+    iter->flags = flags;
+    iter->logical = is_fast_symlink(iter->inode) ? EXT2_MAX_FILE_BLOCKS : 0;
+    memset(iter->reported, 0, sizeof(iter->reported));
+    iter->buffered = FALSE;
+}
+
+/*
+Finds the extent at or after iter->logical: an index block not reported yet
+on the way down, or the longest run of contiguous data blocks inside one
+pointer array. Returns 1 and fills in extent, or 0 once the map is exhausted.
+*/
+static int block_map_scan(BlockMapIter *iter, BlockExtent *extent){
+    unsigned long per_block = EXT2_ADDR_PER_BLOCK;
+    while(iter->logical < EXT2_MAX_FILE_BLOCKS){
+        unsigned int offsets[4];
+        int depth = block_map_path(iter->logical, offsets);
+        unsigned int *pointers = iter->inode->i_block;
+        unsigned int slot = offsets[0];
+        int skipped = FALSE;
+        for(int level = 1; level <= depth; level++){
+            unsigned int node = pointers[slot];
+            if(!block_map_valid(iter->fs, node)){
+                //Nothing under this index block, jump past everything it would map.
+                unsigned long span = 1, position = 0;
+                for(int below = depth; below >= level; below--){
+                    position += offsets[below] * span;
+                    span *= per_block;
+                }
+                iter->logical += span - position;
+                skipped = TRUE;
+                break;
+            }
+            if((iter->flags & BLOCK_MAP_INDEX) && iter->reported[level - 1] != node){
+                iter->reported[level - 1] = node;
+                extent->logical = iter->logical;
+                extent->physical = node;
+                extent->length = 1;
+                extent->level = depth - level + 1;
+                return 1;
+            }
+            pointers = (unsigned int*)get_block(iter->fs, node);
+            slot = offsets[level];
+        }
+        if(skipped){
+            continue;
+        }
+        unsigned int limit = depth == 0 ? EXT2_NDIR_BLOCKS : per_block;
+        unsigned int first = pointers[slot];
+        unsigned int length = 1;
+        if(!block_map_valid(iter->fs, first)){
+            while(slot + length < limit && !block_map_valid(iter->fs, pointers[slot + length])){
+                length++;
+            }
+            iter->logical += length;
+            continue;
+        }
+        while(slot + length < limit && pointers[slot + length] == first + length && block_map_valid(iter->fs, first + length)){
+            length++;
+        }
+        extent->logical = iter->logical;
+        extent->physical = first;
+        extent->length = length;
+        extent->level = BLOCK_MAP_DATA;
+        iter->logical += length;
+        return 1;
+    }
+    return 0;
+}
+
+static void block_map_prefetch(BlockMapIter *iter, BlockExtent *extent){
+    static size_t page_size = 0;
+    if(!page_size){
+        page_size = sysconf(_SC_PAGESIZE);
+    }
+    size_t start = ((size_t)extent->physical * EXT2_BLOCK_SIZE) & ~(page_size - 1);
+    size_t end = (size_t)(extent->physical + extent->length) * EXT2_BLOCK_SIZE;
+    madvise(iter->fs->disk + start, end - start, MADV_WILLNEED);
+}
+
+/*
+Hands out the next extent of the block map in file order, index blocks (with
+BLOCK_MAP_INDEX) before the blocks they map. With BLOCK_MAP_PREFETCH the
+extent after it is already being read in while the caller works on this one.
+Returns 1, or 0 at the end of the map.
+*/
+int block_map_next(BlockMapIter *iter, BlockExtent *extent){
+    if(!iter->buffered && !block_map_scan(iter, &iter->next)){
+        return 0;
+    }
+    *extent = iter->next;
+    iter->buffered = block_map_scan(iter, &iter->next);
+    if(iter->buffered && (iter->flags & BLOCK_MAP_PREFETCH)){
+        block_map_prefetch(iter, &iter->next);
+    }
+    return 1;
+}
@@ -0,0 +1,60 @@
+#ifndef BLOCKMAP_FUNCTIONS
+#define BLOCKMAP_FUNCTIONS
+
+/*
+Logical to physical block mapping through an inode's block map: i_block[0..11]
+point at data, i_block[12], [13] and [14] at the single, double and triple
+indirect index blocks.
+
+A BlockMapIter walks the whole map in file order and hands out extents, runs
+of physically contiguous blocks, so callers can clear bitmap ranges, copy or
+read ahead a run at a time. Zero pointers are holes and are skipped, along
+with everything under a missing index block; the walk never stops early on
+one. Pointers past the end of the file system are treated as holes too.
+*/
+
+#define    EXT2_NDIR_BLOCKS 12
+#define    EXT2_IND_BLOCK 12
+#define    EXT2_DIND_BLOCK 13
+#define    EXT2_TIND_BLOCK 14
+#define    EXT2_ADDR_PER_BLOCK (EXT2_BLOCK_SIZE / sizeof(unsigned int))
+#define    EXT2_MAX_FILE_BLOCKS (EXT2_NDIR_BLOCKS + EXT2_ADDR_PER_BLOCK \
+        + EXT2_ADDR_PER_BLOCK * EXT2_ADDR_PER_BLOCK \
+        + EXT2_ADDR_PER_BLOCK * EXT2_ADDR_PER_BLOCK * EXT2_ADDR_PER_BLOCK)
+
+//Level of an extent holding file data, index blocks get 1 to 3.
+#define    BLOCK_MAP_DATA 0
+
+//Iterator flags: also report index blocks, and madvise the run after the one handed out.
+#define    BLOCK_MAP_INDEX 1
+#define    BLOCK_MAP_PREFETCH 2
+
+typedef struct block_extent {
+    unsigned int logical;   /* First logical block, for index blocks the first one they map */
+    unsigned int physical;
+    unsigned int length;
+    int level;
+} BlockExtent;
+
+typedef struct block_map_iter {
+    ext2_fs *fs;
+    struct ext2_inode *inode;
+    int flags;
+    //Next logical block to look at.
+    unsigned long logical;
+    //Index blocks on the current path already reported, top level first.
+    unsigned int reported[3];
+    //An extent computed ahead of time, so it can be prefetched.
+    int buffered;
+    BlockExtent next;
+} BlockMapIter;
+
+int block_map_path(unsigned int, unsigned int*);
+unsigned int index_blocks_needed(unsigned int);
+unsigned int get_file_block(ext2_fs*, int, unsigned int);
+unsigned int count_file_blocks(ext2_fs*, int);
+unsigned int index_blocks_missing(ext2_fs*, int, unsigned int, unsigned int);
+void block_map_iter_init(BlockMapIter*, ext2_fs*, int, int);
+int block_map_next(BlockMapIter*, BlockExtent*);
+
+#endif
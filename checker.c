@@ -0,0 +1,908 @@
+#define _GNU_SOURCE
+#include <time.h>
+#include <sched.h>
+#include <stdint.h>
+#include <stdarg.h>
+
+#include "checker.h"
+#include "walk.h"
+
+//Inodes of the table pass 2 hands a thread at a time.
+#define CHECK_INODE_CHUNK 1024
+
+/*
+A block pass 2 found already claimed when inode reached it.
+*/
+typedef struct duplicate_block {
+    unsigned int block;
+    unsigned int inode;
+} DuplicateBlock;
+
+typedef struct check_state CheckState;
+
+typedef struct check_worker {
+    pthread_t thread;
+    CheckState *state;
+    int index;
+    //Directories still to be listed: the owner pushes and pops at bottom, thieves take from top.
+    pthread_mutex_t lock;
+    unsigned int *stack;
+    int top;
+    int bottom;
+    int capacity;
+    long listed;
+    long stolen;
+    //Blocks this worker found claimed twice in pass 2.
+    DuplicateBlock *duplicates;
+    int duplicate_count;
+    int duplicate_capacity;
+} CheckWorker;
+
+struct check_state {
+    ext2_fs *fs;
+    int threads;
+    //CHECK_DRY_RUN: report what would be fixed, touch nothing.
+    int dry_run;
+    CheckWorker *workers;
+    //Pass 1: a flag per inode set once it is queued, directories queued or being listed, and how many entries name each inode.
+    unsigned char *queued;
+    long pending;
+    int failed;
+    unsigned int *references;
+    //Pass 2: start of the next chunk of the inode table, the bitmaps as the image should have them, the metadata blocks, and per inode how many of its blocks the block bitmap has clear.
+    unsigned int next_inode;
+    unsigned int first_ino;
+    unsigned char *shadow_inodes;
+    unsigned char *shadow_blocks;
+    unsigned char *metadata;
+    unsigned int *unmarked;
+    //Pass 3: fixes made by the entry checks, inodes whose deletion time a dry run reported already, and what the bitmap diff tallies.
+    int entry_fixes;
+    unsigned char *dtime_reported;
+    long metadata_unmarked;
+    long leaked_blocks;
+};
+
+static double check_seconds(void){
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int print_count_fix(int record_count, int bitmap_count, int record_type, int bitmap_type){
+    int difference = abs(record_count - bitmap_count);
+    switch (record_type) {
+        case SUPER_BLOCK:
+            printf("Fixed: superblock's ");
+            break;
+        case GROUP_DESC:
+            printf("Fixed: block group's ");
+            break;
+    }
+    switch (bitmap_type) {
+        case INODE:
+            printf("free inodes counter was off by ");
+            break;
+        case BLOCK:
+            printf("free blocks counter was off by ");
+            break;
+    }
+    printf("%d compared to the bitmap\n", difference);
+    return difference;
+}
+
+/*
+Prints a finding of a dry run as a JSON line: its category, the inode and
+block it is about (0 for none), how many things it covers, and the fix a
+real run would make, formatted from format.
+*/
+static void report_finding(const char *category, unsigned int inode, unsigned int block, long count, const char *format, ...){
+    char fix[256];
+    va_list args;
+    va_start(args, format);
+    vsnprintf(fix, sizeof(fix), format, args);
+    va_end(args);
+    printf("{\"category\":\"%s\",\"inode\":%u,\"block\":%u,\"count\":%ld,\"fix\":\"%s\"}\n", category, inode, block, count, fix);
+}
+
+/*
+Check (a) for one counter, record_count as kept by the superblock or group
+(record_type), against bitmap_count from the bitmap. Reports a mismatch and
+returns how far off the counter is; setting it is up to the caller.
+*/
+static int check_count(CheckState *state, int record_count, int bitmap_count, int record_type, int bitmap_type, int group){
+    if(record_count == bitmap_count){
+        return 0;
+    }
+    if(!state->dry_run){
+        return print_count_fix(record_count, bitmap_count, record_type, bitmap_type);
+    }
+    const char *category = bitmap_type == INODE ? "free_inodes_count" : "free_blocks_count";
+    int difference = abs(record_count - bitmap_count);
+    if(record_type == SUPER_BLOCK){
+        report_finding(category, 0, 0, difference, "set the superblock's count from %d to %d", record_count, bitmap_count);
+    }else{
+        report_finding(category, 0, 0, difference, "set group %d's count from %d to %d", group, record_count, bitmap_count);
+    }
+    return difference;
+}
+
+/*
+Check (a): the free inode and block counters of every group and of the
+superblock against the bitmaps, each bitmap counted in one popcount pass.
+Counters that are off are set to what the bitmaps say.
+*/
+static int check_free_counts(CheckState *state){
+    ext2_fs *fs = state->fs;
+    struct ext2_super_block* super_block = get_super_block(fs);
+    unsigned int free_inode_count = 0, free_block_count = 0;
+    int total_fixes = 0, off;
+
+    for(int g = 0; g < fs->geometry.group_count; g++){
+        struct ext2_group_desc *group_descriptor = get_group_descriptor(fs, g);
+        unsigned int group_free_inodes = bitmap_count_zero(get_inode_bitmap(fs, g), fs->geometry.inodes_per_group);
+        unsigned int group_free_blocks = bitmap_count_zero(get_block_bitmap(fs, g), group_block_count(fs, g));
+
+        if((off = check_count(state, group_descriptor->bg_free_inodes_count, group_free_inodes, GROUP_DESC, INODE, g)) && !state->dry_run){
+            group_descriptor->bg_free_inodes_count = group_free_inodes;
+            mark_dirty(fs, group_descriptor, sizeof(struct ext2_group_desc));
+        }
+        total_fixes += off;
+        if((off = check_count(state, group_descriptor->bg_free_blocks_count, group_free_blocks, GROUP_DESC, BLOCK, g)) && !state->dry_run){
+            group_descriptor->bg_free_blocks_count = group_free_blocks;
+            mark_dirty(fs, group_descriptor, sizeof(struct ext2_group_desc));
+        }
+        total_fixes += off;
+
+        free_inode_count += group_free_inodes;
+        free_block_count += group_free_blocks;
+    }
+    if((off = check_count(state, super_block->s_free_inodes_count, free_inode_count, SUPER_BLOCK, INODE, 0)) && !state->dry_run){
+        super_block->s_free_inodes_count = free_inode_count;
+        mark_dirty(fs, super_block, sizeof(struct ext2_super_block));
+    }
+    total_fixes += off;
+    if((off = check_count(state, super_block->s_free_blocks_count, free_block_count, SUPER_BLOCK, BLOCK, 0)) && !state->dry_run){
+        super_block->s_free_blocks_count = free_block_count;
+        mark_dirty(fs, super_block, sizeof(struct ext2_super_block));
+    }
+    total_fixes += off;
+    return total_fixes;
+}
+
+/*
+The file type check (b) leaves an entry with: its inode's, when that is a
+file, directory or symbolic link.
+*/
+static int fixed_file_type(struct ext2_inode *inode, int file_type){
+    switch(inode->i_mode & 0xf000){
+        case EXT2_S_IFLNK:
+            return EXT2_FT_SYMLINK;
+        case EXT2_S_IFREG:
+            return EXT2_FT_REG_FILE;
+        case EXT2_S_IFDIR:
+            return EXT2_FT_DIR;
+    }
+    return file_type;
+}
+
+/*
+Checks (b) and (d) for the directory entry at offset in block.
+*/
+static int check_dir_entry(CheckState *state, int block, int offset){
+    ext2_fs *fs = state->fs;
+    int fix_count = 0;
+    struct ext2_dir_entry *dir_entry = (struct ext2_dir_entry *)(get_block(fs, block) + offset);
+    struct ext2_inode *inode = get_inode(fs, dir_entry->inode);
+
+    //b
+    int type_match =  FALSE;
+    unsigned int mode_mask = 0xf000;
+    unsigned int mode = (inode->i_mode & mode_mask);
+    switch (mode) {
+        case EXT2_S_IFLNK:
+            if(dir_entry->file_type == EXT2_FT_SYMLINK){
+                type_match = TRUE;
+            }
+            break;
+        case EXT2_S_IFREG:
+            if(dir_entry->file_type == EXT2_FT_REG_FILE){
+                type_match = TRUE;
+            }
+            break;
+        case EXT2_S_IFDIR:
+            if(dir_entry->file_type == EXT2_FT_DIR){
+                type_match = TRUE;
+            }
+            break;
+    }
+    if(!type_match && state->dry_run){
+        report_finding("entry_type", dir_entry->inode, block, 1, "set the entry's file type from %d to %d", dir_entry->file_type,
+            fixed_file_type(inode, dir_entry->file_type));
+        fix_count++;
+    }else if(!type_match){
+        switch (mode) {
+            case EXT2_S_IFLNK:
+                dir_entry->file_type = EXT2_FT_SYMLINK;
+                break;
+            case EXT2_S_IFREG:
+                dir_entry->file_type = EXT2_FT_REG_FILE;
+                break;
+            case EXT2_S_IFDIR:
+                dir_entry->file_type = EXT2_FT_DIR;
+                break;
+        }
+        mark_dirty(fs, dir_entry, sizeof(struct ext2_dir_entry));
+        printf("Fixed: Entry type vs inode mismatch: inode [%d]\n", dir_entry->inode);
+        fix_count++;
+    }
+
+    //d
+    if(inode->i_dtime != 0 && state->dry_run){
+        //A real run clears it at the first entry naming the inode.
+        if(state->dtime_reported[dir_entry->inode]){
+            return fix_count;
+        }
+        state->dtime_reported[dir_entry->inode] = TRUE;
+        report_finding("deletion_time", dir_entry->inode, 0, 1, "clear the deletion time");
+        fix_count++;
+    }else if(inode->i_dtime != 0){
+        inode->i_dtime = 0;
+        mark_dirty(fs, inode, sizeof(struct ext2_inode));
+        printf("Fixed: valid inode marked for deletion: [%d]\n", dir_entry->inode);
+        fix_count++;
+    }
+
+    return fix_count;
+}
+
+/*
+Runs fn on threads workers of state, the calling thread being the first.
+*/
+static void run_workers(CheckState *state, void *(*fn)(void*)){
+    int started = 1;
+    while(started < state->threads && pthread_create(&state->workers[started].thread, NULL, fn, &state->workers[started]) == 0){
+        started++;
+    }
+    fn(&state->workers[0]);
+    for(int t = 1; t < started; t++){
+        pthread_join(state->workers[t].thread, NULL);
+    }
+}
+
+/*
+Puts directory inode_num on the bottom of worker's stack. Returns 0 or -ENOMEM.
+*/
+static int check_push(CheckWorker *worker, unsigned int inode_num){
+    pthread_mutex_lock(&worker->lock);
+    if(worker->bottom == worker->capacity){
+        int capacity = worker->capacity ? worker->capacity * 2 : 64;
+        unsigned int *stack = realloc(worker->stack, sizeof(unsigned int) * capacity);
+        if(!stack){
+            pthread_mutex_unlock(&worker->lock);
+            return -ENOMEM;
+        }
+        worker->stack = stack;
+        worker->capacity = capacity;
+    }
+    worker->stack[worker->bottom++] = inode_num;
+    pthread_mutex_unlock(&worker->lock);
+    return 0;
+}
+
+/*
+Takes the directory last pushed on worker's own stack. Returns 1, or 0 if it
+is empty.
+*/
+static int check_pop(CheckWorker *worker, unsigned int *inode_num){
+    int found = FALSE;
+    pthread_mutex_lock(&worker->lock);
+    if(worker->bottom > worker->top){
+        *inode_num = worker->stack[--worker->bottom];
+        found = TRUE;
+    }
+    if(worker->bottom == worker->top){
+        worker->bottom = worker->top = 0;
+    }
+    pthread_mutex_unlock(&worker->lock);
+    return found;
+}
+
+/*
+Takes the oldest directory off another worker's stack, the one likeliest to
+have a big subtree under it. Returns 1, or 0 if every stack is empty.
+*/
+static int check_steal(CheckWorker *thief, unsigned int *inode_num){
+    CheckState *state = thief->state;
+    for(int t = 1; t < state->threads; t++){
+        CheckWorker *victim = &state->workers[(thief->index + t) % state->threads];
+        int found = FALSE;
+        pthread_mutex_lock(&victim->lock);
+        if(victim->bottom > victim->top){
+            *inode_num = victim->stack[victim->top++];
+            found = TRUE;
+        }
+        pthread_mutex_unlock(&victim->lock);
+        if(found){
+            thief->stolen++;
+            return TRUE;
+        }
+    }
+    return FALSE;
+}
+
+/*
+Counts a reference for the inode each live entry of directory inode_num
+names and queues the subdirectories not queued yet. Returns 0 or -ENOMEM.
+*/
+static int list_dir(CheckWorker *worker, unsigned int inode_num){
+    CheckState *state = worker->state;
+    ext2_fs *fs = state->fs;
+    BlockMapIter iter;
+    BlockExtent extent;
+    block_map_iter_init(&iter, fs, inode_num, BLOCK_MAP_PREFETCH);
+    while(block_map_next(&iter, &extent)){
+        for(unsigned int b = extent.physical; b < extent.physical + extent.length; b++){
+            unsigned char *block = get_block(fs, b);
+            int offset = 0, next;
+            for(; offset < EXT2_BLOCK_SIZE && (next = dir_block_next(block, offset)) >= 0; offset = next){
+                struct ext2_dir_entry *file = (struct ext2_dir_entry *)(block + offset);
+                if(file->name_len == 0 || file->inode == 0 || file->inode > fs->geometry.inodes_count){
+                    continue;
+                }
+                int descend = fixed_file_type(get_inode(fs, file->inode), file->file_type) == EXT2_FT_DIR && !dir_entry_is_dot(file);
+                __atomic_add_fetch(&state->references[file->inode], 1, __ATOMIC_RELAXED);
+                if(descend && !__atomic_exchange_n(&state->queued[file->inode], 1, __ATOMIC_ACQ_REL)){
+                    __atomic_add_fetch(&state->pending, 1, __ATOMIC_ACQ_REL);
+                    if(check_push(worker, file->inode) < 0){
+                        //Never queued after all: a count left behind would keep every worker waiting.
+                        __atomic_sub_fetch(&state->pending, 1, __ATOMIC_ACQ_REL);
+                        __atomic_store_n(&state->queued[file->inode], 0, __ATOMIC_RELEASE);
+                        return -ENOMEM;
+                    }
+                }
+            }
+        }
+    }
+    worker->listed++;
+    return 0;
+}
+
+/*
+Pass 1 worker: lists directories off its own stack, or stolen from another
+worker's, until none are queued or being listed anywhere.
+*/
+static void *check_list_worker(void *arg){
+    CheckWorker *worker = arg;
+    CheckState *state = worker->state;
+    unsigned int inode_num;
+    while(__atomic_load_n(&state->pending, __ATOMIC_ACQUIRE) > 0){
+        if(!check_pop(worker, &inode_num) && !check_steal(worker, &inode_num)){
+            sched_yield();
+            continue;
+        }
+        if(list_dir(worker, inode_num) < 0){
+            __atomic_store_n(&state->failed, TRUE, __ATOMIC_RELAXED);
+        }
+        __atomic_sub_fetch(&state->pending, 1, __ATOMIC_ACQ_REL);
+    }
+    return NULL;
+}
+
+/*
+Returns whether group keeps a copy of the superblock and group descriptors:
+all of them do, unless the sparse_super feature leaves the copies to groups
+0, 1 and the powers of 3, 5 and 7.
+*/
+static int group_has_super(ext2_fs *fs, unsigned int group){
+    if(!(get_super_block(fs)->s_feature_ro_compat & EXT2_FEATURE_RO_COMPAT_SPARSE_SUPER) || group <= 1){
+        return TRUE;
+    }
+    for(unsigned int base = 3; base <= 7; base += 2){
+        unsigned long power = base;
+        while(power < group){
+            power *= base;
+        }
+        if(power == group){
+            return TRUE;
+        }
+    }
+    return FALSE;
+}
+
+/*
+Sets the bits of the blocks the file system keeps for itself in the metadata
+bitmap: each group's superblock and descriptor copy (with the descriptor
+blocks reserved for growing), its two bitmaps and its inode table.
+*/
+static void mark_metadata(CheckState *state){
+    ext2_fs *fs = state->fs;
+    unsigned int first_data_block = fs->geometry.first_data_block;
+    unsigned long descriptor_blocks = (fs->geometry.group_count * sizeof(struct ext2_group_desc) + EXT2_BLOCK_SIZE - 1) / EXT2_BLOCK_SIZE;
+    unsigned long table_blocks = ((unsigned long)fs->geometry.inodes_per_group * fs->geometry.inode_size + EXT2_BLOCK_SIZE - 1) / EXT2_BLOCK_SIZE;
+    unsigned long nbits = fs->geometry.blocks_count - first_data_block;
+    for(int g = 0; g < fs->geometry.group_count; g++){
+        struct ext2_group_desc *group_descriptor = get_group_descriptor(fs, g);
+        unsigned int blocks[3] = {group_descriptor->bg_block_bitmap, group_descriptor->bg_inode_bitmap, group_descriptor->bg_inode_table};
+        unsigned long counts[3] = {1, 1, table_blocks};
+        if(group_has_super(fs, g)){
+            unsigned long bit = (unsigned long)g * fs->geometry.blocks_per_group;
+            unsigned long count = 1 + descriptor_blocks + get_super_block(fs)->s_reserved_gdt_blocks;
+            bitmap_set_range(state->metadata, bit, bit + count <= nbits ? count : nbits - bit);
+        }
+        for(int m = 0; m < 3; m++){
+            if(blocks[m] >= first_data_block && blocks[m] - first_data_block + counts[m] <= nbits){
+                bitmap_set_range(state->metadata, blocks[m] - first_data_block, counts[m]);
+            }
+        }
+    }
+}
+
+/*
+Remembers that worker found block claimed before inode_num reached it.
+*/
+static void record_duplicate(CheckWorker *worker, unsigned int block, unsigned int inode_num){
+    if(worker->duplicate_count == worker->duplicate_capacity){
+        int capacity = worker->duplicate_capacity ? worker->duplicate_capacity * 2 : 16;
+        DuplicateBlock *duplicates = realloc(worker->duplicates, sizeof(DuplicateBlock) * capacity);
+        if(!duplicates){
+            __atomic_store_n(&worker->state->failed, TRUE, __ATOMIC_RELAXED);
+            return;
+        }
+        worker->duplicates = duplicates;
+        worker->duplicate_capacity = capacity;
+    }
+    worker->duplicates[worker->duplicate_count++] = (DuplicateBlock){block, inode_num};
+}
+
+/*
+Claims the length blocks from block in the shadow block bitmap for inode_num,
+the whole run at once when none of it is taken, or bit by bit to find the
+ones that are. The resize inode maps the reserved descriptor blocks, which
+are metadata already, so those aren't duplicates.
+*/
+static void claim_extent(CheckWorker *worker, unsigned int inode_num, unsigned int block, unsigned int length){
+    CheckState *state = worker->state;
+    unsigned long bit = block - state->fs->geometry.first_data_block;
+    if(bitmap_claim_range(state->shadow_blocks, bit, length)){
+        return;
+    }
+    for(unsigned long b = bit; b < bit + length; b++){
+        unsigned char mask = 1 << (b % 8);
+        if(inode_num == EXT2_RESIZE_INO && (state->metadata[b / 8] & mask)){
+            continue;
+        }
+        if(__atomic_fetch_or(&state->shadow_blocks[b / 8], mask, __ATOMIC_ACQ_REL) & mask){
+            record_duplicate(worker, block + (b - bit), inode_num);
+        }
+    }
+}
+
+/*
+Pass 2 worker: takes chunks of the inode table until there are none left.
+Every inode a directory names, and every reserved one, goes in the shadow
+inode bitmap, and the blocks its map reaches (index blocks included) are
+claimed in the shadow block bitmap, counting those the on-disk bitmap has
+clear.
+*/
+static void *check_inode_table(void *arg){
+    CheckWorker *worker = arg;
+    CheckState *state = worker->state;
+    ext2_fs *fs = state->fs;
+    unsigned int first;
+    while((first = __atomic_fetch_add(&state->next_inode, CHECK_INODE_CHUNK, __ATOMIC_RELAXED)) <= fs->geometry.inodes_count){
+        unsigned int last = first + CHECK_INODE_CHUNK <= fs->geometry.inodes_count ? first + CHECK_INODE_CHUNK : fs->geometry.inodes_count + 1;
+        for(unsigned int i = first; i < last; i++){
+            if(i >= state->first_ino && state->references[i] == 0){
+                continue;
+            }
+            __atomic_fetch_or(&state->shadow_inodes[(i - 1) / 8], 1 << ((i - 1) % 8), __ATOMIC_RELAXED);
+            BlockMapIter iter;
+            BlockExtent extent;
+            block_map_iter_init(&iter, fs, i, BLOCK_MAP_INDEX);
+            while(block_map_next(&iter, &extent)){
+                claim_extent(worker, i, extent.physical, extent.length);
+                if(check_bitmap_range_clear(fs, extent.physical, extent.length, BLOCK)){
+                    for(unsigned int b = extent.physical; b < extent.physical + extent.length; b++){
+                        state->unmarked[i] += check_bitmap(fs, b, BLOCK) == 0;
+                    }
+                }
+            }
+        }
+    }
+    return NULL;
+}
+
+/*
+Pass 3 visitor: the entry checks, depth first from the root the way the
+checker always has walked, each entry checked before the walk goes into it.
+The walk goes by the type check (b) leaves the entry with, which pass 1
+followed too.
+*/
+static int check_walk_entry(ext2_fs *fs, WalkEntry *entry, void *arg){
+    CheckState *state = arg;
+    state->entry_fixes += check_dir_entry(state, entry->block, entry->offset);
+    entry->file_type = fixed_file_type(get_inode(fs, entry->inode), entry->file_type);
+    return WALK_CONTINUE;
+}
+
+/*
+Sets the links count of every inode a directory names to the number of
+entries naming it. Returns the number of fixes.
+*/
+static int check_links(CheckState *state){
+    ext2_fs *fs = state->fs;
+    int fix_count = 0;
+    for(unsigned int i = 1; i <= fs->geometry.inodes_count; i++){
+        if(state->references[i] == 0){
+            continue;
+        }
+        struct ext2_inode *inode = get_inode(fs, i);
+        if(inode->i_links_count != state->references[i] && state->dry_run){
+            report_finding("links_count", i, 0, 1, "set the links count from %d to %d", inode->i_links_count, state->references[i]);
+            fix_count++;
+        }else if(inode->i_links_count != state->references[i]){
+            printf("Fixed: inode [%d] links count was %d, but %d entries name it\n", i, inode->i_links_count, state->references[i]);
+            inode->i_links_count = state->references[i];
+            mark_dirty(fs, inode, sizeof(struct ext2_inode));
+            fix_count++;
+        }
+    }
+    return fix_count;
+}
+
+/*
+Called by diff_bitmap for an inode the shadow and on-disk bitmaps disagree
+on. One in use but not marked gets marked; one marked that no directory
+names is freed. Returns the number of fixes.
+*/
+static int inode_differs(CheckState *state, unsigned int inode_num, int in_use){
+    if(state->dry_run){
+        report_finding(in_use ? "inode_unmarked" : "inode_leaked", inode_num, 0, 1, in_use ? "mark the inode in use" : "free the inode");
+        return 1;
+    }
+    if(in_use){
+        printf("Fixed: inode [%d] not marked as in-use\n", inode_num);
+        return 1;
+    }
+    struct ext2_inode *inode = get_inode(state->fs, inode_num);
+    inode->i_links_count = 0;
+    inode->i_dtime = time(NULL);
+    mark_dirty(state->fs, inode, sizeof(struct ext2_inode));
+    printf("Fixed: inode [%d] marked in-use but not named by any directory, freed\n", inode_num);
+    return 1;
+}
+
+/*
+Called by diff_bitmap for a block the shadow and on-disk bitmaps disagree
+on. Blocks of inodes that were not marked were reported per inode already,
+metadata and leaked blocks are tallied for a line each. Returns the number
+of fixes.
+*/
+static int block_differs(CheckState *state, unsigned int block, int in_use){
+    unsigned long bit = block - state->fs->geometry.first_data_block;
+    if(!in_use){
+        if(state->dry_run){
+            report_finding("block_leaked", 0, block, 1, "free the block");
+        }
+        state->leaked_blocks++;
+        return 1;
+    }
+    if(state->metadata[bit / 8] & (1 << (bit % 8))){
+        if(state->dry_run){
+            report_finding("metadata_unmarked", 0, block, 1, "mark the block in use");
+        }
+        state->metadata_unmarked++;
+        return 1;
+    }
+    return 0;
+}
+
+/*
+Compares nbits of the on-disk bitmap disk with shadow 64 bits at a time,
+calls differs for each bit where they disagree with its index (first being
+bit 0's) and the shadow's value, then copies the shadow's bits over unless it
+is a dry run. Adds the fixes differs reports to *fix_count and returns how
+many bits were set minus how many were cleared.
+*/
+static long diff_bitmap(CheckState *state, unsigned char *disk, const unsigned char *shadow, unsigned long nbits, unsigned int first,
+                        int (*differs)(CheckState*, unsigned int, int), int *fix_count){
+    long delta = 0;
+    for(unsigned long bit = 0; bit < nbits; bit += 64){
+        size_t bytes = nbits - bit >= 64 ? 8 : (nbits - bit + 7) / 8;
+        uint64_t disk_word = 0, shadow_word = 0;
+        memcpy(&disk_word, disk + bit / 8, bytes);
+        memcpy(&shadow_word, shadow + bit / 8, bytes);
+        uint64_t difference = disk_word ^ shadow_word;
+        if(nbits - bit < 64){
+            difference &= (1ULL << (nbits - bit)) - 1;
+        }
+        if(!difference){
+            continue;
+        }
+        for(uint64_t rest = difference; rest; rest &= rest - 1){
+            int b = __builtin_ctzll(rest);
+            int in_use = (shadow_word >> b) & 1;
+            *fix_count += differs(state, first + bit + b, in_use);
+            delta += in_use ? 1 : -1;
+        }
+        if(state->dry_run){
+            continue;
+        }
+        disk_word ^= difference;
+        memcpy(disk + bit / 8, &disk_word, bytes);
+        mark_dirty(state->fs, disk + bit / 8, bytes);
+    }
+    return delta;
+}
+
+/*
+Makes the on-disk bitmaps match the shadow ones group by group, moving the
+free counters along. Returns the number of fixes.
+*/
+static int check_bitmaps(CheckState *state){
+    ext2_fs *fs = state->fs;
+    int fix_count = 0;
+    for(unsigned int i = 1; i <= fs->geometry.inodes_count; i++){
+        if(state->unmarked[i] > 0 && state->dry_run){
+            report_finding("blocks_unmarked", i, 0, state->unmarked[i], "mark %d blocks in use", state->unmarked[i]);
+            fix_count += state->unmarked[i];
+        }else if(state->unmarked[i] > 0){
+            printf("Fixed: %d in-use data blocks not marked in data bitmap for inode: [%d]\n", state->unmarked[i], i);
+            fix_count += state->unmarked[i];
+        }
+    }
+    for(int g = 0; g < fs->geometry.group_count; g++){
+        unsigned long inode_bit = (unsigned long)g * fs->geometry.inodes_per_group;
+        long delta = diff_bitmap(state, get_inode_bitmap(fs, g), state->shadow_inodes + inode_bit / 8, fs->geometry.inodes_per_group,
+                                 inode_bit + 1, inode_differs, &fix_count);
+        if(delta != 0 && !state->dry_run){
+            update_free_count(fs, inode_bit + 1, -delta, INODE);
+        }
+        unsigned long block_bit = (unsigned long)g * fs->geometry.blocks_per_group;
+        delta = diff_bitmap(state, get_block_bitmap(fs, g), state->shadow_blocks + block_bit / 8, group_block_count(fs, g),
+                            block_bit + fs->geometry.first_data_block, block_differs, &fix_count);
+        if(delta != 0 && !state->dry_run){
+            update_free_count(fs, block_bit + fs->geometry.first_data_block, -delta, BLOCK);
+        }
+    }
+    if(state->metadata_unmarked > 0 && !state->dry_run){
+        printf("Fixed: %ld file system metadata blocks not marked in data bitmap\n", state->metadata_unmarked);
+    }
+    if(state->leaked_blocks > 0 && !state->dry_run){
+        printf("Fixed: %ld blocks marked in-use but not used by any inode, freed\n", state->leaked_blocks);
+    }
+    return fix_count;
+}
+
+static int compare_blocks(const void *a, const void *b){
+    unsigned int x = *(const unsigned int*)a, y = *(const unsigned int*)b;
+    return x < y ? -1 : x > y;
+}
+
+static int compare_duplicates(const void *a, const void *b){
+    const DuplicateBlock *x = a, *y = b;
+    if(x->block != y->block){
+        return x->block < y->block ? -1 : 1;
+    }
+    return x->inode < y->inode ? -1 : x->inode > y->inode;
+}
+
+/*
+Reports each block claimed more than once with every owner it has, found by
+walking the maps of the inodes pass 2 walked again. These are left alone:
+which owner should keep the block is for a person to say. Returns how many
+blocks there are, or -ENOMEM.
+*/
+static int report_duplicates(CheckState *state){
+    ext2_fs *fs = state->fs;
+    int count = 0;
+    for(int t = 0; t < state->threads; t++){
+        count += state->workers[t].duplicate_count;
+    }
+    if(count == 0){
+        return 0;
+    }
+    unsigned int *blocks = malloc(sizeof(unsigned int) * count);
+    int owner_count = 0, owner_capacity = count * 2;
+    DuplicateBlock *owners = malloc(sizeof(DuplicateBlock) * owner_capacity);
+    if(!blocks || !owners){
+        free(blocks);
+        free(owners);
+        return -ENOMEM;
+    }
+    int distinct = 0;
+    for(int t = 0; t < state->threads; t++){
+        for(int d = 0; d < state->workers[t].duplicate_count; d++){
+            blocks[distinct++] = state->workers[t].duplicates[d].block;
+        }
+    }
+    qsort(blocks, distinct, sizeof(unsigned int), compare_blocks);
+    int kept = 0;
+    for(int d = 0; d < distinct; d++){
+        if(kept == 0 || blocks[kept - 1] != blocks[d]){
+            blocks[kept++] = blocks[d];
+        }
+    }
+    distinct = kept;
+
+    for(unsigned int i = 1; i <= fs->geometry.inodes_count; i++){
+        unsigned int bit = i - 1;
+        if(!(state->shadow_inodes[bit / 8] & (1 << (bit % 8)))){
+            continue;
+        }
+        BlockMapIter iter;
+        BlockExtent extent;
+        block_map_iter_init(&iter, fs, i, BLOCK_MAP_INDEX);
+        while(block_map_next(&iter, &extent)){
+            //First duplicate at or past the start of the extent.
+            int low = 0, high = distinct;
+            while(low < high){
+                int middle = (low + high) / 2;
+                if(blocks[middle] < extent.physical){
+                    low = middle + 1;
+                }else{
+                    high = middle;
+                }
+            }
+            for(; low < distinct && blocks[low] < extent.physical + extent.length; low++){
+                if(owner_count == owner_capacity){
+                    owner_capacity *= 2;
+                    DuplicateBlock *grown = realloc(owners, sizeof(DuplicateBlock) * owner_capacity);
+                    if(!grown){
+                        free(blocks);
+                        free(owners);
+                        return -ENOMEM;
+                    }
+                    owners = grown;
+                }
+                owners[owner_count++] = (DuplicateBlock){blocks[low], i};
+            }
+        }
+    }
+    qsort(owners, owner_count, sizeof(DuplicateBlock), compare_duplicates);
+
+    for(int d = 0, o = 0; d < distinct; d++){
+        unsigned long bit = blocks[d] - fs->geometry.first_data_block;
+        int metadata = (state->metadata[bit / 8] & (1 << (bit % 8))) != 0;
+        if(state->dry_run){
+            //A line per owner, inode 0 being the file system's metadata.
+            if(metadata){
+                report_finding("duplicate_block", 0, blocks[d], 1, "none");
+            }
+            for(; o < owner_count && owners[o].block == blocks[d]; o++){
+                if(owners[o].inode != EXT2_RESIZE_INO || !metadata){
+                    report_finding("duplicate_block", owners[o].inode, blocks[d], 1, "none");
+                }
+            }
+            continue;
+        }
+        printf("Found: block [%u] claimed by", blocks[d]);
+        const char *separator = "";
+        if(metadata){
+            printf(" file system metadata");
+            separator = ",";
+        }
+        for(; o < owner_count && owners[o].block == blocks[d]; o++){
+            if(owners[o].inode == EXT2_RESIZE_INO && *separator){
+                continue;
+            }
+            printf("%s inode [%d]", separator, owners[o].inode);
+            separator = ",";
+        }
+        printf(", not fixed\n");
+    }
+    free(blocks);
+    free(owners);
+    return distinct;
+}
+
+static void check_state_free(CheckState *state){
+    for(int t = 0; state->workers && t < state->threads; t++){
+        pthread_mutex_destroy(&state->workers[t].lock);
+        free(state->workers[t].stack);
+        free(state->workers[t].duplicates);
+    }
+    free(state->workers);
+    free(state->queued);
+    free(state->references);
+    free(state->shadow_inodes);
+    free(state->shadow_blocks);
+    free(state->metadata);
+    free(state->unmarked);
+    free(state->dtime_reported);
+}
+
+/*
+Runs every check over the image, with threads threads for passes 1 and 2.
+Returns the number of fixes made, or -ENOMEM, and sets *unfixed to the number
+of problems found but left alone.
+*/
+int check_image(ext2_fs *fs, int threads, int flags, int *unfixed){
+    unsigned int inodes = fs->geometry.inodes_count + 1;
+    //Whole words for both shadow bitmaps, so the claims never run past them.
+    size_t inode_bytes = (fs->geometry.inodes_count + 63) / 64 * 8;
+    size_t block_bytes = (fs->geometry.blocks_count - fs->geometry.first_data_block + 63) / 64 * 8;
+    struct ext2_super_block *super_block = get_super_block(fs);
+    CheckState state = {.fs = fs, .threads = threads > 0 ? threads : 1, .dry_run = (flags & CHECK_DRY_RUN) != 0, .next_inode = 1};
+    state.first_ino = super_block->s_rev_level > 0 ? super_block->s_first_ino : EXT2_GOOD_OLD_FIRST_INO;
+    state.workers = calloc(state.threads, sizeof(CheckWorker));
+    state.queued = calloc(inodes, 1);
+    state.references = calloc(inodes, sizeof(unsigned int));
+    state.shadow_inodes = calloc(inode_bytes, 1);
+    state.shadow_blocks = calloc(block_bytes, 1);
+    state.metadata = calloc(block_bytes, 1);
+    state.unmarked = calloc(inodes, sizeof(unsigned int));
+    state.dtime_reported = state.dry_run ? calloc(inodes, 1) : NULL;
+    *unfixed = 0;
+    if(!state.workers || !state.queued || !state.references || !state.shadow_inodes || !state.shadow_blocks
+       || !state.metadata || !state.unmarked || (state.dry_run && !state.dtime_reported)){
+        check_state_free(&state);
+        return -ENOMEM;
+    }
+    for(int t = 0; t < state.threads; t++){
+        state.workers[t].state = &state;
+        state.workers[t].index = t;
+        pthread_mutex_init(&state.workers[t].lock, NULL);
+    }
+
+    double start = check_seconds();
+    int fix_count = check_free_counts(&state);
+    double counted = check_seconds();
+
+    state.queued[EXT2_ROOT_INO] = TRUE;
+    state.pending = 1;
+    if(check_push(&state.workers[0], EXT2_ROOT_INO) < 0){
+        check_state_free(&state);
+        return -ENOMEM;
+    }
+    run_workers(&state, check_list_worker);
+    double listed = check_seconds();
+
+    mark_metadata(&state);
+    memcpy(state.shadow_blocks, state.metadata, block_bytes);
+    run_workers(&state, check_inode_table);
+    double scanned = check_seconds();
+    if(state.failed){
+        check_state_free(&state);
+        return -ENOMEM;
+    }
+
+    TreeWalk walk = {.order = WALK_DFS, .flags = WALK_ONCE | WALK_DOTS, .visit = check_walk_entry, .arg = &state};
+    int walked = tree_walk(fs, EXT2_ROOT_INO, &walk, NULL);
+    if(walked < 0){
+        check_state_free(&state);
+        return walked;
+    }
+    fix_count += state.entry_fixes;
+    fix_count += check_links(&state);
+    fix_count += check_bitmaps(&state);
+    int duplicates = report_duplicates(&state);
+    double fixed = check_seconds();
+    if(duplicates < 0){
+        check_state_free(&state);
+        return duplicates;
+    }
+    *unfixed = duplicates;
+
+    if(state.dry_run){
+        double phases[] = {counted - start, listed - counted, scanned - listed, fixed - scanned};
+        const char *names[] = {"free counts", "directories", "inode table", "fixes"};
+        for(int p = 0; p < 4; p++){
+            printf("{\"category\":\"timing\",\"phase\":\"%s\",\"seconds\":%.6f}\n", names[p], phases[p]);
+        }
+    }
+    if(fs->stats){
+        long dirs = 0, stolen = 0;
+        for(int t = 0; t < state.threads; t++){
+            dirs += state.workers[t].listed;
+            stolen += state.workers[t].stolen;
+        }
+        fprintf(stderr, "free counts: %.3f s\n", counted - start);
+        fprintf(stderr, "pass 1 (directories): %.3f s, %ld listed, %ld stolen\n", listed - counted, dirs, stolen);
+        fprintf(stderr, "pass 2 (inode table): %.3f s, %d threads\n", scanned - listed, state.threads);
+        fprintf(stderr, "pass 3 (fixes): %.3f s, %ld directories walked, %ld deep at most\n", fixed - scanned, walk.dirs, walk.max_pending);
+    }
+    check_state_free(&state);
+    return fix_count;
+}
@@ -0,0 +1,45 @@
+#ifndef CHECKER_FUNCTIONS
+#define CHECKER_FUNCTIONS
+
+#include "helper.h"
+
+/*
+The consistency checks behind ext2_checker, run in phases so the expensive
+reading can be spread over threads while the fixes still come out one at a
+time, in the same order whatever the number of threads:
+
+Pass 1 reads every directory reachable from the root and counts the entries
+naming each inode. Each thread keeps its own stack of directories still to
+list and steals from the others when it runs dry, so whole subtrees move
+between threads.
+
+Pass 2 scans the inode table in chunks, one thread per chunk at a time, and
+builds shadow bitmaps of what the image should have marked: every inode
+named in pass 1 and every reserved one, the blocks their maps reach and the
+blocks the groups keep for metadata. Each inode is scanned once however many
+entries name it, and a block claimed twice is remembered as a duplicate.
+
+Pass 3 walks the tree depth first on the calling thread with tree_walk for
+the entry checks, going into each directory once. It then sets each links
+count to the entries counted and compares the on-disk bitmaps with the
+shadow ones a word at a time: bits missing are set, and inodes and blocks
+marked but used by nothing are freed. Duplicates are reported but left
+alone.
+
+check_image prints a "Fixed:" line per repair and returns how many it made,
+with the number of duplicate blocks in its last argument. With fs->stats it
+also reports the time each phase took on stderr.
+
+With CHECK_DRY_RUN nothing in the image is touched, so it can be loaded with
+IMAGE_HINT_READ_ONLY. Each finding is printed as a JSON line instead, with
+its category, inode, block, count and the fix a real run would make, followed
+by a "timing" line per phase. The counts returned are what a real run would
+fix. Findings that only show up after an earlier fix (a counter moved by
+the bitmap diff, say) are not predicted.
+*/
+
+#define CHECK_DRY_RUN 1
+
+int check_image(ext2_fs*, int, int, int*);
+
+#endif
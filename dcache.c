@@ -0,0 +1,215 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "dcache.h"
+
+typedef struct dcache_entry {
+    struct dcache_entry *next;
+    unsigned int hash;
+    int parent_inode_num;
+    int block_num;
+    int offset;
+    int name_len;
+    char name[];
+} DcacheEntry;
+
+/*
+FNV-1a over the name, seeded with the parent inode number.
+*/
+static unsigned int dcache_hash(int parent_inode_num, const char *name, int name_len){
+    unsigned int hash = 2166136261u ^ (unsigned int)parent_inode_num;
+    hash *= 16777619u;
+    for(int i = 0; i < name_len; i++){
+        hash ^= (unsigned char)name[i];
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+/*
+Doubles the bucket array once the chains average more than one entry.
+*/
+static void dcache_grow(Dcache *cache){
+    unsigned int new_count = cache->bucket_count ? cache->bucket_count * 2 : 256;
+    DcacheEntry **new_buckets = calloc(new_count, sizeof(DcacheEntry*));
+    if(!new_buckets){
+        return;
+    }
+    for(unsigned int b = 0; b < cache->bucket_count; b++){
+        DcacheEntry *entry = cache->buckets[b];
+        while(entry){
+            DcacheEntry *next = entry->next;
+            entry->next = new_buckets[entry->hash & (new_count - 1)];
+            new_buckets[entry->hash & (new_count - 1)] = entry;
+            entry = next;
+        }
+    }
+    free(cache->buckets);
+    cache->buckets = new_buckets;
+    cache->bucket_count = new_count;
+}
+
+static DcacheEntry **dcache_find(Dcache *cache, unsigned int hash, int parent_inode_num, const char *name, int name_len){
+    if(!cache->buckets){
+        return NULL;
+    }
+    DcacheEntry **link = &cache->buckets[hash & (cache->bucket_count - 1)];
+    while(*link){
+        DcacheEntry *entry = *link;
+        if(entry->hash == hash && entry->parent_inode_num == parent_inode_num
+            && entry->name_len == name_len && memcmp(entry->name, name, name_len) == 0){
+            return link;
+        }
+        link = &entry->next;
+    }
+    return NULL;
+}
+
+static void dcache_drop_entries(Dcache*);
+
+/*
+Starts an empty cache.
+*/
+void dcache_init(Dcache *cache){
+    cache->buckets = NULL;
+    cache->bucket_count = 0;
+    cache->entry_count = 0;
+    pthread_mutex_init(&cache->lock, NULL);
+}
+
+/*
+Looks up name in directory parent_inode_num. Returns DCACHE_HIT and fills in
+block_num and offset, DCACHE_NEGATIVE if the name is known to be missing, or
+DCACHE_MISS if the directory has to be searched.
+*/
+int dcache_lookup(Dcache *cache, int parent_inode_num, const char *name, int name_len, int *block_num, int *offset){
+    unsigned int hash = dcache_hash(parent_inode_num, name, name_len);
+    int found = DCACHE_MISS;
+    pthread_mutex_lock(&cache->lock);
+    DcacheEntry **link = dcache_find(cache, hash, parent_inode_num, name, name_len);
+    if(link && (*link)->block_num == 0){
+        found = DCACHE_NEGATIVE;
+    }else if(link){
+        *block_num = (*link)->block_num;
+        *offset = (*link)->offset;
+        found = DCACHE_HIT;
+    }
+    pthread_mutex_unlock(&cache->lock);
+    return found;
+}
+
+/*
+Records that name in directory parent_inode_num lives at offset inside block
+block_num, replacing whatever was known about it.
+*/
+void dcache_insert(Dcache *cache, int parent_inode_num, const char *name, int name_len, int block_num, int offset){
+    unsigned int hash = dcache_hash(parent_inode_num, name, name_len);
+    pthread_mutex_lock(&cache->lock);
+    DcacheEntry **link = dcache_find(cache, hash, parent_inode_num, name, name_len);
+    if(link){
+        (*link)->block_num = block_num;
+        (*link)->offset = offset;
+        pthread_mutex_unlock(&cache->lock);
+        return;
+    }
+    if(cache->entry_count >= DCACHE_MAX_ENTRIES){
+        dcache_drop_entries(cache);
+    }
+    if(cache->entry_count >= cache->bucket_count){
+        dcache_grow(cache);
+    }
+    DcacheEntry *entry = cache->buckets ? malloc(sizeof(DcacheEntry) + name_len) : NULL;
+    if(entry){
+        entry->hash = hash;
+        entry->parent_inode_num = parent_inode_num;
+        entry->block_num = block_num;
+        entry->offset = offset;
+        entry->name_len = name_len;
+        memcpy(entry->name, name, name_len);
+        entry->next = cache->buckets[hash & (cache->bucket_count - 1)];
+        cache->buckets[hash & (cache->bucket_count - 1)] = entry;
+        cache->entry_count++;
+    }
+    pthread_mutex_unlock(&cache->lock);
+}
+
+/*
+Records that name is not in directory parent_inode_num.
+*/
+void dcache_insert_negative(Dcache *cache, int parent_inode_num, const char *name, int name_len){
+    dcache_insert(cache, parent_inode_num, name, name_len, 0, 0);
+}
+
+/*
+Forgets whatever is known about name in directory parent_inode_num.
+*/
+void dcache_invalidate(Dcache *cache, int parent_inode_num, const char *name, int name_len){
+    unsigned int hash = dcache_hash(parent_inode_num, name, name_len);
+    pthread_mutex_lock(&cache->lock);
+    DcacheEntry **link = dcache_find(cache, hash, parent_inode_num, name, name_len);
+    if(link){
+        DcacheEntry *entry = *link;
+        *link = entry->next;
+        free(entry);
+        cache->entry_count--;
+    }
+    pthread_mutex_unlock(&cache->lock);
+}
+
+/*
+Forgets every name in directory parent_inode_num, for when the directory
+itself goes away and its inode number may come back as another one.
+*/
+void dcache_invalidate_dir(Dcache *cache, int parent_inode_num){
+    pthread_mutex_lock(&cache->lock);
+    for(unsigned int b = 0; b < cache->bucket_count && cache->entry_count > 0; b++){
+        DcacheEntry **link = &cache->buckets[b];
+        while(*link){
+            DcacheEntry *entry = *link;
+            if(entry->parent_inode_num == parent_inode_num){
+                *link = entry->next;
+                free(entry);
+                cache->entry_count--;
+            }else{
+                link = &entry->next;
+            }
+        }
+    }
+    pthread_mutex_unlock(&cache->lock);
+}
+
+/*
+Frees every entry, keeping the bucket array. The caller holds the lock.
+*/
+static void dcache_drop_entries(Dcache *cache){
+    for(unsigned int b = 0; b < cache->bucket_count; b++){
+        DcacheEntry *entry = cache->buckets[b];
+        while(entry){
+            DcacheEntry *next = entry->next;
+            free(entry);
+            entry = next;
+        }
+        cache->buckets[b] = NULL;
+    }
+    cache->entry_count = 0;
+}
+
+/*
+Drops every entry, keeping the bucket array for reuse.
+*/
+void dcache_clear(Dcache *cache){
+    pthread_mutex_lock(&cache->lock);
+    dcache_drop_entries(cache);
+    pthread_mutex_unlock(&cache->lock);
+}
+
+/*
+Drops every entry and the bucket array, leaving an empty cache.
+*/
+void dcache_destroy(Dcache *cache){
+    dcache_clear(cache);
+    free(cache->buckets);
+    cache->buckets = NULL;
+    cache->bucket_count = 0;
+    pthread_mutex_destroy(&cache->lock);
+}
@@ -0,0 +1,46 @@
+#ifndef DCACHE_FUNCTIONS
+#define DCACHE_FUNCTIONS
+
+/*
+Directory entry cache for path resolution. Entries are keyed by the parent
+directory's inode number and the entry name, and remember where the entry
+lives (block number and offset inside it) rather than its contents, so fixes
+made in place (file type, inode fields) never go stale. A block number of 0
+records that the name is known to be absent.
+
+Anything that adds, removes or moves a directory entry must update the cache
+through dcache_insert or dcache_invalidate, and freeing a directory's inode
+drops its entries through dcache_invalidate_dir. A hit is still checked
+against the block it names before it is trusted.
+
+Each open image has its own cache, set up by dcache_init. Every call takes
+the cache's mutex, so threads sharing an image can use it at once; keeping an
+entry in step with its directory is up to the directory's lock.
+*/
+
+#include <pthread.h>
+
+//Past this many entries the cache is emptied and starts filling again.
+#define DCACHE_MAX_ENTRIES 65536
+
+#define DCACHE_MISS 0
+#define DCACHE_HIT 1
+#define DCACHE_NEGATIVE 2
+
+typedef struct dcache {
+    struct dcache_entry **buckets;
+    unsigned int bucket_count;
+    unsigned int entry_count;
+    pthread_mutex_t lock;
+} Dcache;
+
+void dcache_init(Dcache*);
+int dcache_lookup(Dcache*, int, const char*, int, int*, int*);
+void dcache_insert(Dcache*, int, const char*, int, int, int);
+void dcache_insert_negative(Dcache*, int, const char*, int);
+void dcache_invalidate(Dcache*, int, const char*, int);
+void dcache_invalidate_dir(Dcache*, int);
+void dcache_clear(Dcache*);
+void dcache_destroy(Dcache*);
+
+#endif
@@ -0,0 +1,135 @@
+#include <errno.h>
+#include <string.h>
+
+#include "dirblock.h"
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+/*
+Prepares name (len bytes, no terminator needed) for matching.
+*/
+void dir_name_key_init(DirNameKey *key, const char *name, int len){
+    key->name = name;
+    key->len = len;
+    memset(key->prefix, 0, sizeof(key->prefix));
+    memcpy(key->prefix, name, len < 16 ? len : 16);
+}
+
+/*
+Smallest rec_len an entry with a name of name_len bytes can have.
+*/
+int dir_rec_len(int name_len){
+    return (8 + name_len + 3) & ~3;
+}
+
+/*
+Returns the offset of the entry following the one at offset, EXT2_BLOCK_SIZE
+after the last entry, or -1 if the entry at offset is corrupt.
+*/
+int dir_block_next(const unsigned char *block, int offset){
+    if(offset + 8 > EXT2_BLOCK_SIZE){
+        return -1;
+    }
+    const struct ext2_dir_entry *entry = (const struct ext2_dir_entry *)(block + offset);
+    if(entry->rec_len < 8 || (entry->rec_len & 3) || offset + entry->rec_len > EXT2_BLOCK_SIZE
+        || 8 + entry->name_len > entry->rec_len){
+        return -1;
+    }
+    return offset + entry->rec_len;
+}
+
+/*
+Returns 1 if the entry at offset is named exactly like key.
+*/
+int dir_entry_matches(const unsigned char *block, int offset, const DirNameKey *key){
+    const struct ext2_dir_entry *entry = (const struct ext2_dir_entry *)(block + offset);
+    if(entry->name_len != key->len || key->len == 0){
+        return 0;
+    }
+    const unsigned char *name = block + offset + 8;
+#ifdef __SSE2__
+    //Only when the 16 byte load stays inside the block.
+    if(offset + 8 + 16 <= EXT2_BLOCK_SIZE){
+        __m128i found = _mm_loadu_si128((const __m128i *)name);
+        __m128i wanted = _mm_loadu_si128((const __m128i *)key->prefix);
+        unsigned int equal = _mm_movemask_epi8(_mm_cmpeq_epi8(found, wanted));
+        unsigned int needed = key->len >= 16 ? 0xffff : (1u << key->len) - 1;
+        if((equal & needed) != needed){
+            return 0;
+        }
+        return key->len <= 16 || memcmp(name + 16, key->name + 16, key->len - 16) == 0;
+    }
+#endif
+    return memcmp(name, key->name, key->len) == 0;
+}
+
+/*
+Returns 1 for the "." and ".." entries.
+*/
+int dir_entry_is_dot(const struct ext2_dir_entry *entry){
+    if(entry->name_len == 1){
+        return entry->name[0] == '.';
+    }
+    return entry->name_len == 2 && entry->name[0] == '.' && entry->name[1] == '.';
+}
+
+/*
+Looks for a live entry named like key by following the rec_len chain. Returns
+its offset and, if prev_offset is given, the offset of the entry before it (0
+for the first entry), or -ENOENT.
+*/
+int dir_block_find(const unsigned char *block, const DirNameKey *key, int *prev_offset){
+    int offset = 0, last_offset = 0;
+    while(offset + 8 <= EXT2_BLOCK_SIZE){
+        const struct ext2_dir_entry *entry = (const struct ext2_dir_entry *)(block + offset);
+        unsigned int rec_len = entry->rec_len;
+        //One test covers a rec_len that is too small, misaligned or runs off the block.
+        if(rec_len - 8 > (unsigned int)(EXT2_BLOCK_SIZE - 8 - offset) || (rec_len & 3)){
+            break;
+        }
+        if(entry->name_len == key->len && entry->inode != 0 && dir_entry_matches(block, offset, key)){
+            if(prev_offset){
+                *prev_offset = last_offset;
+            }
+            return offset;
+        }
+        last_offset = offset;
+        offset += rec_len;
+    }
+    return -ENOENT;
+}
+
+/*
+Looks for an entry named like key, removed ones included, by stepping over each
+entry's name instead of its rec_len so the gaps left by removals are searched
+too. Returns its offset and, if prev_offset is given, the offset of the live
+entry whose rec_len covers it, or -ENOENT.
+*/
+int dir_block_find_deleted(const unsigned char *block, const DirNameKey *key, int *prev_offset){
+    int offset = 0, last_real_entry = 0, next_real_entry = 0;
+    while(offset + 8 <= EXT2_BLOCK_SIZE){
+        const struct ext2_dir_entry *entry = (const struct ext2_dir_entry *)(block + offset);
+
+        //Check if we have found garbage data:
+        if(entry->name_len == 0 || entry->name_len > entry->rec_len || offset + entry->rec_len > EXT2_BLOCK_SIZE
+            || offset + dir_rec_len(entry->name_len) > EXT2_BLOCK_SIZE){
+            break;
+        }
+
+        if(dir_entry_matches(block, offset, key)){
+            if(prev_offset){
+                *prev_offset = last_real_entry;
+            }
+            return offset;
+        }
+
+        if(offset == next_real_entry){
+            last_real_entry = offset;
+            next_real_entry += entry->rec_len;
+        }
+        offset += dir_rec_len(entry->name_len);
+    }
+    return -ENOENT;
+}
@@ -0,0 +1,30 @@
+#ifndef DIRBLOCK_FUNCTIONS
+#define DIRBLOCK_FUNCTIONS
+
+#include "ext2.h"
+
+/*
+Name matching for directory blocks. A block is the raw EXT2_BLOCK_SIZE bytes
+from the image. The name being looked for is turned into a DirNameKey once, so
+each entry costs a name_len compare and, for names up to 16 bytes, a single
+vector compare against the zero padded prefix in the key.
+
+Walks stop at the first entry whose rec_len is impossible instead of running
+off the block.
+*/
+
+typedef struct dir_name_key {
+    const char *name;
+    int len;
+    unsigned char prefix[16];
+} DirNameKey;
+
+void dir_name_key_init(DirNameKey*, const char*, int);
+int dir_rec_len(int);
+int dir_block_next(const unsigned char*, int);
+int dir_entry_matches(const unsigned char*, int, const DirNameKey*);
+int dir_entry_is_dot(const struct ext2_dir_entry*);
+int dir_block_find(const unsigned char*, const DirNameKey*, int*);
+int dir_block_find_deleted(const unsigned char*, const DirNameKey*, int*);
+
+#endif
@@ -86,7 +86,7 @@ struct ext2_super_block {
 	 */
 	unsigned char  s_prealloc_blocks;     /* Nr of blocks to try to preallocate*/
 	unsigned char  s_prealloc_dir_blocks; /* Nr to preallocate for dirs */
-	unsigned short s_padding1;
+	unsigned short s_reserved_gdt_blocks; /* Per group desc for online growth */
 	/*
 	 * Journaling support valid if EXT3_FEATURE_COMPAT_HAS_JOURNAL set.
 	 */
@@ -173,6 +173,8 @@ struct ext2_inode {
  */
 /* Root inode */
 #define    EXT2_ROOT_INO         2
+/* Reserved group descriptors inode */
+#define    EXT2_RESIZE_INO       7
 /* First non-reserved inode for old ext2 filesystems */
 #define EXT2_GOOD_OLD_FIRST_INO 11
 
@@ -0,0 +1,224 @@
+#include <time.h>
+
+#include "ops.h"
+
+/*
+Runs a manifest of operations against one mapping of the image and flushes
+it once at the end. Each line of the manifest is one operation, with the same
+arguments as the matching tool:
+
+    mkdir [--index] <path>
+    cp <path to source file> <path to dest>
+    ln [-s] <path to source file> <path to dest>
+    rm <path to file>
+    restore <path to file>
+
+Arguments are separated by whitespace; one holding spaces can be put in double
+quotes, where \" and \\ stand for a quote and a backslash. Blank lines and
+lines starting with # are skipped.
+
+Every operation line gets one JSON object on stdout, in manifest order:
+
+    {"line":3,"op":"mkdir","args":["/a"],"status":17,"error":"File exists"}
+
+status is 0 or the errno the operation failed with. Diagnostics go to stderr.
+The exit status is that of the first failed operation, or 0.
+*/
+
+//No operation takes more arguments than this, counting the op name and flags.
+#define MAX_ARGS 4
+
+/*
+Splits line in place into at most max arguments. Returns the argument count,
+or -1 if there are too many or a quote is left open.
+*/
+static int split_line(char *line, char **args, int max){
+    int count = 0;
+    char *in = line;
+    while(1){
+        while(*in == ' ' || *in == '\t' || *in == '\n' || *in == '\r'){
+            in++;
+        }
+        if(*in == '\0' || (count == 0 && *in == '#')){
+            return count;
+        }
+        if(count == max){
+            return -1;
+        }
+        //Unquote into the same buffer, the result is never longer than the input.
+        char *out = in;
+        args[count++] = out;
+        int quoted = FALSE;
+        while(*in != '\0' && (quoted || (*in != ' ' && *in != '\t' && *in != '\n' && *in != '\r'))){
+            if(*in == '"'){
+                quoted = !quoted;
+                in++;
+            }else if(quoted && *in == '\\' && (in[1] == '"' || in[1] == '\\')){
+                *out++ = in[1];
+                in += 2;
+            }else{
+                *out++ = *in++;
+            }
+        }
+        if(quoted){
+            return -1;
+        }
+        if(*in != '\0'){
+            in++;
+        }
+        *out = '\0';
+    }
+}
+
+/*
+Writes s as a JSON string.
+*/
+static void print_json_string(const char *s){
+    putchar('"');
+    for(; *s; s++){
+        unsigned char c = *s;
+        if(c == '"' || c == '\\'){
+            printf("\\%c", c);
+        }else if(c < 0x20){
+            printf("\\u%04x", c);
+        }else{
+            putchar(c);
+        }
+    }
+    putchar('"');
+}
+
+/*
+Runs the operation in args. Returns 0 or a negative errno, -EINVAL if the line
+doesn't name a known operation with the right arguments.
+*/
+static int run_operation(ext2_fs *fs, char **args, int count, int manifest_is_stdin){
+    if(strcmp(args[0], "mkdir") == 0){
+        if(count == 3 && strcmp(args[1], "--index") == 0){
+            return make_directory(fs, args[2], TRUE);
+        }
+        if(count == 2){
+            return make_directory(fs, args[1], FALSE);
+        }
+    }else if(strcmp(args[0], "cp") == 0 && count == 3){
+        if(manifest_is_stdin && strcmp(args[1], "-") == 0){
+            //stdin is taken by the manifest.
+            return -EINVAL;
+        }
+        return copy_file(fs, args[1], args[2]);
+    }else if(strcmp(args[0], "ln") == 0){
+        if(count == 4 && strcmp(args[1], "-s") == 0){
+            return make_link(fs, args[2], args[3], SOFTLINK);
+        }
+        if(count == 3){
+            return make_link(fs, args[1], args[2], HARDLINK);
+        }
+    }else if(strcmp(args[0], "rm") == 0 && count == 2){
+        return remove_file(fs, args[1]);
+    }else if(strcmp(args[0], "restore") == 0 && count == 2){
+        return restore_file(fs, args[1]);
+    }
+    return -EINVAL;
+}
+
+int main(int argc, char **argv) {
+    int hints = IMAGE_HINT_RANDOM;
+    argc = parse_stats_flag(argc, argv, &hints);
+    //--stop-on-error skips the rest of the manifest after the first failure.
+    int stop_on_error = FALSE;
+    if(argc >= 2 && strcmp(argv[1], "--stop-on-error") == 0){
+        stop_on_error = TRUE;
+        argv[1] = argv[0];
+        argv++;
+        argc--;
+    }
+    if(argc != 2 && argc != 3) {
+        fprintf(stderr, "Usage: %s [--stop-on-error] <image file name> [manifest file, - or none for stdin]\n", argv[0]);
+        exit(1);
+    }
+
+    FILE *manifest = stdin;
+    if(argc == 3 && strcmp(argv[2], "-") != 0){
+        manifest = fopen(argv[2], "r");
+        if(!manifest){
+            perror("Failed to open manifest.");
+            exit(1);
+        }
+    }
+    ext2_fs *fs = load_image(argv[1], hints);
+    if(!fs){
+        perror("Failed to open disk image.");
+        exit(1);
+    }
+
+    //One line per operation as it finishes, so a reader can follow along.
+    setvbuf(stdout, NULL, _IOLBF, 0);
+
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    char *line = NULL;
+    size_t line_capacity = 0;
+    int line_num = 0, operations = 0, failures = 0, first_error = 0;
+    while(getline(&line, &line_capacity, manifest) >= 0){
+        line_num++;
+        char *args[MAX_ARGS];
+        int count = split_line(line, args, MAX_ARGS);
+        if(count == 0){
+            continue;
+        }
+        int result;
+        if(count < 0){
+            fprintf(stderr, "manifest line %d: could not split into arguments.\n", line_num);
+            result = -EINVAL;
+            count = 0;
+        }else{
+            result = run_operation(fs, args, count, manifest == stdin);
+        }
+        operations++;
+
+        printf("{\"line\":%d,\"op\":", line_num);
+        print_json_string(count > 0 ? args[0] : "");
+        printf(",\"args\":[");
+        for(int i = 1; i < count; i++){
+            if(i > 1){
+                putchar(',');
+            }
+            print_json_string(args[i]);
+        }
+        printf("],\"status\":%d,\"error\":", -result);
+        print_json_string(result < 0 ? strerror(-result) : "");
+        printf("}\n");
+
+        if(result < 0){
+            failures++;
+            if(!first_error){
+                first_error = -result;
+            }
+            if(stop_on_error){
+                break;
+            }
+        }
+    }
+    free(line);
+    if(manifest != stdin){
+        fclose(manifest);
+    }
+
+    int saved = save_image(fs);
+    if(saved < 0){
+        //Before close_image, which may leave its own errno behind.
+        perror("Failed to write disk image.");
+    }
+    close_image(fs);
+    if(saved < 0){
+        return EIO;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    if(hints & IMAGE_HINT_STATS){
+        double elapsed = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+        fprintf(stderr, "%d operations, %d failed, in %.3f s (%.0f ops/s)\n", operations, failures, elapsed,
+            elapsed > 0 ? operations / elapsed : 0.0);
+    }
+    return first_error;
+}
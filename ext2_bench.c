@@ -0,0 +1,833 @@
+#include "ops.h"
+#include "checker.h"
+#include "walk.h"
+#include <time.h>
+
+/*
+Microbenchmarks for the helper layer. Each mode prints one line per
+measurement so runs can be diffed or collected into a table.
+*/
+
+#define BENCH_GROUP_BITS 8192
+#define BENCH_EXPORT_ROUNDS 5
+#define BENCH_WALK_ROUNDS 5
+
+static double now_seconds(void){
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/*
+Builds group_count group bitmaps of BENCH_GROUP_BITS bits each, with roughly
+fill_percent of the bits set at random.
+*/
+static unsigned char *make_bitmaps(int group_count, int fill_percent){
+    unsigned char *bitmaps = calloc(group_count, BENCH_GROUP_BITS / 8);
+    srand(369);
+    for(long bit = 0; bit < (long)group_count * BENCH_GROUP_BITS; bit++){
+        if(rand() % 100 < fill_percent){
+            bitmaps[bit / 8] |= 1 << (bit % 8);
+        }
+    }
+    return bitmaps;
+}
+
+/*
+The allocator as it used to be: bit at a time from the start of group 0.
+*/
+static long legacy_alloc(unsigned char *bitmaps, int group_count){
+    for(int g = 0; g < group_count; g++){
+        unsigned char *bitmap = bitmaps + g * (BENCH_GROUP_BITS / 8);
+        for(int i = 0; i < BENCH_GROUP_BITS / 8; i++){
+            char mask = 1;
+            for(int j = 0; j < 8; j++){
+                if(!(bitmap[i] & mask)){
+                    bitmap[i] |= mask;
+                    return (long)g * BENCH_GROUP_BITS + i * 8 + j;
+                }
+                mask = mask << 1;
+            }
+        }
+    }
+    return -1;
+}
+
+/*
+The word scanner with a goal group and per group next-fit cursors, as used by
+get_free_block.
+*/
+static long cursor_alloc(unsigned char *bitmaps, int group_count, unsigned int *cursors, int *goal){
+    for(int n = 0; n < group_count; n++){
+        int g = (*goal + n) % group_count;
+        unsigned char *bitmap = bitmaps + g * (BENCH_GROUP_BITS / 8);
+        long bit = bitmap_find_zero(bitmap, BENCH_GROUP_BITS, cursors[g]);
+        if(bit >= 0){
+            bitmap[bit / 8] |= 1 << (bit % 8);
+            cursors[g] = bit + 1;
+            *goal = g;
+            return (long)g * BENCH_GROUP_BITS + bit;
+        }
+    }
+    return -1;
+}
+
+static int bench_bitmap(int group_count, int fill_percent, long allocations){
+    unsigned char *bitmaps = make_bitmaps(group_count, fill_percent);
+    unsigned long free_bits = 0;
+    for(int g = 0; g < group_count; g++){
+        free_bits += bitmap_count_zero(bitmaps + g * (BENCH_GROUP_BITS / 8), BENCH_GROUP_BITS);
+    }
+    if(allocations > free_bits){
+        allocations = free_bits;
+    }
+    printf("bitmap: %d groups x %d bits, %d%% full, %lu free, %ld allocations\n", group_count, BENCH_GROUP_BITS, fill_percent, free_bits, allocations);
+
+    unsigned char *work = malloc((size_t)group_count * BENCH_GROUP_BITS / 8);
+    memcpy(work, bitmaps, (size_t)group_count * BENCH_GROUP_BITS / 8);
+    double start = now_seconds();
+    for(long n = 0; n < allocations; n++){
+        legacy_alloc(work, group_count);
+    }
+    double elapsed = now_seconds() - start;
+    printf("  bit-at-a-time from 0:   %12.0f allocs/s\n", allocations / elapsed);
+
+    memcpy(work, bitmaps, (size_t)group_count * BENCH_GROUP_BITS / 8);
+    unsigned int *cursors = calloc(group_count, sizeof(unsigned int));
+    int goal = 0;
+    start = now_seconds();
+    for(long n = 0; n < allocations; n++){
+        cursor_alloc(work, group_count, cursors, &goal);
+    }
+    elapsed = now_seconds() - start;
+    printf("  word scan + next-fit:   %12.0f allocs/s\n", allocations / elapsed);
+
+    memcpy(work, bitmaps, (size_t)group_count * BENCH_GROUP_BITS / 8);
+    unsigned long *bits = malloc(sizeof(unsigned long) * BENCH_GROUP_BITS);
+    long batched = 0;
+    start = now_seconds();
+    for(int g = 0; g < group_count && batched < allocations; g++){
+        unsigned char *bitmap = work + g * (BENCH_GROUP_BITS / 8);
+        unsigned long found = bitmap_find_zeros(bitmap, BENCH_GROUP_BITS, 0, allocations - batched, bits);
+        for(unsigned long i = 0; i < found; i++){
+            bitmap[bits[i] / 8] |= 1 << (bits[i] % 8);
+        }
+        batched += found;
+    }
+    elapsed = now_seconds() - start;
+    printf("  find N free bits:       %12.0f allocs/s\n", batched / elapsed);
+
+    int runs = 0;
+    memcpy(work, bitmaps, (size_t)group_count * BENCH_GROUP_BITS / 8);
+    start = now_seconds();
+    for(int g = 0; g < group_count; g++){
+        long bit = bitmap_find_zero_run(work + g * (BENCH_GROUP_BITS / 8), BENCH_GROUP_BITS, 0, 4);
+        if(bit >= 0){
+            runs++;
+        }
+    }
+    elapsed = now_seconds() - start;
+    printf("  run of 4 per group:     %12.0f searches/s (%d groups had one)\n", group_count / elapsed, runs);
+
+    //Free counting as check (a) of the checker used to do it, a bit and its mask maths at a time.
+    unsigned long counted = 0;
+    start = now_seconds();
+    for(int g = 0; g < group_count; g++){
+        unsigned char *bitmap = bitmaps + g * (BENCH_GROUP_BITS / 8);
+        for(int bit = 0; bit < BENCH_GROUP_BITS; bit++){
+            if(!(bitmap[bit / 8] & (1 << (bit % 8)))){
+                counted++;
+            }
+        }
+    }
+    elapsed = now_seconds() - start;
+    printf("  count, bit at a time:   %12.3f us for all groups (%lu free)\n", elapsed * 1e6, counted);
+
+    counted = 0;
+    start = now_seconds();
+    for(int g = 0; g < group_count; g++){
+        counted += bitmap_count_zero(bitmaps + g * (BENCH_GROUP_BITS / 8), BENCH_GROUP_BITS);
+    }
+    elapsed = now_seconds() - start;
+    printf("  count, popcount:        %12.3f us for all groups (%lu free)\n", elapsed * 1e6, counted);
+
+    free(bits);
+    free(cursors);
+    free(work);
+    free(bitmaps);
+    return 0;
+}
+
+/*
+Directory block search as it used to be: strlen and strncmp on every entry,
+without looking at name_len.
+*/
+static int legacy_search_dir_block(unsigned char *block, char *filename){
+    int offset = 0;
+    while(offset < EXT2_BLOCK_SIZE){
+        struct ext2_dir_entry *file = (struct ext2_dir_entry *)(block + offset);
+        if(strncmp(filename, file->name, strlen(filename)) == 0){
+            return offset;
+        }
+        offset += file->rec_len;
+    }
+    return -ENOENT;
+}
+
+static void dirblock_name(char *name, size_t size, int n){
+    if(n % 2){
+        snprintf(name, size, "entry_%05d", n);
+    }else{
+        snprintf(name, size, "a_much_longer_entry_name_%05d", n);
+    }
+}
+
+/*
+Fills block_count directory blocks with as many entries as fit and times
+lookups of names spread over the whole set, a quarter of them misses, with the
+old and the new block search.
+*/
+static int bench_dirblock(int block_count, long lookups){
+    unsigned char *blocks = calloc(block_count, EXT2_BLOCK_SIZE);
+    char name[64];
+    int n = 0, entries = 0;
+    for(int b = 0; b < block_count; b++){
+        unsigned char *block = blocks + (size_t)b * EXT2_BLOCK_SIZE;
+        struct ext2_dir_entry *entry = NULL;
+        int offset = 0;
+        while(1){
+            dirblock_name(name, sizeof(name), n);
+            int rec_len = dir_rec_len(strlen(name));
+            if(offset + rec_len > EXT2_BLOCK_SIZE){
+                break;
+            }
+            entry = (struct ext2_dir_entry *)(block + offset);
+            entry->inode = n + 12;
+            entry->rec_len = rec_len;
+            entry->name_len = strlen(name);
+            entry->file_type = EXT2_FT_REG_FILE;
+            memcpy(entry->name, name, entry->name_len);
+            offset += rec_len;
+            n++;
+        }
+        entry->rec_len += EXT2_BLOCK_SIZE - offset;
+    }
+    entries = n;
+    printf("dirblock: %d blocks, %d entries, %ld lookups\n", block_count, entries, lookups);
+
+    int *targets = malloc(sizeof(int) * lookups);
+    srand(369);
+    for(long i = 0; i < lookups; i++){
+        //Names past the last entry are misses and scan every block.
+        targets[i] = rand() % (entries + entries / 3);
+    }
+
+    long found = 0;
+    double start = now_seconds();
+    for(long i = 0; i < lookups; i++){
+        dirblock_name(name, sizeof(name), targets[i]);
+        for(int b = 0; b < block_count; b++){
+            if(legacy_search_dir_block(blocks + (size_t)b * EXT2_BLOCK_SIZE, name) >= 0){
+                found++;
+                break;
+            }
+        }
+    }
+    double elapsed = now_seconds() - start;
+    printf("  strncmp per entry:      %12.0f lookups/s (%ld found)\n", lookups / elapsed, found);
+
+    found = 0;
+    start = now_seconds();
+    for(long i = 0; i < lookups; i++){
+        DirNameKey key;
+        dirblock_name(name, sizeof(name), targets[i]);
+        dir_name_key_init(&key, name, strlen(name));
+        for(int b = 0; b < block_count; b++){
+            if(dir_block_find(blocks + (size_t)b * EXT2_BLOCK_SIZE, &key, NULL) >= 0){
+                found++;
+                break;
+            }
+        }
+    }
+    elapsed = now_seconds() - start;
+    printf("  name_len + key compare: %12.0f lookups/s (%ld found)\n", lookups / elapsed, found);
+
+    free(targets);
+    free(blocks);
+    return 0;
+}
+
+/*
+Makes an empty directory called name under the root of the loaded image, the
+same way ext2_mkdir does, and returns its inode number.
+*/
+static int bench_make_dir(ext2_fs *fs, char *name){
+    int block = get_free_block(fs);
+    int inode = get_free_inode(fs);
+    if(block < 0 || inode < 0){
+        return -ENOSPC;
+    }
+    create_inode(fs, inode, EXT2_S_IFDIR, EXT2_BLOCK_SIZE, 2, 2, (unsigned int *) &block, 1);
+    memset(get_block(fs, block), 0, EXT2_BLOCK_SIZE);
+    create_dir_entry(fs, inode, inode, 1, EXT2_FT_DIR, ".");
+    create_dir_entry(fs, inode, EXT2_ROOT_INO, 2, EXT2_FT_DIR, "..");
+    if(create_dir_entry(fs, EXT2_ROOT_INO, inode, strlen(name), EXT2_FT_DIR, name) == -ENOSPC){
+        add_block(fs, EXT2_ROOT_INO);
+        create_dir_entry(fs, EXT2_ROOT_INO, inode, strlen(name), EXT2_FT_DIR, name);
+    }
+    return inode;
+}
+
+/*
+Searches directory dir_inode_num for name without going through the dentry
+cache, so the cost of the directory format itself is measured.
+*/
+static int bench_search(ext2_fs *fs, int dir_inode_num, char *name){
+    int block_num, offset;
+    if(htree_is_indexed(fs, dir_inode_num)){
+        return htree_lookup(fs, dir_inode_num, name, strlen(name), &block_num, &offset);
+    }
+    return scan_dir_blocks(fs, dir_inode_num, name, strlen(name), dir_block_find, &block_num, &offset);
+}
+
+/*
+Grows one linear and one indexed directory side by side on a scratch image and
+reports the average insert latency (the existence check the tools do plus the
+insert) and lookup latency at each doubling of the directory size. The entries
+all point at the directory itself, so the image is not consistent afterwards.
+*/
+static int bench_htree(char *image, int max_entries){
+    ext2_fs *fs = load_image(image, IMAGE_HINT_RANDOM);
+    if(!fs){
+        perror("Failed to open disk image.");
+        return 1;
+    }
+    char *labels[2] = {"linear", "indexed"};
+    int dirs[2];
+    dirs[0] = bench_make_dir(fs, "bench_linear");
+    dirs[1] = bench_make_dir(fs, "bench_indexed");
+    if(dirs[0] < 0 || dirs[1] < 0){
+        fprintf(stderr, "%s: could not set up the benchmark directories\n", image);
+        return 1;
+    }
+    printf("htree: lookups and inserts per directory size, %d entries max\n", max_entries);
+
+    char name[32];
+    int lookups = 1000;
+    for(int d = 0; d < 2; d++){
+        int entries = 0;
+        srand(369);
+        //Indexing turns on dir_index, which would convert the linear one as it grows.
+        if(d == 1 && htree_build(fs, dirs[d]) < 0){
+            fprintf(stderr, "%s: could not index %s\n", image, "bench_indexed");
+            return 1;
+        }
+        for(int size = 256; size <= max_entries; size *= 2){
+            double start = now_seconds();
+            int inserted = 0;
+            for(; entries < size; entries++, inserted++){
+                snprintf(name, sizeof(name), "bench_%07d", entries);
+                if(bench_search(fs, dirs[d], name) == 0){
+                    break;
+                }
+                int result = create_dir_entry(fs, dirs[d], dirs[d], strlen(name), EXT2_FT_UNKNOWN, name);
+                if(result == -ENOSPC && add_block(fs, dirs[d]) > 0){
+                    result = create_dir_entry(fs, dirs[d], dirs[d], strlen(name), EXT2_FT_UNKNOWN, name);
+                }
+                if(result < 0){
+                    break;
+                }
+            }
+            double insert_time = now_seconds() - start;
+            if(entries < size){
+                printf("  %-8s full at %d entries\n", labels[d], entries);
+                break;
+            }
+
+            start = now_seconds();
+            for(int n = 0; n < lookups; n++){
+                snprintf(name, sizeof(name), "bench_%07d", rand() % entries);
+                bench_search(fs, dirs[d], name);
+            }
+            double lookup_time = now_seconds() - start;
+            printf("  %-8s %7d entries %5u blocks: insert %9.2f us, lookup %9.2f us\n", labels[d], entries,
+                get_inode(fs, dirs[d])->i_size / EXT2_BLOCK_SIZE, insert_time * 1e6 / inserted, lookup_time * 1e6 / lookups);
+        }
+    }
+    close_image(fs);
+    return 0;
+}
+
+/*
+Frees group_count full groups of bits in runs of run bits, the way ext2_rm
+walks a file's extents: bit at a time with a counter update per bit, as
+release_file_blocks used to, and with bitmap_clear_range and one counter
+update per run.
+*/
+static int bench_range(int group_count, int run, int rounds){
+    size_t bytes = (size_t)group_count * BENCH_GROUP_BITS / 8;
+    unsigned char *work = malloc(bytes);
+    int *free_counts = calloc(group_count, sizeof(int));
+    unsigned long total_bits = (unsigned long)group_count * BENCH_GROUP_BITS;
+    printf("range: %d groups x %d bits, runs of %d, %d rounds\n", group_count, BENCH_GROUP_BITS, run, rounds);
+
+    double elapsed = 0;
+    for(int r = 0; r < rounds; r++){
+        memset(work, 0xff, bytes);
+        double start = now_seconds();
+        for(unsigned long bit = 0; bit < total_bits; bit++){
+            int group = bit / BENCH_GROUP_BITS;
+            unsigned char *bitmap = work + (size_t)group * (BENCH_GROUP_BITS / 8);
+            unsigned int offset = bit % BENCH_GROUP_BITS;
+            bitmap[offset / 8] &= ~(1 << (offset % 8));
+            free_counts[group]++;
+        }
+        elapsed += now_seconds() - start;
+    }
+    printf("  bit at a time:          %12.1f Mbits/s\n", total_bits * rounds / elapsed / 1e6);
+
+    elapsed = 0;
+    for(int r = 0; r < rounds; r++){
+        memset(work, 0xff, bytes);
+        double start = now_seconds();
+        for(unsigned long bit = 0; bit < total_bits; bit += run){
+            int group = bit / BENCH_GROUP_BITS;
+            unsigned int offset = bit % BENCH_GROUP_BITS;
+            unsigned int length = run < BENCH_GROUP_BITS - offset ? run : BENCH_GROUP_BITS - offset;
+            free_counts[group] += bitmap_clear_range(work + (size_t)group * (BENCH_GROUP_BITS / 8), offset, length);
+        }
+        elapsed += now_seconds() - start;
+    }
+    printf("  bitmap_clear_range:     %12.1f Mbits/s (%lu left set)\n", total_bits * rounds / elapsed / 1e6,
+        total_bits - bitmap_count_zero(work, total_bits));
+
+    free(free_counts);
+    free(work);
+    return 0;
+}
+
+/*
+Path parsing as it used to be: a strdup of the whole path, then a node and a
+name copy per component, appended by walking the list from the head.
+*/
+typedef struct legacy_path_node {
+    char *filename;
+    struct legacy_path_node *next;
+} LegacyPathNode;
+
+static LegacyPathNode *legacy_create_path_list(char *path){
+    char *token;
+    LegacyPathNode *head = NULL;
+    char *copy, *original;
+    copy = original = strdup(path);
+    while((token = strsep(&copy, "/")) != NULL){
+        if(strlen(token) > 0){
+            LegacyPathNode *node = malloc(sizeof(LegacyPathNode));
+            node->filename = strdup(token);
+            node->next = NULL;
+            if(head){
+                LegacyPathNode *current = head;
+                while(current->next){
+                    current = current->next;
+                }
+                current->next = node;
+            }else{
+                head = node;
+            }
+        }
+    }
+    free(original);
+    return head;
+}
+
+static void legacy_destroy_path_list(LegacyPathNode *path){
+    while(path){
+        LegacyPathNode *next = path->next;
+        free(path->filename);
+        free(path);
+        path = next;
+    }
+}
+
+/*
+Parses paths of depth components, then reads their last component, with the
+old linked list, a heap allocated view, and a view parsed into caller storage.
+*/
+static int bench_path(int depth, long iterations){
+    char path[depth * 16 + 1];
+    int length = 0;
+    for(int d = 0; d < depth; d++){
+        length += snprintf(path + length, sizeof(path) - length, "/component_%03d", d);
+    }
+    printf("path: %d components, %d bytes, %ld parses\n", depth, length, iterations);
+
+    long checksum = 0;
+    double start = now_seconds();
+    for(long i = 0; i < iterations; i++){
+        LegacyPathNode *list = legacy_create_path_list(path);
+        LegacyPathNode *last = list;
+        while(last->next){
+            last = last->next;
+        }
+        checksum += strlen(last->filename);
+        legacy_destroy_path_list(list);
+    }
+    double elapsed = now_seconds() - start;
+    printf("  linked list:        %12.0f parses/s (%ld)\n", iterations / elapsed, checksum);
+
+    checksum = 0;
+    start = now_seconds();
+    for(long i = 0; i < iterations; i++){
+        PathView *view = path_view_create(path);
+        checksum += path_view_last(view)->len;
+        path_view_destroy(view);
+    }
+    elapsed = now_seconds() - start;
+    printf("  path_view_create:   %12.0f parses/s (%ld)\n", iterations / elapsed, checksum);
+
+    int capacity = path_view_capacity(path, length);
+    PathView *view = malloc(PATH_VIEW_BYTES(capacity));
+    view->capacity = capacity;
+    checksum = 0;
+    start = now_seconds();
+    for(long i = 0; i < iterations; i++){
+        path_view_parse(view, path, length);
+        checksum += path_view_last(view)->len;
+    }
+    elapsed = now_seconds() - start;
+    printf("  path_view_parse:    %12.0f parses/s (%ld)\n", iterations / elapsed, checksum);
+    free(view);
+    return 0;
+}
+
+typedef struct bench_thread {
+    pthread_t thread;
+    ext2_fs *fs;
+    char *source;
+    int round;
+    int index;
+    int files;
+    int failed;
+} BenchThread;
+
+/*
+Copies files files into the thread's own directory, then removes them again.
+*/
+static void *bench_thread_copy(void *arg){
+    BenchThread *bench = arg;
+    char path[64];
+    for(int f = 0; f < bench->files; f++){
+        snprintf(path, sizeof(path), "/bench_threads_%d_%d/f%d", bench->round, bench->index, f);
+        if(copy_file(bench->fs, bench->source, path) < 0){
+            bench->failed++;
+        }
+    }
+    for(int f = 0; f < bench->files; f++){
+        snprintf(path, sizeof(path), "/bench_threads_%d_%d/f%d", bench->round, bench->index, f);
+        remove_file(bench->fs, path);
+    }
+    return NULL;
+}
+
+/*
+Runs 1, 2, 4... up to max_threads threads against one shared handle, each
+copying files files of file_size bytes into a directory of its own and then
+removing them, and reports the copies per second and the speedup over one
+thread. The directories are left behind.
+*/
+static int bench_threads(char *image, int max_threads, int files, int file_size){
+    ext2_fs *fs = load_image(image, IMAGE_HINT_THREADS);
+    if(!fs){
+        perror("Failed to open disk image.");
+        return 1;
+    }
+    char source[] = "/tmp/ext2_bench_XXXXXX";
+    int source_fd = mkstemp(source);
+    unsigned char *data = calloc(1, file_size > 0 ? file_size : 1);
+    if(source_fd < 0 || !data || write(source_fd, data, file_size) != file_size){
+        perror("Failed to write the source file.");
+        return 1;
+    }
+    close(source_fd);
+    free(data);
+    BenchThread *threads = calloc(max_threads, sizeof(BenchThread));
+    printf("threads: %d files of %d bytes per thread, up to %d threads, %ld CPUs\n", files, file_size, max_threads, sysconf(_SC_NPROCESSORS_ONLN));
+
+    //One untimed round first, so the image pages are mapped in before anything is measured.
+    double single = 0;
+    int round = getpid() * 16;
+    for(int count = 1, warm = TRUE; count <= max_threads; round++){
+        char path[64];
+        for(int t = 0; t < count; t++){
+            snprintf(path, sizeof(path), "/bench_threads_%d_%d", round, t);
+            if(make_directory(fs, path, FALSE) < 0){
+                return 1;
+            }
+        }
+        double start = now_seconds();
+        for(int t = 0; t < count; t++){
+            threads[t] = (BenchThread){.fs = fs, .source = source, .round = round, .index = t, .files = files};
+            pthread_create(&threads[t].thread, NULL, bench_thread_copy, &threads[t]);
+        }
+        int failed = 0;
+        for(int t = 0; t < count; t++){
+            pthread_join(threads[t].thread, NULL);
+            failed += threads[t].failed;
+        }
+        double elapsed = now_seconds() - start;
+        if(warm){
+            warm = FALSE;
+            continue;
+        }
+        double rate = (double)count * files / elapsed;
+        if(count == 1){
+            single = rate;
+        }
+        printf("  %3d threads: %10.0f copies/s  speedup %5.2fx  (%d failed)\n", count, rate, rate / single, failed);
+        count *= 2;
+    }
+    unlink(source);
+    save_image(fs);
+    close_image(fs);
+    free(threads);
+    return 0;
+}
+
+/*
+Copies files files of file_size random bytes into a fresh directory of the
+image, then gets them back out into a local directory two ways: export_tree,
+which writes straight from the mapped image, and read_file into a buffer
+followed by write, a copy through a bounce buffer like reading the files
+through a loop mount would make. The ways take turns for BENCH_EXPORT_ROUNDS
+rounds and each one's best round is reported, which keeps the first round's
+page faults and the host's writeback out of the comparison. The image
+directory is left behind.
+*/
+static int bench_export(char *image, int files, int file_size){
+    ext2_fs *fs = load_image(image, IMAGE_HINT_NONE);
+    if(!fs){
+        perror("Failed to open disk image.");
+        return 1;
+    }
+    char source[] = "/tmp/ext2_bench_XXXXXX";
+    char out[] = "/tmp/ext2_bench_out_XXXXXX";
+    int source_fd = mkstemp(source);
+    unsigned char *data = malloc(file_size > 0 ? file_size : 1);
+    for(int i = 0; data && i < file_size; i++){
+        data[i] = rand();
+    }
+    if(source_fd < 0 || !data || write(source_fd, data, file_size) != file_size || !mkdtemp(out)){
+        perror("Failed to write the source file.");
+        return 1;
+    }
+    close(source_fd);
+    char dir[64], path[128], host_path[128];
+    snprintf(dir, sizeof(dir), "/bench_export_%d", getpid());
+    if(make_directory(fs, dir, FALSE) < 0){
+        return 1;
+    }
+    for(int f = 0; f < files; f++){
+        snprintf(path, sizeof(path), "%s/f%d", dir, f);
+        if(copy_file(fs, source, path) < 0){
+            return 1;
+        }
+    }
+    save_image(fs);
+    unlink(source);
+    printf("export: %d files of %d bytes\n", files, file_size);
+
+    size_t buffer_size = 65536;
+    unsigned char *buffer = realloc(data, buffer_size);
+    double bounce = 0, direct = 0;
+    for(int round = 0; round < BENCH_EXPORT_ROUNDS; round++){
+        double start = now_seconds();
+        for(int f = 0; f < files; f++){
+            snprintf(path, sizeof(path), "%s/f%d", dir, f);
+            snprintf(host_path, sizeof(host_path), "%s/b%d", out, f);
+            int inode_num = lookup_inode(fs, path);
+            int dest_fd = open(host_path, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+            unsigned long long offset = 0;
+            ssize_t bytes_read;
+            while((bytes_read = read_file(fs, inode_num, offset, buffer, buffer_size)) > 0){
+                if(write(dest_fd, buffer, bytes_read) != bytes_read){
+                    break;
+                }
+                offset += bytes_read;
+            }
+            close(dest_fd);
+        }
+        double elapsed = now_seconds() - start;
+        bounce = round == 0 || elapsed < bounce ? elapsed : bounce;
+
+        snprintf(host_path, sizeof(host_path), "%s/tree%d", out, round);
+        start = now_seconds();
+        export_tree(fs, dir, host_path);
+        elapsed = now_seconds() - start;
+        direct = round == 0 || elapsed < direct ? elapsed : direct;
+    }
+    double megabytes = (double)files * file_size / (1024 * 1024);
+    printf("  read_file + write: %8.1f MB/s\n", megabytes / bounce);
+    printf("  export (writev):   %8.1f MB/s  %.2fx\n", megabytes / direct, bounce / direct);
+
+    for(int f = 0; f < files; f++){
+        snprintf(host_path, sizeof(host_path), "%s/b%d", out, f);
+        unlink(host_path);
+        for(int round = 0; round < BENCH_EXPORT_ROUNDS; round++){
+            snprintf(host_path, sizeof(host_path), "%s/tree%d/f%d", out, round, f);
+            unlink(host_path);
+        }
+    }
+    for(int round = 0; round < BENCH_EXPORT_ROUNDS; round++){
+        snprintf(host_path, sizeof(host_path), "%s/tree%d", out, round);
+        rmdir(host_path);
+    }
+    rmdir(out);
+    free(buffer);
+    close_image(fs);
+    return 0;
+}
+
+/*
+Runs check_image over image with 1, 2, 4... up to max_threads threads and
+reports each run's time and its speedup over one thread, after an untimed
+run to bring the image into memory. Meant for a consistent image: the
+checker repairs whatever it finds, so only the first run would have work to
+do otherwise.
+*/
+static int bench_checker(char *image, int max_threads){
+    ext2_fs *fs = load_image(image, IMAGE_HINT_NONE);
+    if(!fs){
+        perror("Failed to open disk image.");
+        return 1;
+    }
+    printf("checker: %u inodes, %u blocks, up to %d threads, %ld CPUs\n", fs->geometry.inodes_count, fs->geometry.blocks_count,
+        max_threads, sysconf(_SC_NPROCESSORS_ONLN));
+    int unfixed;
+    if(check_image(fs, 1, 0, &unfixed) != 0 || unfixed != 0){
+        fprintf(stderr, "%s: not consistent, the runs wouldn't be comparable.\n", image);
+        return 1;
+    }
+    double single = 0;
+    for(int threads = 1; threads <= max_threads; threads *= 2){
+        double start = now_seconds();
+        check_image(fs, threads, 0, &unfixed);
+        double elapsed = now_seconds() - start;
+        if(threads == 1){
+            single = elapsed;
+        }
+        printf("  %3d threads: %8.3f ms  speedup %5.2fx\n", threads, elapsed * 1000, single / elapsed);
+    }
+    close_image(fs);
+    return 0;
+}
+
+/*
+tree_walk visitor for the walk benchmark: counts the entries and touches
+each one's inode, as the tools walking the tree do.
+*/
+static int bench_count_entry(ext2_fs *fs, WalkEntry *entry, void *arg){
+    long *entries = arg;
+    (*entries)++;
+    return get_inode(fs, entry->inode)->i_mode == 0 ? WALK_SKIP : WALK_CONTINUE;
+}
+
+/*
+Walks the whole tree of image depth first, breadth first, and breadth first
+in block order, reporting the best of BENCH_WALK_ROUNDS runs of each along
+with how many directories the walk held at once.
+*/
+static int bench_walk(char *image){
+    ext2_fs *fs = load_image(image, IMAGE_HINT_NONE);
+    if(!fs){
+        perror("Failed to open disk image.");
+        return 1;
+    }
+    struct {
+        char *name;
+        int order;
+        int flags;
+    } modes[] = {
+        {"depth first", WALK_DFS, WALK_ONCE},
+        {"breadth first", WALK_BFS, WALK_ONCE},
+        {"breadth first, block order", WALK_BFS, WALK_ONCE | WALK_BLOCK_ORDER},
+    };
+    for(int m = 0; m < 3; m++){
+        double best = 0;
+        long entries = 0;
+        TreeWalk walk = {.order = modes[m].order, .flags = modes[m].flags, .visit = bench_count_entry, .arg = &entries};
+        for(int round = 0; round < BENCH_WALK_ROUNDS; round++){
+            entries = 0;
+            double start = now_seconds();
+            if(tree_walk(fs, EXT2_ROOT_INO, &walk, NULL) < 0){
+                fprintf(stderr, "walk failed.\n");
+                close_image(fs);
+                return 1;
+            }
+            double elapsed = now_seconds() - start;
+            if(round == 0 || elapsed < best){
+                best = elapsed;
+            }
+        }
+        printf("%-28s %8.3f ms  %ld entries, %ld directories, %ld held at most\n", modes[m].name, best * 1000, entries, walk.dirs,
+            walk.max_pending);
+    }
+    close_image(fs);
+    return 0;
+}
+
+int main(int argc, char **argv) {
+    if(argc >= 2 && strcmp(argv[1], "bitmap") == 0){
+        int group_count = argc > 2 ? atoi(argv[2]) : 64;
+        int fill_percent = argc > 3 ? atoi(argv[3]) : 90;
+        long allocations = argc > 4 ? atol(argv[4]) : 20000;
+        return bench_bitmap(group_count, fill_percent, allocations);
+    }
+    if(argc >= 2 && strcmp(argv[1], "dirblock") == 0){
+        int block_count = argc > 2 ? atoi(argv[2]) : 64;
+        long lookups = argc > 3 ? atol(argv[3]) : 20000;
+        return bench_dirblock(block_count, lookups);
+    }
+    if(argc >= 3 && strcmp(argv[1], "htree") == 0){
+        int max_entries = argc > 3 ? atoi(argv[3]) : 8192;
+        return bench_htree(argv[2], max_entries);
+    }
+    if(argc >= 2 && strcmp(argv[1], "range") == 0){
+        int group_count = argc > 2 ? atoi(argv[2]) : 128;
+        int run = argc > 3 ? atoi(argv[3]) : 256;
+        int rounds = argc > 4 ? atoi(argv[4]) : 20;
+        return bench_range(group_count, run > 0 ? run : 1, rounds);
+    }
+    if(argc >= 2 && strcmp(argv[1], "path") == 0){
+        int depth = argc > 2 ? atoi(argv[2]) : 8;
+        long iterations = argc > 3 ? atol(argv[3]) : 1000000;
+        return bench_path(depth > 0 ? depth : 1, iterations);
+    }
+    if(argc >= 3 && strcmp(argv[1], "threads") == 0){
+        int max_threads = argc > 3 ? atoi(argv[3]) : 8;
+        int files = argc > 4 ? atoi(argv[4]) : 2000;
+        int file_size = argc > 5 ? atoi(argv[5]) : 4096;
+        return bench_threads(argv[2], max_threads > 0 ? max_threads : 1, files, file_size);
+    }
+    if(argc >= 3 && strcmp(argv[1], "checker") == 0){
+        int max_threads = argc > 3 ? atoi(argv[3]) : 8;
+        return bench_checker(argv[2], max_threads > 0 ? max_threads : 1);
+    }
+    if(argc >= 3 && strcmp(argv[1], "export") == 0){
+        int files = argc > 3 ? atoi(argv[3]) : 64;
+        int file_size = argc > 4 ? atoi(argv[4]) : 1048576;
+        return bench_export(argv[2], files, file_size);
+    }
+    if(argc >= 3 && strcmp(argv[1], "walk") == 0){
+        return bench_walk(argv[2]);
+    }
+    fprintf(stderr, "Usage: %s bitmap [groups] [fill percent] [allocations]\n", argv[0]);
+    fprintf(stderr, "       %s dirblock [blocks] [lookups]\n", argv[0]);
+    fprintf(stderr, "       %s htree <scratch image> [max entries]\n", argv[0]);
+    fprintf(stderr, "       %s range [groups] [run] [rounds]\n", argv[0]);
+    fprintf(stderr, "       %s path [components] [parses]\n", argv[0]);
+    fprintf(stderr, "       %s threads <scratch image> [max threads] [files per thread] [file size]\n", argv[0]);
+    fprintf(stderr, "       %s export <scratch image> [files] [file size]\n", argv[0]);
+    fprintf(stderr, "       %s checker <image> [max threads]\n", argv[0]);
+    fprintf(stderr, "       %s walk <image>\n", argv[0]);
+    exit(1);
+}
@@ -0,0 +1,36 @@
+#include "ops.h"
+
+int main(int argc, char **argv) {
+    int hints = IMAGE_HINT_SEQUENTIAL;
+    argc = parse_stats_flag(argc, argv, &hints);
+    //-r exports a whole directory tree.
+    int recursive = FALSE;
+    int kept = 1;
+    for(int i = 1; i < argc; i++){
+        if(strcmp(argv[i], "-r") == 0){
+            recursive = TRUE;
+        }else{
+            argv[kept++] = argv[i];
+        }
+    }
+    argc = kept;
+    if(argc != 4 && (recursive || argc != 3)) {
+        fprintf(stderr, "Usage: %s [-r] <image file name> <path in image> [local dest]\n", argv[0]);
+        exit(1);
+    }
+    ext2_fs *fs = load_image(argv[1], hints);
+    if(!fs){
+        perror("Failed to open disk image.");
+        exit(1);
+    }
+
+    //Without a dest the file goes to stdout.
+    int result;
+    if(recursive){
+        result = export_tree(fs, argv[2], argv[3]);
+    }else{
+        result = export_file(fs, argv[2], argc == 4 ? argv[3] : "-");
+    }
+    close_image(fs);
+    return -result;
+}
@@ -0,0 +1,594 @@
+#define _GNU_SOURCE
+#include <poll.h>
+#include <signal.h>
+#include <time.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "ops.h"
+#include "ext2d.h"
+
+/*
+Image server: keeps the images named on the command line mapped and carries
+out requests from any number of clients on a Unix domain socket, see ext2d.h
+for the protocol. One thread serves every connection from a poll loop.
+
+Each pass of the loop reads everything the clients have sent, carries out
+every complete request in order, and then flushes all the images that changed
+at once before releasing the replies of the requests that changed them. With
+--linger the flush waits up to that many microseconds for more requests to
+share it.
+*/
+
+#define MAX_IMAGES 16
+#define MAX_CONNECTIONS 256
+//A client this far behind on reading its replies gets no more requests read.
+#define MAX_PENDING_OUTPUT (8 * 1024 * 1024)
+
+//A reply held until the next flush, and the image whose flush it waits on.
+typedef struct held_reply {
+    size_t offset;
+    int image;
+} HeldReply;
+
+typedef struct connection {
+    int fd;
+    unsigned char *in;
+    size_t in_length;
+    size_t in_capacity;
+    unsigned char *out;
+    size_t out_length;
+    size_t out_capacity;
+    size_t out_sent;
+    //Replies before this offset may be sent, the rest wait for the next flush.
+    size_t out_ready;
+    HeldReply *held;
+    int held_count;
+    int held_capacity;
+    //The client is done sending, close once its replies are out.
+    int eof;
+} Connection;
+
+static ext2_fs *images[MAX_IMAGES];
+static int image_dirty[MAX_IMAGES];
+static int image_count = 0;
+
+static Connection *connections[MAX_CONNECTIONS];
+static int connection_count = 0;
+
+//Set once a change is waiting to be flushed, with the time the first one came in.
+static int commit_pending = FALSE;
+static double commit_pending_since = 0;
+
+static long requests_served = 0;
+static long commits = 0;
+static long committed_requests = 0;
+static long uncommitted_requests = 0;
+
+static volatile sig_atomic_t stopping = FALSE;
+
+static void handle_stop(int signal_number){
+    stopping = TRUE;
+}
+
+static double now_seconds(void){
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+/*
+Grows the buffer at *buffer to hold at least needed bytes. Returns 0, or -1 if
+memory runs out.
+*/
+static int reserve(unsigned char **buffer, size_t *capacity, size_t needed){
+    if(needed <= *capacity){
+        return 0;
+    }
+    size_t new_capacity = *capacity ? *capacity : 4096;
+    while(new_capacity < needed){
+        new_capacity *= 2;
+    }
+    unsigned char *new_buffer = realloc(*buffer, new_capacity);
+    if(!new_buffer){
+        return -1;
+    }
+    *buffer = new_buffer;
+    *capacity = new_capacity;
+    return 0;
+}
+
+/*
+Makes room in the connection's held list for one more reply. Returns 0, or -1
+if memory runs out.
+*/
+static int reserve_held(Connection *conn){
+    if(conn->held_count < conn->held_capacity){
+        return 0;
+    }
+    int capacity = conn->held_capacity ? conn->held_capacity * 2 : 64;
+    HeldReply *held = realloc(conn->held, sizeof(HeldReply) * capacity);
+    if(!held){
+        return -1;
+    }
+    conn->held = held;
+    conn->held_capacity = capacity;
+    return 0;
+}
+
+/*
+Starts a reply with room for length bytes of payload, which the caller writes
+at the returned pointer. A held reply, and anything after it, goes out only
+after the next flush. Returns NULL if memory runs out.
+*/
+static unsigned char *start_reply(Connection *conn, uint32_t tag, int status, size_t length, int held){
+    if(reserve(&conn->out, &conn->out_capacity, conn->out_length + sizeof(Ext2dReply) + length) < 0){
+        return NULL;
+    }
+    Ext2dReply reply = {length, tag, status};
+    memcpy(conn->out + conn->out_length, &reply, sizeof(reply));
+    int ready = !held && conn->out_ready == conn->out_length;
+    conn->out_length += sizeof(reply) + length;
+    if(ready){
+        conn->out_ready = conn->out_length;
+    }
+    return conn->out + conn->out_length - length;
+}
+
+/*
+Points args at the NUL terminated strings making up payload. Returns how many
+there are, or -1 if there are more than max or the last one is unterminated.
+*/
+static int split_payload(char *payload, size_t length, char **args, int max){
+    int count = 0;
+    size_t start = 0;
+    while(start < length){
+        char *end = memchr(payload + start, '\0', length - start);
+        if(!end || count == max){
+            return -1;
+        }
+        args[count++] = payload + start;
+        start = end - payload + 1;
+    }
+    return count;
+}
+
+/*
+Answers a stat request for path in image fs.
+*/
+static void reply_stat(Connection *conn, ext2_fs *fs, uint32_t tag, char *path){
+    int inode_num = lookup_inode(fs, path);
+    if(inode_num < 0){
+        start_reply(conn, tag, -inode_num, 0, FALSE);
+        return;
+    }
+    struct ext2_inode *inode = get_inode(fs, inode_num);
+    Ext2dStat info = {inode_num, inode->i_mode, inode->i_links_count, get_file_size(fs, inode_num), inode->i_blocks, inode->i_mtime};
+    unsigned char *payload = start_reply(conn, tag, 0, sizeof(info), FALSE);
+    if(!payload){
+        //Room for an empty reply is always there, see run_requests.
+        start_reply(conn, tag, ENOMEM, 0, FALSE);
+        return;
+    }
+    memcpy(payload, &info, sizeof(info));
+}
+
+/*
+Answers a read request, copying the file's bytes straight into the reply.
+*/
+static void reply_read(Connection *conn, ext2_fs *fs, uint32_t tag, Ext2dRead *range, char *path){
+    int inode_num = lookup_inode(fs, path);
+    if(inode_num < 0){
+        start_reply(conn, tag, -inode_num, 0, FALSE);
+        return;
+    }
+    size_t length = range->length < EXT2D_MAX_READ ? range->length : EXT2D_MAX_READ;
+    unsigned char *payload = start_reply(conn, tag, 0, length, FALSE);
+    if(!payload){
+        start_reply(conn, tag, ENOMEM, 0, FALSE);
+        return;
+    }
+    ssize_t bytes_read = read_file(fs, inode_num, range->offset, payload, length);
+    //Shrink the reply to what was actually read.
+    Ext2dReply reply = {bytes_read > 0 ? bytes_read : 0, tag, bytes_read < 0 ? -bytes_read : 0};
+    memcpy(payload - sizeof(reply), &reply, sizeof(reply));
+    if(bytes_read < 0){
+        bytes_read = 0;
+    }
+    conn->out_length -= length - bytes_read;
+    if(conn->out_ready > conn->out_length){
+        conn->out_ready = conn->out_length;
+    }
+}
+
+/*
+Carries out one request. Changes are made to the image right away, their
+replies are held until the next flush.
+*/
+static void run_request(Connection *conn, Ext2dRequest *request, char *payload){
+    char *args[2];
+    int count = -1;
+    int status = EINVAL;
+    requests_served++;
+    if(request->image >= image_count){
+        start_reply(conn, request->tag, EINVAL, 0, FALSE);
+        return;
+    }
+    ext2_fs *fs = images[request->image];
+    if(request->op == EXT2D_OP_READ){
+        if(request->length >= sizeof(Ext2dRead)){
+            Ext2dRead range;
+            memcpy(&range, payload, sizeof(range));
+            if(split_payload(payload + sizeof(range), request->length - sizeof(range), args, 1) == 1){
+                reply_read(conn, fs, request->tag, &range, args[0]);
+                return;
+            }
+        }
+        start_reply(conn, request->tag, EINVAL, 0, FALSE);
+        return;
+    }
+    count = split_payload(payload, request->length, args, 2);
+    switch(request->op){
+        case EXT2D_OP_STAT:
+            if(count == 1){
+                reply_stat(conn, fs, request->tag, args[0]);
+                return;
+            }
+            start_reply(conn, request->tag, EINVAL, 0, FALSE);
+            return;
+        case EXT2D_OP_MKDIR:
+            if(count == 1){
+                status = -make_directory(fs, args[0], request->flags & EXT2D_FLAG_INDEX);
+            }
+            break;
+        case EXT2D_OP_CP:
+            if(count == 2){
+                //A pipe would stall every client while the server waits on it.
+                struct stat source_stat;
+                if(stat(args[0], &source_stat) < 0){
+                    status = ENOENT;
+                }else if(S_ISREG(source_stat.st_mode)){
+                    status = -copy_file(fs, args[0], args[1]);
+                }
+            }
+            break;
+        case EXT2D_OP_LN:
+            if(count == 2){
+                status = -make_link(fs, args[0], args[1], (request->flags & EXT2D_FLAG_SYMLINK) ? SOFTLINK : HARDLINK);
+            }
+            break;
+        case EXT2D_OP_RM:
+            if(count == 1){
+                status = -remove_file(fs, args[0]);
+            }
+            break;
+        case EXT2D_OP_RESTORE:
+            if(count == 1){
+                status = -restore_file(fs, args[0]);
+            }
+            break;
+        case EXT2D_OP_SYNC:
+            status = 0;
+            break;
+        default:
+            start_reply(conn, request->tag, EINVAL, 0, FALSE);
+            return;
+    }
+    //Even a failed change may have touched the image, so every one waits for the flush.
+    image_dirty[request->image] = TRUE;
+    if(!commit_pending){
+        commit_pending = TRUE;
+        commit_pending_since = now_seconds();
+    }
+    uncommitted_requests++;
+    //Both the reply and its place in held were reserved by run_requests.
+    unsigned char *reply = start_reply(conn, request->tag, status, 0, TRUE);
+    conn->held[conn->held_count++] = (HeldReply){reply - sizeof(Ext2dReply) - conn->out, request->image};
+}
+
+/*
+Carries out every complete request in the connection's input buffer. Returns
+0, or -1 if the connection has to be closed.
+*/
+static int run_requests(Connection *conn){
+    size_t start = 0;
+    while(conn->in_length - start >= sizeof(Ext2dRequest)){
+        Ext2dRequest request;
+        memcpy(&request, conn->in + start, sizeof(request));
+        if(request.length > EXT2D_MAX_PAYLOAD){
+            return -1;
+        }
+        if(conn->in_length - start < sizeof(request) + request.length){
+            break;
+        }
+        //Room for an empty reply before anything is done: a change made with no
+        //way left to answer it would leave the client waiting forever.
+        if(reserve(&conn->out, &conn->out_capacity, conn->out_length + sizeof(Ext2dReply)) < 0
+            || reserve_held(conn) < 0){
+            return -1;
+        }
+        run_request(conn, &request, (char *)conn->in + start + sizeof(request));
+        start += sizeof(request) + request.length;
+    }
+    memmove(conn->in, conn->in + start, conn->in_length - start);
+    conn->in_length -= start;
+    return 0;
+}
+
+/*
+Reads what the client has sent so far and carries out the complete requests.
+Returns 0, or -1 if the connection is broken.
+*/
+static int read_requests(Connection *conn){
+    while(1){
+        if(reserve(&conn->in, &conn->in_capacity, conn->in_length + 65536) < 0){
+            return -1;
+        }
+        ssize_t bytes_read = read(conn->fd, conn->in + conn->in_length, conn->in_capacity - conn->in_length);
+        if(bytes_read < 0 && errno == EINTR){
+            continue;
+        }
+        if(bytes_read < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)){
+            return 0;
+        }
+        if(bytes_read < 0){
+            return -1;
+        }
+        if(bytes_read == 0){
+            conn->eof = TRUE;
+            return 0;
+        }
+        conn->in_length += bytes_read;
+        if(run_requests(conn) < 0){
+            return -1;
+        }
+        if(conn->out_length - conn->out_sent > MAX_PENDING_OUTPUT){
+            return 0;
+        }
+    }
+}
+
+/*
+Sends the replies that are ready. Returns 0, or -1 if the connection broke or
+the client hung up and has nothing left to receive.
+*/
+static int write_replies(Connection *conn){
+    while(conn->out_sent < conn->out_ready){
+        ssize_t written = write(conn->fd, conn->out + conn->out_sent, conn->out_ready - conn->out_sent);
+        if(written < 0 && errno == EINTR){
+            continue;
+        }
+        if(written < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)){
+            return 0;
+        }
+        if(written < 0){
+            return -1;
+        }
+        conn->out_sent += written;
+    }
+    //Everything sendable is out, move the held replies to the front.
+    memmove(conn->out, conn->out + conn->out_sent, conn->out_length - conn->out_sent);
+    for(int h = 0; h < conn->held_count; h++){
+        conn->held[h].offset -= conn->out_sent;
+    }
+    conn->out_length -= conn->out_sent;
+    conn->out_ready -= conn->out_sent;
+    conn->out_sent = 0;
+    return conn->eof && conn->out_length == 0 ? -1 : 0;
+}
+
+static void close_connection(int index){
+    Connection *conn = connections[index];
+    close(conn->fd);
+    free(conn->in);
+    free(conn->out);
+    free(conn->held);
+    free(conn);
+    connections[index] = connections[--connection_count];
+}
+
+/*
+Flushes every image changed since the last flush and releases the replies
+waiting on it. A change to an image that can't be written is still in the
+shared mapping, and the kernel writes it back later, but it isn't known to be
+on disk: its reply goes out with EIO, and the image stays dirty so the next
+flush tries it again.
+*/
+static void commit(void){
+    int failed[MAX_IMAGES] = {0};
+    for(int i = 0; i < image_count; i++){
+        if(image_dirty[i] && save_image(images[i]) < 0){
+            perror("Failed to write disk image.");
+            failed[i] = TRUE;
+        }else{
+            image_dirty[i] = FALSE;
+        }
+    }
+    commits++;
+    committed_requests += uncommitted_requests;
+    uncommitted_requests = 0;
+    commit_pending = FALSE;
+    for(int c = connection_count - 1; c >= 0; c--){
+        Connection *conn = connections[c];
+        for(int h = 0; h < conn->held_count; h++){
+            if(!failed[conn->held[h].image]){
+                continue;
+            }
+            //A change that failed already keeps its own error.
+            Ext2dReply reply;
+            memcpy(&reply, conn->out + conn->held[h].offset, sizeof(reply));
+            if(reply.status == 0){
+                reply.status = EIO;
+                memcpy(conn->out + conn->held[h].offset, &reply, sizeof(reply));
+            }
+        }
+        conn->held_count = 0;
+        conn->out_ready = conn->out_length;
+        if(write_replies(conn) < 0){
+            close_connection(c);
+        }
+    }
+}
+
+/*
+Binds a listening socket at path. A socket file left behind by a server that
+is gone is replaced, one that still answers is not.
+*/
+static int listen_at(char *path){
+    struct sockaddr_un address;
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    if(strlen(path) >= sizeof(address.sun_path)){
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    strcpy(address.sun_path, path);
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if(fd < 0){
+        return -1;
+    }
+    if(bind(fd, (struct sockaddr *)&address, sizeof(address)) < 0){
+        int probe = errno == EADDRINUSE ? socket(AF_UNIX, SOCK_STREAM, 0) : -1;
+        if(probe < 0 || connect(probe, (struct sockaddr *)&address, sizeof(address)) == 0 || errno != ECONNREFUSED){
+            if(probe >= 0){
+                close(probe);
+            }
+            close(fd);
+            errno = EADDRINUSE;
+            return -1;
+        }
+        close(probe);
+        unlink(path);
+        if(bind(fd, (struct sockaddr *)&address, sizeof(address)) < 0){
+            close(fd);
+            return -1;
+        }
+    }
+    if(listen(fd, 128) < 0){
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+static void accept_connections(int listen_fd){
+    while(connection_count < MAX_CONNECTIONS){
+        int fd = accept4(listen_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if(fd < 0){
+            return;
+        }
+        Connection *conn = calloc(1, sizeof(Connection));
+        if(!conn){
+            close(fd);
+            return;
+        }
+        conn->fd = fd;
+        connections[connection_count++] = conn;
+    }
+}
+
+int main(int argc, char **argv) {
+    int hints = IMAGE_HINT_RANDOM;
+    argc = parse_stats_flag(argc, argv, &hints);
+    //--linger holds each flush back up to this long, so more changes share it.
+    long linger_us = 0;
+    if(argc >= 3 && strcmp(argv[1], "--linger") == 0){
+        linger_us = atol(argv[2]);
+        argv[2] = argv[0];
+        argv += 2;
+        argc -= 2;
+    }
+    if(argc < 3 || argc - 2 > MAX_IMAGES) {
+        fprintf(stderr, "Usage: %s [--stats] [--linger <microseconds>] <socket path> <image file name>...\n", argv[0]);
+        exit(1);
+    }
+    for(int i = 2; i < argc; i++){
+        //Flush statistics per commit would drown out everything else.
+        images[image_count] = load_image(argv[i], hints & ~IMAGE_HINT_STATS);
+        if(!images[image_count]){
+            perror("Failed to open disk image.");
+            exit(1);
+        }
+        image_count++;
+    }
+    int listen_fd = listen_at(argv[1]);
+    if(listen_fd < 0){
+        perror("Failed to listen on socket.");
+        exit(1);
+    }
+
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = handle_stop;
+    sigaction(SIGINT, &action, NULL);
+    sigaction(SIGTERM, &action, NULL);
+    signal(SIGPIPE, SIG_IGN);
+
+    struct pollfd fds[MAX_CONNECTIONS + 1];
+    while(!stopping){
+        fds[0].fd = listen_fd;
+        fds[0].events = connection_count < MAX_CONNECTIONS ? POLLIN : 0;
+        for(int c = 0; c < connection_count; c++){
+            Connection *conn = connections[c];
+            fds[c + 1].fd = conn->fd;
+            fds[c + 1].events = 0;
+            if(!conn->eof && conn->out_length - conn->out_sent <= MAX_PENDING_OUTPUT){
+                fds[c + 1].events |= POLLIN;
+            }
+            if(conn->out_ready > conn->out_sent){
+                fds[c + 1].events |= POLLOUT;
+            }
+        }
+        int timeout = -1;
+        if(commit_pending){
+            double remaining = commit_pending_since + linger_us / 1e6 - now_seconds();
+            timeout = remaining > 0 ? (int)(remaining * 1000) + 1 : 0;
+        }
+        int polled_count = connection_count;
+        if(poll(fds, polled_count + 1, timeout) < 0){
+            if(errno == EINTR){
+                continue;
+            }
+            perror("poll");
+            break;
+        }
+
+        //Serve the connections polled, back to front so closing one doesn't move the rest.
+        for(int c = polled_count - 1; c >= 0; c--){
+            Connection *conn = connections[c];
+            int broken = FALSE;
+            if(fds[c + 1].revents & (POLLIN | POLLHUP | POLLERR)){
+                broken = read_requests(conn) < 0;
+            }
+            if(!broken && (conn->out_ready > conn->out_sent || conn->eof)){
+                broken = write_replies(conn) < 0;
+            }
+            if(broken){
+                close_connection(c);
+            }
+        }
+        if(fds[0].revents & POLLIN){
+            accept_connections(listen_fd);
+        }
+        if(commit_pending && now_seconds() >= commit_pending_since + linger_us / 1e6){
+            commit();
+        }
+    }
+
+    if(commit_pending){
+        commit();
+    }
+    while(connection_count > 0){
+        close_connection(connection_count - 1);
+    }
+    close(listen_fd);
+    unlink(argv[1]);
+    for(int i = 0; i < image_count; i++){
+        close_image(images[i]);
+    }
+    if(hints & IMAGE_HINT_STATS){
+        fprintf(stderr, "%ld requests, %ld changes in %ld flushes (%.1f per flush)\n", requests_served,
+            committed_requests, commits, commits ? (double)committed_requests / commits : 0.0);
+    }
+    return 0;
+}
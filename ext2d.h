@@ -0,0 +1,84 @@
+#ifndef EXT2D_PROTOCOL
+#define EXT2D_PROTOCOL
+
+#include <stdint.h>
+
+/*
+Wire protocol of ext2d, the image server. Clients connect to its Unix domain
+socket and send requests, each a header followed by length bytes of payload.
+Fields are in host byte order, the socket never leaves the machine.
+
+Requests may be pipelined: a client can send any number before reading the
+replies. A connection's requests are carried out in the order they were sent
+and its replies come back in the same order, each carrying the tag of its
+request.
+
+Requests that change an image are acknowledged only once the change has been
+flushed to the image file. The server flushes once for all the changes made
+since the last flush (group commit), so a busy server pays for one msync per
+round of requests rather than one per request.
+
+Payloads are NUL terminated strings, paths inside the image unless said
+otherwise:
+
+    EXT2D_OP_MKDIR    path                  flags: EXT2D_FLAG_INDEX
+    EXT2D_OP_CP       source, dest          source is a path on the server's machine
+    EXT2D_OP_LN       source, dest          flags: EXT2D_FLAG_SYMLINK
+    EXT2D_OP_RM       path
+    EXT2D_OP_RESTORE  path
+    EXT2D_OP_STAT     path                  reply payload: Ext2dStat
+    EXT2D_OP_READ     Ext2dRead, path       reply payload: the bytes read
+    EXT2D_OP_SYNC     (none)                acknowledged after the next flush
+
+A reply's status is 0 or the errno the request failed with. A request the
+server can't parse gets EINVAL; one longer than EXT2D_MAX_PAYLOAD closes the
+connection. A change whose image couldn't be flushed gets EIO: it was made,
+but isn't known to be on disk yet.
+*/
+
+#define EXT2D_OP_MKDIR 1
+#define EXT2D_OP_CP 2
+#define EXT2D_OP_LN 3
+#define EXT2D_OP_RM 4
+#define EXT2D_OP_RESTORE 5
+#define EXT2D_OP_STAT 6
+#define EXT2D_OP_READ 7
+#define EXT2D_OP_SYNC 8
+
+#define EXT2D_FLAG_INDEX 0x1
+#define EXT2D_FLAG_SYMLINK 0x1
+
+//Longest request payload accepted, and most bytes one read returns.
+#define EXT2D_MAX_PAYLOAD (64 * 1024)
+#define EXT2D_MAX_READ (1024 * 1024)
+
+typedef struct ext2d_request {
+    uint32_t length;    /* Payload bytes following the header */
+    uint32_t tag;       /* Echoed in the reply */
+    uint8_t op;
+    uint8_t image;      /* Index of the image in the server's command line */
+    uint16_t flags;
+} Ext2dRequest;
+
+typedef struct ext2d_reply {
+    uint32_t length;
+    uint32_t tag;
+    int32_t status;
+} Ext2dReply;
+
+typedef struct ext2d_read {
+    uint64_t offset;
+    uint32_t length;
+    uint32_t padding;
+} Ext2dRead;
+
+typedef struct ext2d_stat {
+    uint32_t inode;
+    uint16_t mode;
+    uint16_t links;
+    uint64_t size;
+    uint32_t sectors;
+    uint32_t mtime;
+} Ext2dStat;
+
+#endif
@@ -0,0 +1,319 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <time.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "ext2d.h"
+
+/*
+Load generator for ext2d. Opens a number of connections to the server and
+keeps up to depth requests in flight on each (pipelining), then reports the
+throughput and the latency of the requests, from being queued to send until
+the reply arrived. Workloads:
+
+    stat    stat / over and over, nothing changes
+    mkdir   a new directory per request, every reply waits for a flush
+    mixed   per directory: mkdir, cp a 4KB file in, stat it, read it, rm it
+
+The directories are named after the process id, so runs can be repeated on
+the same image.
+*/
+
+#define MAX_CONNECTIONS 256
+#define MIXED_FILE_SIZE 4096
+//Replies are read into a buffer this big, it only has to hold the largest one.
+#define CLIENT_BUFFER (64 * 1024)
+#define MIXED_STEPS 5
+
+typedef struct client {
+    int fd;
+    unsigned char *out;
+    size_t out_length;
+    size_t out_capacity;
+    size_t out_sent;
+    unsigned char in[CLIENT_BUFFER];
+    size_t in_length;
+    long issued;
+    int in_flight;
+} Client;
+
+static char *op_names[] = {"", "mkdir", "cp", "ln", "rm", "restore", "stat", "read", "sync"};
+
+static double now_seconds(void){
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+static int compare_doubles(const void *a, const void *b){
+    double x = *(const double *)a, y = *(const double *)b;
+    return x < y ? -1 : x > y;
+}
+
+/*
+Queues a request with payload made of extra (extra_length bytes) followed by
+the NUL terminated strings in args.
+*/
+static void queue_request(Client *client, uint8_t op, uint8_t image, uint16_t flags, uint32_t tag,
+        void *extra, size_t extra_length, char **args, int count){
+    size_t length = extra_length;
+    for(int i = 0; i < count; i++){
+        length += strlen(args[i]) + 1;
+    }
+    size_t needed = client->out_length + sizeof(Ext2dRequest) + length;
+    if(needed > client->out_capacity){
+        client->out_capacity = needed * 2;
+        client->out = realloc(client->out, client->out_capacity);
+        if(!client->out){
+            perror("realloc");
+            exit(1);
+        }
+    }
+    Ext2dRequest request = {length, tag, op, image, flags};
+    unsigned char *at = client->out + client->out_length;
+    memcpy(at, &request, sizeof(request));
+    at += sizeof(request);
+    memcpy(at, extra, extra_length);
+    at += extra_length;
+    for(int i = 0; i < count; i++){
+        size_t arg_length = strlen(args[i]) + 1;
+        memcpy(at, args[i], arg_length);
+        at += arg_length;
+    }
+    client->out_length = needed;
+}
+
+/*
+Queues request number sequence of the workload on connection c. Returns the op.
+*/
+static int queue_workload(Client *client, char *workload, int c, long sequence, uint32_t tag, int image, char *source){
+    char path[128], file[160];
+    char *args[2];
+    if(strcmp(workload, "stat") == 0){
+        args[0] = "/";
+        queue_request(client, EXT2D_OP_STAT, image, 0, tag, NULL, 0, args, 1);
+        return EXT2D_OP_STAT;
+    }
+    if(strcmp(workload, "mkdir") == 0){
+        snprintf(path, sizeof(path), "/load_%d_%d_%ld", getpid(), c, sequence);
+        args[0] = path;
+        queue_request(client, EXT2D_OP_MKDIR, image, 0, tag, NULL, 0, args, 1);
+        return EXT2D_OP_MKDIR;
+    }
+    snprintf(path, sizeof(path), "/load_%d_%d_%ld", getpid(), c, sequence / MIXED_STEPS);
+    snprintf(file, sizeof(file), "%s/f", path);
+    Ext2dRead range = {0, MIXED_FILE_SIZE, 0};
+    switch(sequence % MIXED_STEPS){
+        case 0:
+            args[0] = path;
+            queue_request(client, EXT2D_OP_MKDIR, image, 0, tag, NULL, 0, args, 1);
+            return EXT2D_OP_MKDIR;
+        case 1:
+            args[0] = source;
+            args[1] = file;
+            queue_request(client, EXT2D_OP_CP, image, 0, tag, NULL, 0, args, 2);
+            return EXT2D_OP_CP;
+        case 2:
+            args[0] = file;
+            queue_request(client, EXT2D_OP_STAT, image, 0, tag, NULL, 0, args, 1);
+            return EXT2D_OP_STAT;
+        case 3:
+            args[0] = file;
+            queue_request(client, EXT2D_OP_READ, image, 0, tag, &range, sizeof(range), args, 1);
+            return EXT2D_OP_READ;
+        default:
+            args[0] = file;
+            queue_request(client, EXT2D_OP_RM, image, 0, tag, NULL, 0, args, 1);
+            return EXT2D_OP_RM;
+    }
+}
+
+static int connect_to(char *path){
+    struct sockaddr_un address;
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    strncpy(address.sun_path, path, sizeof(address.sun_path) - 1);
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if(fd < 0 || connect(fd, (struct sockaddr *)&address, sizeof(address)) < 0){
+        return -1;
+    }
+    fcntl(fd, F_SETFL, O_NONBLOCK);
+    return fd;
+}
+
+/*
+Prints the percentiles of count latencies (seconds), sorting them in place.
+*/
+static void print_latencies(char *label, double *latencies, long count){
+    if(count == 0){
+        return;
+    }
+    qsort(latencies, count, sizeof(double), compare_doubles);
+    printf("  %-8s %8ld requests  p50 %9.1f us  p99 %9.1f us  max %9.1f us\n", label, count,
+        latencies[count / 2] * 1e6, latencies[(long)(count * 0.99)] * 1e6, latencies[count - 1] * 1e6);
+}
+
+int main(int argc, char **argv) {
+    int image = 0;
+    if(argc >= 3 && strcmp(argv[1], "--image") == 0){
+        image = atoi(argv[2]);
+        argv[2] = argv[0];
+        argv += 2;
+        argc -= 2;
+    }
+    if(argc < 3 || argc > 6) {
+        fprintf(stderr, "Usage: %s [--image n] <socket path> <stat|mkdir|mixed> [requests] [connections] [depth]\n", argv[0]);
+        exit(1);
+    }
+    char *workload = argv[2];
+    long requests = argc > 3 ? atol(argv[3]) : 100000;
+    int connection_count = argc > 4 ? atoi(argv[4]) : 4;
+    int depth = argc > 5 ? atoi(argv[5]) : 16;
+    if(strcmp(workload, "stat") != 0 && strcmp(workload, "mkdir") != 0 && strcmp(workload, "mixed") != 0){
+        fprintf(stderr, "%s: unknown workload %s\n", argv[0], workload);
+        exit(1);
+    }
+    if(requests <= 0 || connection_count <= 0 || connection_count > MAX_CONNECTIONS || depth <= 0){
+        fprintf(stderr, "%s: requests, connections and depth must be positive, at most %d connections\n", argv[0], MAX_CONNECTIONS);
+        exit(1);
+    }
+
+    //The server copies from this file, so it has to sit on the same machine.
+    char source[] = "/tmp/ext2d_load_XXXXXX";
+    int source_fd = mkstemp(source);
+    if(source_fd < 0){
+        perror("mkstemp");
+        exit(1);
+    }
+    unsigned char data[MIXED_FILE_SIZE];
+    memset(data, 'x', sizeof(data));
+    if(write(source_fd, data, sizeof(data)) != sizeof(data)){
+        perror("write");
+        exit(1);
+    }
+    close(source_fd);
+
+    Client *clients = calloc(connection_count, sizeof(Client));
+    double *sent_at = malloc(requests * sizeof(double));
+    double *latencies = malloc(requests * sizeof(double));
+    unsigned char *ops = malloc(requests);
+    if(!clients || !sent_at || !latencies || !ops){
+        perror("malloc");
+        exit(1);
+    }
+    for(int c = 0; c < connection_count; c++){
+        clients[c].fd = connect_to(argv[1]);
+        if(clients[c].fd < 0){
+            perror("Failed to connect to server.");
+            exit(1);
+        }
+    }
+
+    //Requests are handed out round robin, request n goes to connection n % connection_count.
+    long completed = 0, failed = 0;
+    int first_error = 0;
+    struct pollfd fds[MAX_CONNECTIONS];
+    double start = now_seconds();
+    while(completed < requests){
+        for(int c = 0; c < connection_count; c++){
+            Client *client = &clients[c];
+            while(client->in_flight < depth){
+                long tag = client->issued * connection_count + c;
+                if(tag >= requests){
+                    break;
+                }
+                ops[tag] = queue_workload(client, workload, c, client->issued, tag, image, source);
+                sent_at[tag] = now_seconds();
+                client->issued++;
+                client->in_flight++;
+            }
+            fds[c].fd = client->fd;
+            fds[c].events = POLLIN | (client->out_sent < client->out_length ? POLLOUT : 0);
+        }
+        if(poll(fds, connection_count, -1) < 0){
+            if(errno == EINTR){
+                continue;
+            }
+            perror("poll");
+            exit(1);
+        }
+        for(int c = 0; c < connection_count; c++){
+            Client *client = &clients[c];
+            if(fds[c].revents & POLLOUT){
+                ssize_t written = write(client->fd, client->out + client->out_sent, client->out_length - client->out_sent);
+                if(written > 0){
+                    client->out_sent += written;
+                    if(client->out_sent == client->out_length){
+                        client->out_sent = client->out_length = 0;
+                    }
+                }
+            }
+            if(!(fds[c].revents & (POLLIN | POLLHUP | POLLERR))){
+                continue;
+            }
+            ssize_t bytes_read = read(client->fd, client->in + client->in_length, sizeof(client->in) - client->in_length);
+            if(bytes_read <= 0){
+                if(bytes_read < 0 && (errno == EAGAIN || errno == EINTR)){
+                    continue;
+                }
+                fprintf(stderr, "%s: server closed the connection\n", argv[0]);
+                exit(1);
+            }
+            client->in_length += bytes_read;
+            size_t offset = 0;
+            double now = now_seconds();
+            while(client->in_length - offset >= sizeof(Ext2dReply)){
+                Ext2dReply reply;
+                memcpy(&reply, client->in + offset, sizeof(reply));
+                if(client->in_length - offset < sizeof(reply) + reply.length){
+                    break;
+                }
+                if(reply.tag < requests){
+                    latencies[reply.tag] = now - sent_at[reply.tag];
+                }
+                if(reply.status != 0){
+                    failed++;
+                    if(!first_error){
+                        first_error = reply.status;
+                    }
+                }
+                completed++;
+                client->in_flight--;
+                offset += sizeof(reply) + reply.length;
+            }
+            memmove(client->in, client->in + offset, client->in_length - offset);
+            client->in_length -= offset;
+        }
+    }
+    double elapsed = now_seconds() - start;
+    unlink(source);
+
+    printf("%s: %ld requests over %d connections, %d deep, in %.3f s: %.0f ops/s, %ld failed",
+        workload, requests, connection_count, depth, elapsed, requests / elapsed, failed);
+    if(first_error){
+        printf(" (first: %s)", strerror(first_error));
+    }
+    printf("\n");
+    //Per op first, which needs the latencies grouped by op, then all of them together.
+    double *grouped = malloc(requests * sizeof(double));
+    for(int op = EXT2D_OP_MKDIR; op <= EXT2D_OP_SYNC && grouped; op++){
+        long count = 0;
+        for(long n = 0; n < requests; n++){
+            if(ops[n] == op){
+                grouped[count++] = latencies[n];
+            }
+        }
+        if(count < requests){
+            print_latencies(op_names[op], grouped, count);
+        }
+    }
+    print_latencies("all", latencies, requests);
+    return 0;
+}
@@ -1,159 +1,457 @@
 #include "helper.h"
+
 /*
-Returns pointer to the starting point of the image, if fails, returns NULL.
+Returns whether the group layout super_block describes is one the tools can
+use: 1 KB blocks start at block 1, a group's bitmaps fit in one block each,
+and the groups hold every block and inode.
 */
-unsigned char* load_image(char *path){
-    unsigned char* disk = NULL;
-    DISK_IMAGE_FILE_DESCRIPTOR = open(path, O_RDWR);
-    disk = mmap(NULL, 128 * 1024, PROT_READ | PROT_WRITE, MAP_SHARED, DISK_IMAGE_FILE_DESCRIPTOR, 0);
-    if(disk == MAP_FAILED) {
-        disk = NULL;
-    }
-    return disk;
+static int geometry_is_sane(struct ext2_super_block *super_block){
+    unsigned long long blocks_per_group = super_block->s_blocks_per_group;
+    unsigned long long inodes_per_group = super_block->s_inodes_per_group;
+    if(super_block->s_first_data_block != 1 || super_block->s_blocks_count <= super_block->s_first_data_block
+        || blocks_per_group == 0 || blocks_per_group > EXT2_BLOCK_SIZE * 8
+        || inodes_per_group == 0 || inodes_per_group > EXT2_BLOCK_SIZE * 8){
+        return FALSE;
+    }
+    unsigned long long group_count = (super_block->s_blocks_count - super_block->s_first_data_block + blocks_per_group - 1) / blocks_per_group;
+    return super_block->s_inodes_count <= group_count * inodes_per_group;
 }
 
 /*
-Writes the modified disk buffer back to the original file.
+Opens the image at path and returns a handle to it, or NULL with errno set.
+The mapping covers the whole file system as described by its superblock, and
+hints (IMAGE_HINT_*) tell the kernel how the calling tool is going to touch it.
 */
-int save_image(unsigned char* disk){
-    return write(DISK_IMAGE_FILE_DESCRIPTOR, disk, BLOCK_COUNT * EXT2_BLOCK_SIZE);
+ext2_fs* load_image(char *path, int hints){
+    struct ext2_super_block super_block;
+    struct stat image_stat;
+
+    ext2_fs *fs = calloc(1, sizeof(ext2_fs));
+    if(!fs){
+        return NULL;
+    }
+    dcache_init(&fs->dcache);
+    fs->stats = (hints & IMAGE_HINT_STATS) != 0;
+    fs->read_only = (hints & IMAGE_HINT_READ_ONLY) != 0;
+    fs->fd = open(path, fs->read_only ? O_RDONLY : O_RDWR);
+    if(fs->fd < 0){
+        free(fs);
+        return NULL;
+    }
+
+    //The superblock always sits 1024 bytes in, read it before deciding how much to map.
+    if(pread(fs->fd, &super_block, sizeof(super_block), EXT2_SUPER_BLOCK_OFFSET) != sizeof(super_block)
+        || super_block.s_magic != EXT2_SUPER_MAGIC){
+        close_image(fs);
+        errno = EINVAL;
+        return NULL;
+    }
+    //Every tool assumes EXT2_BLOCK_SIZE blocks, refuse anything else rather than corrupt it.
+    if((1024 << super_block.s_log_block_size) != EXT2_BLOCK_SIZE){
+        close_image(fs);
+        errno = EINVAL;
+        return NULL;
+    }
+    //Group geometry is divided by everywhere, a zero here would be SIGFPE not an error.
+    if(!geometry_is_sane(&super_block)){
+        close_image(fs);
+        errno = EINVAL;
+        return NULL;
+    }
+    fs->size = (size_t)super_block.s_blocks_count * EXT2_BLOCK_SIZE;
+    if(fstat(fs->fd, &image_stat) < 0 || (size_t)image_stat.st_size < fs->size){
+        //Truncated image, touching the tail of the mapping would SIGBUS.
+        close_image(fs);
+        errno = EINVAL;
+        return NULL;
+    }
+
+    int map_flags = fs->read_only ? MAP_PRIVATE : MAP_SHARED;
+    if(hints & IMAGE_HINT_POPULATE){
+        map_flags |= MAP_POPULATE;
+    }
+    fs->disk = mmap(NULL, fs->size, fs->read_only ? PROT_READ : PROT_READ | PROT_WRITE, map_flags, fs->fd, 0);
+    if(fs->disk == MAP_FAILED) {
+        fs->disk = NULL;
+        close_image(fs);
+        return NULL;
+    }
+    if(hints & IMAGE_HINT_SEQUENTIAL){
+        madvise(fs->disk, fs->size, MADV_SEQUENTIAL);
+    }else if(hints & IMAGE_HINT_RANDOM){
+        madvise(fs->disk, fs->size, MADV_RANDOM);
+    }
+
+    fs->dirty_map = calloc(super_block.s_blocks_count / 8 + 1, 1);
+    fs->free_shards = aligned_alloc(64, sizeof(FreeCountShard) * FREE_COUNT_SHARDS);
+    if(hints & IMAGE_HINT_THREADS){
+        fs->dir_locks = malloc(sizeof(pthread_rwlock_t) * DIR_LOCK_COUNT);
+    }
+    if(!fs->dirty_map || !fs->free_shards || ((hints & IMAGE_HINT_THREADS) && !fs->dir_locks) || load_geometry(fs) < 0){
+        close_image(fs);
+        errno = ENOMEM;
+        return NULL;
+    }
+    memset(fs->free_shards, 0, sizeof(FreeCountShard) * FREE_COUNT_SHARDS);
+    for(int i = 0; fs->dir_locks && i < DIR_LOCK_COUNT; i++){
+        pthread_rwlock_init(&fs->dir_locks[i], NULL);
+    }
+    return fs;
 }
 
 /*
-Takes in the path argument for EXT2, fixes path for trailing slashes
-returns linked list of PathNodes to be processed by other functions.
-TODO: Make notification system for relative paths!
+Unmaps the image and frees the handle. Changes not flushed by save_image are
+still written back by the kernel eventually, the mapping being shared, apart
+from free counter changes not folded into the superblock yet.
 */
-PathNode *create_path_list(char *path){
-    char* token;
-    PathNode *head = NULL;
-    char *copy = NULL, *original = NULL;
-    copy = original = strdup(path);
-
-    while ((token = strsep(&copy, "/")) != NULL){
-        if(strlen(token) > 0){
-            if(head){
-                PathNode *current = head;
-                //Insert at the end of the list:
-                while(current->next){
-                    current = current->next;
-                }
-                PathNode *node = malloc(sizeof(PathNode));
-                int length = strlen(token);
-                node->filename = malloc(length + 1);
-                strncpy(node->filename, token, length);
-                node->filename[length] = '\0';
-                node->next = NULL;
-
-                current->next = node;
-            }else{
-                head = malloc(sizeof(PathNode));
-                int length = strlen(token);
-                head->filename = malloc(length + 1);
-                strncpy(head->filename, token, length);
-                head->filename[length] = '\0';
-                head->next = NULL;
-            }
+void close_image(ext2_fs *fs){
+    if(fs->disk && fs->free_shards && !fs->read_only){
+        fold_free_counts(fs);
+    }
+    if(fs->disk){
+        munmap(fs->disk, fs->size);
+    }
+    if(fs->fd >= 0){
+        close(fs->fd);
+    }
+    free(fs->dirty_map);
+    free(fs->geometry.block_cursors);
+    free(fs->geometry.inode_cursors);
+    free(fs->free_shards);
+    if(fs->dir_locks){
+        for(int i = 0; i < DIR_LOCK_COUNT; i++){
+            pthread_rwlock_destroy(&fs->dir_locks[i]);
         }
+        free(fs->dir_locks);
+    }
+    dcache_destroy(&fs->dcache);
+    free(fs);
+}
+
+/*
+Works out the group layout from the superblock once, so the per-inode and
+per-block lookups are a division away, and locates the group descriptor table
+(the block right after the one holding the superblock). Returns 0, or -1 if
+the allocator state can't be allocated.
+*/
+int load_geometry(ext2_fs *fs){
+    struct ext2_super_block *super_block = get_super_block(fs);
+    fs->geometry.blocks_count = super_block->s_blocks_count;
+    fs->geometry.inodes_count = super_block->s_inodes_count;
+    fs->geometry.first_data_block = super_block->s_first_data_block;
+    fs->geometry.blocks_per_group = super_block->s_blocks_per_group;
+    fs->geometry.inodes_per_group = super_block->s_inodes_per_group;
+    fs->geometry.group_count = (super_block->s_blocks_count - super_block->s_first_data_block + super_block->s_blocks_per_group - 1) / super_block->s_blocks_per_group;
+    //Revision 0 images don't record an inode size, their inodes are all 128 bytes.
+    if(super_block->s_rev_level > 0){
+        fs->geometry.inode_size = super_block->s_inode_size;
+    }else{
+        fs->geometry.inode_size = sizeof(struct ext2_inode);
     }
-    free(original);
-    return head;
+    fs->geometry.group_descriptors = (struct ext2_group_desc *)get_block(fs, super_block->s_first_data_block + 1);
+    fs->geometry.block_goal_group = 0;
+    fs->geometry.block_cursors = calloc(fs->geometry.group_count, sizeof(unsigned int));
+    fs->geometry.inode_cursors = calloc(fs->geometry.group_count, sizeof(unsigned int));
+    if(!fs->geometry.block_cursors || !fs->geometry.inode_cursors){
+        return -1;
+    }
+    return 0;
 }
 
 /*
-Retuns block number of the next free block, search starting from the beginning
-of the block bitmap. If no more free blocks, return -ENOSPC.
+Flushes the blocks marked dirty since load back to the original file. The
+mapping is shared, so this only has to msync the touched ranges, which are
+widened to whole pages and coalesced into runs first. Free counter changes
+are folded into the superblock before it goes. Must not run while other
+threads are changing the image. Does nothing for a read only image. Returns
+0 on success, -1 with errno set if any run fails to sync, in which case every
+block stays marked dirty for the next call to try again.
 */
-int get_free_block(unsigned char* disk){
-    unsigned char* bitmap = get_block_bitmap(disk);
-    for(int i = 0; i < 16; i++){
-        char mask = 1;
-        for(int j = 0; j < 8; j++){
-            if(!(bitmap[i] & mask)){
-                return i*8 + j + 1;
+int save_image(ext2_fs *fs){
+    size_t page_size = sysconf(_SC_PAGESIZE);
+    size_t run_start = 0, run_end = 0, flushed = 0;
+    unsigned int block_count = fs->size / EXT2_BLOCK_SIZE;
+    int runs = 0, dirty_blocks = 0, ret = 0, error = 0;
+
+    if(fs->read_only){
+        return 0;
+    }
+
+    fold_free_counts(fs);
+
+    for(unsigned int b = 0; b < block_count; b++){
+        if(!fs->dirty_map[b / 8]){
+            //Skip clean bytes of the map in one go.
+            b |= 7;
+            continue;
+        }
+        if(!(fs->dirty_map[b / 8] & (1 << (b % 8)))){
+            continue;
+        }
+        dirty_blocks++;
+        size_t start = ((size_t)b * EXT2_BLOCK_SIZE) & ~(page_size - 1);
+        size_t end = (size_t)(b + 1) * EXT2_BLOCK_SIZE;
+        end = (end + page_size - 1) & ~(page_size - 1);
+        if(end > fs->size){
+            end = fs->size;
+        }
+        if(run_end > 0 && start <= run_end){
+            //Touches or overlaps the current run, just grow it.
+            if(end > run_end){
+                run_end = end;
             }
-            mask = mask << 1;
+            continue;
+        }
+        if(run_end > 0){
+            if(msync(fs->disk + run_start, run_end - run_start, MS_SYNC) < 0 && ret == 0){
+                ret = -1;
+                error = errno;
+            }
+            flushed += run_end - run_start;
+            runs++;
+        }
+        run_start = start;
+        run_end = end;
+    }
+    if(run_end > 0){
+        if(msync(fs->disk + run_start, run_end - run_start, MS_SYNC) < 0 && ret == 0){
+            ret = -1;
+            error = errno;
+        }
+        flushed += run_end - run_start;
+        runs++;
+    }
+    if(ret == 0){
+        memset(fs->dirty_map, 0, block_count / 8 + 1);
+    }
+
+    if(fs->stats){
+        fprintf(stderr, "flushed %zu bytes in %d runs (%d dirty blocks)\n", flushed, runs, dirty_blocks);
+    }
+    if(ret < 0){
+        //The first failure is the one reported, not whatever the stats left.
+        errno = error;
+    }
+    return ret;
+}
+
+/*
+Marks count blocks starting at block_num as modified so save_image flushes them.
+Bits already set are left alone, so threads writing nearby blocks mostly read
+the map rather than fight over it.
+*/
+void mark_blocks_dirty(ext2_fs *fs, unsigned int block_num, unsigned int count){
+    for(unsigned int b = block_num; b < block_num + count; b++){
+        unsigned char mask = 1 << (b % 8);
+        if(!(__atomic_load_n(&fs->dirty_map[b / 8], __ATOMIC_RELAXED) & mask)){
+            __atomic_fetch_or(&fs->dirty_map[b / 8], mask, __ATOMIC_RELAXED);
+        }
+    }
+}
+
+/*
+Marks every block overlapping the length bytes at start as modified.
+*/
+void mark_dirty(ext2_fs *fs, void* start, size_t length){
+    size_t offset = (unsigned char*)start - fs->disk;
+    unsigned int first = offset / EXT2_BLOCK_SIZE;
+    unsigned int last = (offset + length - 1) / EXT2_BLOCK_SIZE;
+    mark_blocks_dirty(fs, first, last - first + 1);
+}
+
+/*
+Removes a "--stats" flag from the argument list, adding IMAGE_HINT_STATS to
+hints if it was there. Returns the new argument count.
+*/
+int parse_stats_flag(int argc, char **argv, int *hints){
+    int kept = 0;
+    for(int i = 0; i < argc; i++){
+        if(strcmp(argv[i], "--stats") == 0){
+            *hints |= IMAGE_HINT_STATS;
+        }else{
+            argv[kept++] = argv[i];
+        }
+    }
+    argv[kept] = NULL;
+    return kept;
+}
+
+/*
+Locks directory inode_num for reading (looking names up) or writing (adding
+and removing entries). No-ops unless the image was opened with
+IMAGE_HINT_THREADS.
+*/
+void dir_lock_read(ext2_fs *fs, int inode_num){
+    if(fs->dir_locks){
+        pthread_rwlock_rdlock(&fs->dir_locks[inode_num % DIR_LOCK_COUNT]);
+    }
+}
+
+void dir_lock_write(ext2_fs *fs, int inode_num){
+    if(fs->dir_locks){
+        pthread_rwlock_wrlock(&fs->dir_locks[inode_num % DIR_LOCK_COUNT]);
+    }
+}
+
+void dir_unlock(ext2_fs *fs, int inode_num){
+    if(fs->dir_locks){
+        pthread_rwlock_unlock(&fs->dir_locks[inode_num % DIR_LOCK_COUNT]);
+    }
+}
+
+/*
+Returns pointer to the start of block block_num. The offset is computed in
+size_t so blocks past the first 2GB of the image are reachable.
+*/
+unsigned char* get_block(ext2_fs *fs, unsigned int block_num){
+    return fs->disk + (size_t)EXT2_BLOCK_SIZE * block_num;
+}
+
+/*
+Returns 1 if the EXT2_BLOCK_SIZE bytes at data are all zeros, 0 otherwise.
+*/
+int block_is_zero(const unsigned char *data){
+    return bitmap_all_clear(data, EXT2_BLOCK_SIZE * 8);
+}
+
+/*
+Retuns block number of the next free block, claimed in the bitmap and taken
+off the free counts. The search starts in the group the last inode was
+allocated from so a file's data lands near its inode, skips groups whose
+descriptor says they are full, and wraps around. Inside a group it resumes
+from that group's next-fit cursor. The goal and cursors are only hints, so
+threads share them without locking. If no more free blocks, return -ENOSPC.
+*/
+int get_free_block(ext2_fs *fs){
+    unsigned int goal = __atomic_load_n(&fs->geometry.block_goal_group, __ATOMIC_RELAXED);
+    for(unsigned int n = 0; n < fs->geometry.group_count; n++){
+        unsigned int group = (goal + n) % fs->geometry.group_count;
+        if(__atomic_load_n(&fs->geometry.group_descriptors[group].bg_free_blocks_count, __ATOMIC_RELAXED) == 0){
+            continue;
+        }
+        unsigned char *bitmap = get_block_bitmap(fs, group);
+        long bit = bitmap_claim_zero(bitmap, group_block_count(fs, group), __atomic_load_n(&fs->geometry.block_cursors[group], __ATOMIC_RELAXED));
+        if(bit >= 0){
+            __atomic_store_n(&fs->geometry.block_cursors[group], bit + 1, __ATOMIC_RELAXED);
+            __atomic_store_n(&fs->geometry.block_goal_group, group, __ATOMIC_RELAXED);
+            int block = fs->geometry.first_data_block + group * fs->geometry.blocks_per_group + bit;
+            mark_dirty(fs, &bitmap[bit / 8], 1);
+            update_free_count(fs, block, -1, BLOCK);
+            return block;
         }
     }
     return -ENOSPC;
 }
 
 /*
-Retuns inode number in inode table of the next free inode, search starting from
-numbber EXT2_GOOD_OLD_FIRST_INO of the inode bitmap. If no more free inodes,
-return -ENOSPC.
+Retuns inode number in inode table of the next free inode, claimed in the
+bitmap and taken off the free counts. New inodes are spread across the
+groups: the group with the most free inodes is tried first, then the rest in
+order, each from its next-fit cursor. If no more free inodes, return -ENOSPC.
 */
-int get_free_inode(unsigned char* disk){
-    unsigned char* bitmap = get_inode_bitmap(disk);
-    for(int i = 0; i < 4; i++){
-        char mask = 1;
-        for(int j = 0; j < 8; j++){
-            if(!(bitmap[i] & mask)){
-                return i*8 + j + 1;
-            }
-            mask = mask << 1;
+int get_free_inode(ext2_fs *fs){
+    unsigned int best = 0;
+    for(unsigned int group = 1; group < fs->geometry.group_count; group++){
+        if(fs->geometry.group_descriptors[group].bg_free_inodes_count > fs->geometry.group_descriptors[best].bg_free_inodes_count){
+            best = group;
+        }
+    }
+    for(unsigned int n = 0; n < fs->geometry.group_count; n++){
+        unsigned int group = (best + n) % fs->geometry.group_count;
+        if(__atomic_load_n(&fs->geometry.group_descriptors[group].bg_free_inodes_count, __ATOMIC_RELAXED) == 0){
+            continue;
+        }
+        unsigned char *bitmap = get_inode_bitmap(fs, group);
+        long bit = bitmap_claim_zero(bitmap, fs->geometry.inodes_per_group, __atomic_load_n(&fs->geometry.inode_cursors[group], __ATOMIC_RELAXED));
+        if(bit >= 0){
+            __atomic_store_n(&fs->geometry.inode_cursors[group], bit + 1, __ATOMIC_RELAXED);
+            //Keep the data of whatever gets this inode in the same group.
+            __atomic_store_n(&fs->geometry.block_goal_group, group, __ATOMIC_RELAXED);
+            int inode = group * fs->geometry.inodes_per_group + bit + 1;
+            mark_dirty(fs, &bitmap[bit / 8], 1);
+            update_free_count(fs, inode, -1, INODE);
+            return inode;
         }
     }
     return -ENOSPC;
 }
 
 /*
-Returns an inode struct from the disk's inode table at index inode_num.+
+Returns an inode struct from the inode table of the group owning inode_num.
 */
-struct ext2_inode* get_inode(unsigned char* disk, int inode_num){
-    struct ext2_group_desc *gd = get_group_descriptor(disk);
-    struct ext2_inode *inodes = (struct ext2_inode *)(disk + EXT2_BLOCK_SIZE * gd->bg_inode_table);
-    return &inodes[inode_num - 1];
+struct ext2_inode* get_inode(ext2_fs *fs, int inode_num){
+    unsigned int index = (inode_num - 1) % fs->geometry.inodes_per_group;
+    struct ext2_group_desc *gd = get_group_descriptor(fs, inode_group(fs, inode_num));
+    return (struct ext2_inode *)(get_block(fs, gd->bg_inode_table) + (size_t)index * fs->geometry.inode_size);
 }
 
 /*
-Returns the only superblock struct we have to worry about.
+Returns the primary superblock struct, the backups in other groups are left alone.
 */
-struct ext2_super_block* get_super_block(unsigned char* disk){
-    struct ext2_super_block *superblock = (struct ext2_super_block *)(disk + EXT2_BLOCK_SIZE);
+struct ext2_super_block* get_super_block(ext2_fs *fs){
+    struct ext2_super_block *superblock = (struct ext2_super_block *)(fs->disk + EXT2_SUPER_BLOCK_OFFSET);
     return superblock;
 }
 
 /*
-Returns the only group descriptor struct we have to worry about.
+Returns the descriptor of block group group from the table located at load.
 */
-struct ext2_group_desc* get_group_descriptor(unsigned char* disk){
-    struct ext2_group_desc *group_descriptor = (struct ext2_group_desc *)(disk + EXT2_BLOCK_SIZE * 2);
-    return group_descriptor;
+struct ext2_group_desc* get_group_descriptor(ext2_fs *fs, int group){
+    return &fs->geometry.group_descriptors[group];
 }
 
 /*
-Returns pointer to the start of the inode bitmap.
+Returns pointer to the start of the inode bitmap of block group group.
 */
-unsigned char* get_inode_bitmap(unsigned char* disk){
-    struct ext2_group_desc *gd = get_group_descriptor(disk);
-    unsigned char *inode_bitmap = (disk + EXT2_BLOCK_SIZE * gd->bg_inode_bitmap);
+unsigned char* get_inode_bitmap(ext2_fs *fs, int group){
+    struct ext2_group_desc *gd = get_group_descriptor(fs, group);
+    unsigned char *inode_bitmap = get_block(fs, gd->bg_inode_bitmap);
     return inode_bitmap;
 }
 
 /*
-Returns pointer to the start of the inode bitmap.
+Returns pointer to the start of the block bitmap of block group group.
 */
-unsigned char* get_block_bitmap(unsigned char* disk){
-    struct ext2_group_desc *gd = get_group_descriptor(disk);
-    unsigned char *block_bitmap = (disk + EXT2_BLOCK_SIZE * gd->bg_block_bitmap);
+unsigned char* get_block_bitmap(ext2_fs *fs, int group){
+    struct ext2_group_desc *gd = get_group_descriptor(fs, group);
+    unsigned char *block_bitmap = get_block(fs, gd->bg_block_bitmap);
     return block_bitmap;
 }
 
+/*
+Returns the block group holding inode inode_num.
+*/
+int inode_group(ext2_fs *fs, int inode_num){
+    return (inode_num - 1) / fs->geometry.inodes_per_group;
+}
+
+/*
+Returns the block group holding block block_num.
+*/
+int block_group(ext2_fs *fs, int block_num){
+    return (block_num - fs->geometry.first_data_block) / fs->geometry.blocks_per_group;
+}
+
+/*
+Returns how many blocks group group covers, only the last group can be short.
+*/
+unsigned int group_block_count(ext2_fs *fs, int group){
+    unsigned int first = fs->geometry.first_data_block + group * fs->geometry.blocks_per_group;
+    if(fs->geometry.blocks_count - first < fs->geometry.blocks_per_group){
+        return fs->geometry.blocks_count - first;
+    }
+    return fs->geometry.blocks_per_group;
+}
+
 /*
 Prints information about an inode, just like in readimage.c
 May be useful for debugging stuff.
 */
-void print_inode(unsigned char* disk, int inode_num){
-    struct ext2_inode* inode = get_inode(disk, inode_num);
+void print_inode(ext2_fs *fs, int inode_num){
+    struct ext2_inode* inode = get_inode(fs, inode_num);
     inode_num -= 1;
 
-    int offset = inode_num % 8;
-    int byte = inode_num / 8;
-    char mask = 1 << offset;
-    unsigned char* inode_bitmap = get_inode_bitmap(disk);
-
-    if((inode_num == EXT2_ROOT_INO - 1 || inode_num > EXT2_GOOD_OLD_FIRST_INO - 1) && inode_bitmap[byte] & mask){
+    if((inode_num == EXT2_ROOT_INO - 1 || inode_num > EXT2_GOOD_OLD_FIRST_INO - 1) && check_bitmap(fs, inode_num + 1, INODE)){
         if(inode->i_size > 0){
             char type;
             unsigned int mode_mask = 0xf000;
@@ -184,363 +482,277 @@ void print_inode(unsigned char* disk, int inode_num){
     }
 }
 /*
-Taking in a list of pathnodes and a pointer to virtual disk image, traverse the
-directory entries one by one searching for the current indexed path node filename.
-If at any point the path cannot be resolved, return -ENOENT. Otherwise, return
-the block number of the file being sought after.
+Runs search (dir_block_find or dir_block_find_deleted) over every block of
+directory inode dir_inode_num, in order, until it finds the name_len
+bytes at name, which need not be NUL terminated. On success fills
+in the block and the offset inside it where the entry starts and returns 0,
+otherwise returns -ENOENT.
 */
-SearchResult find_dir_entry(unsigned char* disk, PathNode* path, int ignore_symlink){
-    PathNode *current = path;
+int scan_dir_blocks(ext2_fs *fs, int dir_inode_num, char *name, int name_len, int (*search)(const unsigned char*, const DirNameKey*, int*), int *block_num, int *offset){
+    DirNameKey key;
+    dir_name_key_init(&key, name, name_len);
+    BlockMapIter iter;
+    BlockExtent extent;
+    block_map_iter_init(&iter, fs, dir_inode_num, 0);
+    while(block_map_next(&iter, &extent)){
+        for(unsigned int block = extent.physical; block < extent.physical + extent.length; block++){
+            int found = search(get_block(fs, block), &key, NULL);
+            if(found >= 0){
+                *block_num = block;
+                *offset = found;
+                return 0;
+            }
+        }
+    }
+    return -ENOENT;
+}
+
+/*
+Returns whether a sound, live entry for the name_len bytes at name starts at
+offset inside block block_num, which is how a dentry cache hit is checked.
+*/
+static int dcache_hit_valid(ext2_fs *fs, int block_num, int offset, char *name, int name_len){
+    if(block_num <= 0 || (unsigned int)block_num >= fs->geometry.blocks_count || offset < 0){
+        return FALSE;
+    }
+    unsigned char *block = get_block(fs, block_num);
+    if(dir_block_next(block, offset) < 0 || ((struct ext2_dir_entry *)(block + offset))->inode == 0){
+        return FALSE;
+    }
+    DirNameKey key;
+    dir_name_key_init(&key, name, name_len);
+    return dir_entry_matches(block, offset, &key);
+}
+
+/*
+Looks up name in directory inode dir_inode_num. The dentry cache is consulted
+first, and a search of the directory blocks records its outcome there, misses
+included. The caller holds the directory's lock, if only for reading. Same
+return convention as scan_dir_blocks.
+*/
+int lookup_dir_entry(ext2_fs *fs, int dir_inode_num, char *name, int name_len, int *block_num, int *offset){
+    switch(dcache_lookup(&fs->dcache, dir_inode_num, name, name_len, block_num, offset)){
+        case DCACHE_HIT:
+            if(dcache_hit_valid(fs, *block_num, *offset, name, name_len)){
+                return 0;
+            }
+            //The block went elsewhere behind the cache's back: search afresh.
+            dcache_invalidate(&fs->dcache, dir_inode_num, name, name_len);
+            break;
+        case DCACHE_NEGATIVE:
+            return -ENOENT;
+    }
+    int found = DX_BAD_INDEX;
+    if(htree_is_indexed(fs, dir_inode_num)){
+        found = htree_lookup(fs, dir_inode_num, name, name_len, block_num, offset);
+    }
+    if(found == DX_BAD_INDEX){
+        found = scan_dir_blocks(fs, dir_inode_num, name, name_len, dir_block_find, block_num, offset);
+    }
+    if(found < 0){
+        dcache_insert_negative(&fs->dcache, dir_inode_num, name, name_len);
+        return -ENOENT;
+    }
+    dcache_insert(&fs->dcache, dir_inode_num, name, name_len, *block_num, *offset);
+    return 0;
+}
+
+/*
+Returns where the target of symbolic link inode_num is kept: inside the inode
+for a fast link, otherwise in its one data block. Sets *length to the
+target's length, i_size capped at where it is kept; the target need not be
+NUL terminated.
+*/
+char* get_link_target(ext2_fs *fs, int inode_num, int *length){
+    struct ext2_inode *inode = get_inode(fs, inode_num);
+    unsigned int size = inode->i_size;
+    if(inode->i_blocks == 0){
+        *length = size < sizeof(inode->i_block) ? size : sizeof(inode->i_block);
+        return (char*)inode->i_block;
+    }
+    *length = size < EXT2_BLOCK_SIZE ? size : EXT2_BLOCK_SIZE;
+    return (char*)get_block(fs, inode->i_block[0]);
+}
+
+/*
+Resolves path one component at a time for find_dir_entry. When the last
+component is a symbolic link to follow, it is not resolved here: *link_inode
+is set to its inode and the caller carries on with the link's target.
+*/
+static SearchResult search_path(ext2_fs *fs, PathView* path, int ignore_symlink, int *link_inode){
     SearchResult result;
     result.error_code = -ENOENT;
     result.parent_block_num = -1;
     result.parent_offset = -1;
+    result.parent_inode_num = EXT2_ROOT_INO;
     result.extra_info = MISSING_FILE;
     result.file_type = EXT2_FT_DIR;
     result.softlink_path = NULL;
-    struct ext2_inode *current_inode = get_inode(disk, EXT2_ROOT_INO);
-    int offset = 0;
 
-    if(!path){
+    if(path->count == 0){
         result.extra_info = JUST_ROOT;
         return result;
     }
-    do{
-        //Iterate through all block possible in directory inodes.
-        offset = -ENOENT;
-        int more_blocks = TRUE;
-        for(int j = 0; j < 12; j++){
-            if(current_inode->i_block[j] <= 0){
-                more_blocks = FALSE;
-                break;
-            }
-            offset = search_dir_block(disk, current->filename, current_inode->i_block[j]);
-            if(offset >= 0){
-                struct ext2_dir_entry *dir_entry = (struct ext2_dir_entry *)(disk + EXT2_BLOCK_SIZE * current_inode->i_block[j] + offset);
-                if(current->next && dir_entry->file_type != EXT2_FT_DIR){
-                    //Exit if there is more to the path but this current file is regular.
-                    //We can assume no symbolic links will appear within path, just at end.
-                    result.extra_info = BAD_PATH;
-                    return result;
-                }else if (!current->next){
-                    //We reached the end of our filepath and came out on top!
-                    //Check if the final file is a symbolic link.
-                    if(dir_entry->file_type == EXT2_FT_SYMLINK && !ignore_symlink){
-                        struct ext2_inode* link_inode = get_inode(disk, dir_entry->inode);
-                        //Assume there is only one block for the symbolic link.
-                        int link_block = link_inode->i_block[0];
-                        char *link_path = (char*)(disk + EXT2_BLOCK_SIZE * link_block);
-                        //Calculate length on first pass:
-                        int counter = 0;
-                        while(link_path[counter] != '\0'){
-                            counter++;
-                        }
-                        char new_path[counter + 1];
-                        strncpy(new_path, link_path, counter + 1);
-                        PathNode *new_path_list = create_path_list(new_path);
-                        SearchResult new_result = find_dir_entry(disk, new_path_list, ignore_symlink);
-                        new_result.softlink_path = link_path;
-                        destroy_path_list(new_path_list);
-                        return new_result;
-                    }
-                    result.error_code = 0;
-                    result.offset = offset;
-                    result.block_num = current_inode->i_block[j];
-                    result.file_type = dir_entry->file_type;
-                    result.inode_num = dir_entry->inode;
-                    return result;
-                }else{
-                    /*
-                    We found the file we want at this level, no need to check other blocks.
-                    Move on to the next file level in the path.
-                    */
-                    result.parent_block_num = current_inode->i_block[j];
-                    result.parent_offset = offset;
-                    current_inode = get_inode(disk, dir_entry->inode);
-                    more_blocks = FALSE;
-                    break;
-                }
-            }else{
-                if(!current->next){
-                    result.extra_info = MISSING_FILE;
-                }else{
-                    result.extra_info = BAD_PATH;
-                }
-                return result;
-            }
-        }
-        //If there are still more blocks, they are indirectly listed.
-        if(more_blocks){
-            int block_list = current_inode->i_block[12];
-            unsigned int *indirect_blocks = (unsigned int*)(disk + EXT2_BLOCK_SIZE * block_list);
-            while(*indirect_blocks > 0){
-                //These are the indefinite list of block numbers, call search like above.
-                offset = search_dir_block(disk, current->filename, *indirect_blocks);
-                if(offset != -ENOENT){
-                    struct ext2_dir_entry *dir_entry = (struct ext2_dir_entry *)(disk + EXT2_BLOCK_SIZE * *indirect_blocks + offset);
-                    if(current->next && dir_entry->file_type != EXT2_FT_DIR){
-                        //TLDR we found it but it's the wrong type.
-                        //Exit if there is more to the path but this current file is regular.
-                        //We can assume no symbolic links will appear within path, just at end.
-                        result.extra_info = BAD_PATH;
-                        return result;
-                    }else if (!current->next){
-                        //We reached the end of our filepath and came out on top!
-                        //Check if the final file is a symbolic link.
-                        if(dir_entry->file_type == EXT2_FT_SYMLINK && !ignore_symlink){
-                            struct ext2_inode* link_inode = get_inode(disk, dir_entry->inode);
-                            //Assume there is only one block for the symbolic link.
-                            int link_block = link_inode->i_block[0];
-                            char *link_path = (char*)(disk + EXT2_BLOCK_SIZE * link_block);
-                            //Calculate length on first pass:
-                            int counter = 0;
-                            while(link_path[counter] != '\0'){
-                                counter++;
-                            }
-                            char new_path[counter + 1];
-                            strncpy(new_path, link_path, counter + 1);
-                            PathNode *new_path_list = create_path_list(new_path);
-                            SearchResult new_result = find_dir_entry(disk, new_path_list, ignore_symlink);
-                            new_result.softlink_path = link_path;
-                            destroy_path_list(new_path_list);
-                            return new_result;
-                        }
-                        result.error_code = 0;
-                        result.offset = offset;
-                        result.block_num = *indirect_blocks;
-                        result.file_type = dir_entry->file_type;
-                        result.inode_num = dir_entry->inode;
-                        return result;
-                    }else{
-                        /*
-                        We found the file we want at this level, no need to check other blocks.
-                        Move on to the next file level in the path.
-                        */
-                        result.parent_block_num = *indirect_blocks;
-                        result.parent_offset = offset;
-                        current_inode = get_inode(disk, dir_entry->inode);
-                        more_blocks = FALSE;
-                        break;
-                    }
-                }else{
-                    if(!current->next){
-                        result.extra_info = MISSING_FILE;
-                    }else{
-                        result.extra_info = BAD_PATH;
-                    }
-                    return result;
-                }
-                indirect_blocks++;
-            }
-        }
-        /*
-        After looking through all the blocks, if we haven't found our file yet,
-        we won't find it.
-        */
-        if(offset == -ENOENT){
-            if(!current->next){
+    for(int i = 0; i < path->count; i++){
+        PathComponent *current = &path->components[i];
+        int is_last = (i == path->count - 1);
+        int block_num, offset;
+        dir_lock_read(fs, result.parent_inode_num);
+        if(lookup_dir_entry(fs, result.parent_inode_num, current->name, current->len, &block_num, &offset) < 0){
+            dir_unlock(fs, result.parent_inode_num);
+            /*
+            After looking through all the blocks, if we haven't found our file yet,
+            we won't find it.
+            */
+            if(is_last){
                 result.extra_info = MISSING_FILE;
             }else{
                 result.extra_info = BAD_PATH;
             }
             return result;
         }
-        if(current){
-            current = current->next;
+        //Copy the entry out while the directory can't change under us.
+        struct ext2_dir_entry dir_entry_copy = *(struct ext2_dir_entry *)(get_block(fs, block_num) + offset);
+        struct ext2_dir_entry *dir_entry = &dir_entry_copy;
+        dir_unlock(fs, result.parent_inode_num);
+        if(!is_last && dir_entry->file_type != EXT2_FT_DIR){
+            //Exit if there is more to the path but this current file is regular.
+            //We can assume no symbolic links will appear within path, just at end.
+            result.extra_info = BAD_PATH;
+            return result;
+        }else if (is_last){
+            //We reached the end of our filepath and came out on top!
+            //Check if the final file is a symbolic link.
+            if(dir_entry->file_type == EXT2_FT_SYMLINK && !ignore_symlink){
+                *link_inode = dir_entry->inode;
+                return result;
+            }
+            result.error_code = 0;
+            result.offset = offset;
+            result.block_num = block_num;
+            result.file_type = dir_entry->file_type;
+            result.inode_num = dir_entry->inode;
+            return result;
         }
-    }while(current);
+        /*
+        We found the file we want at this level, no need to check other blocks.
+        Move on to the next file level in the path.
+        */
+        result.parent_block_num = block_num;
+        result.parent_offset = offset;
+        result.parent_inode_num = dir_entry->inode;
+    }
 
     return result;
 }
 
 /*
-Taking in a list of pathnodes and a pointer to virtual disk image, traverse the
-directory entries one by one searching for the current indexed path node filename.
+Taking in a parsed path and a pointer to virtual disk image, traverse the
+directory entries one by one searching for each path component in turn.
 If at any point the path cannot be resolved, return -ENOENT. Otherwise, return
-the block number of the file being sought after.
+the block number of the file being sought after. Each directory is read
+locked while its entry is looked up, so by the time this returns the entry
+may have been moved or removed: callers changing it look it up again under
+the write lock.
+A symbolic link at the end of the path is followed, in a loop rather than by
+recursing, and after SYMLINK_MAX_HOPS links in a row the lookup fails with
+-ELOOP. softlink_path is then the first link's target.
 */
-SearchResult find_deleted_dir_entry(unsigned char* disk, PathNode* path){
-    PathNode *current = path;
+SearchResult find_dir_entry(ext2_fs *fs, PathView* path, int ignore_symlink){
+    PathView *link_view = NULL;
+    char *first_link = NULL;
+    for(int hops = 0; ; hops++){
+        int link_inode = 0;
+        SearchResult result = search_path(fs, path, ignore_symlink, &link_inode);
+        path_view_destroy(link_view);
+        link_view = NULL;
+        result.softlink_path = first_link;
+        if(!link_inode){
+            return result;
+        }
+        if(hops == SYMLINK_MAX_HOPS){
+            result.error_code = -ELOOP;
+            result.extra_info = BAD_PATH;
+            return result;
+        }
+        int length;
+        char *link_path = get_link_target(fs, link_inode, &length);
+        if(!first_link){
+            first_link = link_path;
+        }
+        //The view points into the link's block, so nothing is copied.
+        link_view = path_view_create_len(link_path, length);
+        if(!link_view){
+            result.extra_info = BAD_PATH;
+            return result;
+        }
+        path = link_view;
+    }
+}
+
+/*
+Same as find_dir_entry, but the final path component is looked for in the gaps
+left behind by removed entries. Symbolic links are not followed.
+*/
+SearchResult find_deleted_dir_entry(ext2_fs *fs, PathView* path){
     SearchResult result;
     result.error_code = -ENOENT;
     result.parent_block_num = -1;
     result.parent_offset = -1;
+    result.parent_inode_num = EXT2_ROOT_INO;
     result.extra_info = MISSING_FILE;
     result.file_type = EXT2_FT_UNKNOWN;
-    struct ext2_inode *current_inode = get_inode(disk, EXT2_ROOT_INO);
-    int offset = 0;
+    result.softlink_path = NULL;
 
-    if(!path){
+    if(path->count == 0){
         result.extra_info = JUST_ROOT;
         return result;
     }
-    do{
-        //Iterate through all block possible in directory inodes.
-        offset = -ENOENT;
-        int more_blocks = TRUE;
-        for(int j = 0; j < 12; j++){
-            if(current_inode->i_block[j] <= 0){
-                more_blocks = FALSE;
-                break;
-            }
-            /*
-            On the final search for the real file, must alter search function
-            to look in the gaps after dir entries where the rec_len is greater
-            than the minimum possible rec_len
-            */
-            if (!current->next){
-                offset = search_deleted_dir_block(disk, current->filename, current_inode->i_block[j]);
-            }else{
-                offset = search_dir_block(disk, current->filename, current_inode->i_block[j]);
-            }
-            if(offset >= 0){
-                struct ext2_dir_entry *dir_entry = (struct ext2_dir_entry *)(disk + EXT2_BLOCK_SIZE * current_inode->i_block[j] + offset);
-                if(current->next && dir_entry->file_type != EXT2_FT_DIR){
-                    //Exit if there is more to the path but this current file is regular.
-                    //We can assume no symbolic links will appear within path, just at end.
-                    result.extra_info = BAD_PATH;
-                    return result;
-                }else if (!current->next){
-                    //We reached the end of our filepath and came out on top!
-                    //Check if the final file is a symbolic link.
-                    /*
-                    if(dir_entry->file_type == EXT2_FT_SYMLINK){
-                        struct ext2_inode* link_inode = get_inode(disk, dir_entry->inode);
-                        //Assume there is only one block for the symbolic link.
-                        int link_block = link_inode->i_block[0];
-                        char *link_path = (char*)(disk + EXT2_BLOCK_SIZE * link_block);
-                        //Calculate length on first pass:
-                        int counter = 0;
-                        while(link_path[counter] != '\0'){
-                            counter++;
-                        }
-                        char new_path[counter + 1];
-                        strncpy(new_path, link_path, counter + 1);
-                        PathNode *new_path_list = create_path_list(new_path);
-                        SearchResult new_result = find_dir_entry(disk, new_path_list, FALSE);
-                        new_result.softlink_path = link_path;
-                        destroy_path_list(new_path_list);
-                        return new_result;
-                    }
-                    */
-                    result.error_code = 0;
-                    result.offset = offset;
-                    result.block_num = current_inode->i_block[j];
-                    result.file_type = dir_entry->file_type;
-                    result.inode_num = dir_entry->inode;
-                    return result;
-                }else{
-                    /*
-                    We found the file we want at this level, no need to check other blocks.
-                    Move on to the next file level in the path.
-                    */
-                    result.parent_block_num = current_inode->i_block[j];
-                    result.parent_offset = offset;
-                    current_inode = get_inode(disk, dir_entry->inode);
-                    more_blocks = FALSE;
-                    break;
-                }
-            }else{
-                if(!current->next){
-                    result.extra_info = MISSING_FILE;
-                }else{
-                    result.extra_info = BAD_PATH;
-                }
-                return result;
-            }
-        }
-        //If there are still more blocks, they are indirectly listed.
-        if(more_blocks){
-            int block_list = current_inode->i_block[12];
-            unsigned int *indirect_blocks = (unsigned int*)(disk + EXT2_BLOCK_SIZE * block_list);
-            while(*indirect_blocks > 0){
-                //These are the indefinite list of block numbers, call search like above.
-
-                /*
-                On the final search for the real file, must alter search function
-                to look in the gaps after dir entries where the rec_len is greater
-                than the minimum possible rec_len
-                */
-                if (!current->next){
-                    offset = search_deleted_dir_block(disk, current->filename, *indirect_blocks);
-                }else{
-                    offset = search_dir_block(disk, current->filename, *indirect_blocks);
-                }
-                if(offset != -ENOENT){
-                    struct ext2_dir_entry *dir_entry = (struct ext2_dir_entry *)(disk + EXT2_BLOCK_SIZE * *indirect_blocks + offset);
-                    if(current->next && dir_entry->file_type != EXT2_FT_DIR){
-                        //TLDR we found it but it's the wrong type.
-                        //Exit if there is more to the path but this current file is regular.
-                        //We can assume no symbolic links will appear within path, just at end.
-                        result.extra_info = BAD_PATH;
-                        return result;
-                    }else if (!current->next){
-                        //We reached the end of our filepath and came out on top!
-                        //Check if the final file is a symbolic link.
-                        /*
-                        if(dir_entry->file_type == EXT2_FT_SYMLINK){
-                            struct ext2_inode* link_inode = get_inode(disk, dir_entry->inode);
-                            //Assume there is only one block for the symbolic link.
-                            int link_block = link_inode->i_block[0];
-                            char *link_path = (char*)(disk + EXT2_BLOCK_SIZE * link_block);
-                            //Calculate length on first pass:
-                            int counter = 0;
-                            while(link_path[counter] != '\0'){
-                                counter++;
-                            }
-                            char new_path[counter + 1];
-                            strncpy(new_path, link_path, counter + 1);
-                            PathNode *new_path_list = create_path_list(new_path);
-                            SearchResult new_result = find_dir_entry(disk, new_path_list, FALSE);
-                            new_result.softlink_path = link_path;
-                            destroy_path_list(new_path_list);
-                            return new_result;
-                        }
-                        */
-                        result.error_code = 0;
-                        result.offset = offset;
-                        result.block_num = *indirect_blocks;
-                        result.file_type = dir_entry->file_type;
-                        result.inode_num = dir_entry->inode;
-                        return result;
-                    }else{
-                        /*
-                        We found the file we want at this level, no need to check other blocks.
-                        Move on to the next file level in the path.
-                        */
-                        result.parent_block_num = *indirect_blocks;
-                        result.parent_offset = offset;
-                        current_inode = get_inode(disk, dir_entry->inode);
-                        more_blocks = FALSE;
-                        break;
-                    }
-                }else{
-                    if(!current->next){
-                        result.extra_info = MISSING_FILE;
-                    }else{
-                        result.extra_info = BAD_PATH;
-                    }
-                    return result;
-                }
-                indirect_blocks++;
-            }
-        }
+    for(int i = 0; i < path->count; i++){
+        PathComponent *current = &path->components[i];
+        int is_last = (i == path->count - 1);
+        int block_num, offset, found;
         /*
-        After looking through all the blocks, if we haven't found our file yet,
-        we won't find it.
+        On the final search for the real file, must alter search function
+        to look in the gaps after dir entries where the rec_len is greater
+        than the minimum possible rec_len
         */
-        if(offset == -ENOENT){
-            if(!current->next){
+        dir_lock_read(fs, result.parent_inode_num);
+        if(is_last){
+            found = scan_dir_blocks(fs, result.parent_inode_num, current->name, current->len, dir_block_find_deleted, &block_num, &offset);
+        }else{
+            found = lookup_dir_entry(fs, result.parent_inode_num, current->name, current->len, &block_num, &offset);
+        }
+        struct ext2_dir_entry dir_entry_copy;
+        if(found >= 0){
+            dir_entry_copy = *(struct ext2_dir_entry *)(get_block(fs, block_num) + offset);
+        }
+        dir_unlock(fs, result.parent_inode_num);
+        if(found < 0){
+            if(is_last){
                 result.extra_info = MISSING_FILE;
             }else{
                 result.extra_info = BAD_PATH;
             }
             return result;
         }
-        if(current){
-            current = current->next;
+        struct ext2_dir_entry *dir_entry = &dir_entry_copy;
+        if(!is_last && dir_entry->file_type != EXT2_FT_DIR){
+            //Exit if there is more to the path but this current file is regular.
+            result.extra_info = BAD_PATH;
+            return result;
+        }else if (is_last){
+            result.error_code = 0;
+            result.offset = offset;
+            result.block_num = block_num;
+            result.file_type = dir_entry->file_type;
+            result.inode_num = dir_entry->inode;
+            return result;
         }
-    }while(current);
+        result.parent_block_num = block_num;
+        result.parent_offset = offset;
+        result.parent_inode_num = dir_entry->inode;
+    }
 
     return result;
 }
@@ -550,116 +762,75 @@ Iterates through the entries of directory block block_num on disk, searching for
 a file named filename. Returns the offset inside the block where the dir_entry
 starts, or -ENOENT if not found.
 */
-int search_dir_block(unsigned char* disk, char *filename, int block_num){
-    unsigned char *file_caret = (disk + EXT2_BLOCK_SIZE * block_num);
-    struct ext2_dir_entry *file;
-    int offset = 0;
-    while(offset < EXT2_BLOCK_SIZE){
-        file = (struct ext2_dir_entry *)(file_caret);
-        if(strncmp(filename, file->name, strlen(filename)) == 0){
-            return offset;
-        }
-        offset += file->rec_len;
-        file_caret += file->rec_len;
-    }
-    return -ENOENT;
+int search_dir_block(ext2_fs *fs, char *filename, int block_num){
+    DirNameKey key;
+    dir_name_key_init(&key, filename, strlen(filename));
+    return dir_block_find(get_block(fs, block_num), &key, NULL);
 }
 
-int search_deleted_dir_block(unsigned char* disk, char *filename, int block_num){
-    unsigned char *file_caret = (disk + EXT2_BLOCK_SIZE * block_num);
-    struct ext2_dir_entry *file;
-    int offset = 0;
-    while(offset < EXT2_BLOCK_SIZE){
-        file = (struct ext2_dir_entry *)(file_caret);
-
-        //Check if we have found garbage data:
-        if(file->name_len > file->rec_len || offset + file->rec_len > EXT2_BLOCK_SIZE || file->name_len == 0){
-            break;
-        }
-
-        if(strncmp(filename, file->name, strlen(filename)) == 0){
-            return offset;
-        }
-
-        int min_rec_len = 8 + file->name_len;
-        if(min_rec_len % 4 != 0){
-            min_rec_len += 4 - ((8 + file->name_len) % 4);
-        }
-
-        offset += min_rec_len;
-        file_caret += min_rec_len;
-    }
-    return -ENOENT;
+/*
+Same as search_dir_block, but also looks in the gaps left by removed entries.
+*/
+int search_deleted_dir_block(ext2_fs *fs, char *filename, int block_num){
+    DirNameKey key;
+    dir_name_key_init(&key, filename, strlen(filename));
+    return dir_block_find_deleted(get_block(fs, block_num), &key, NULL);
 }
 
-int find_prev_deleted_dir_entry(unsigned char* disk, char *filename, int block_num){
-    unsigned char *file_caret = (disk + EXT2_BLOCK_SIZE * block_num);
-    struct ext2_dir_entry *file;
-    int offset = 0, last_offset = 0, next_real_entry = 0;
-    while(offset < EXT2_BLOCK_SIZE){
-        file = (struct ext2_dir_entry *)(file_caret);
-
-        //Check if we have found garbage data:
-        if(file->name_len > file->rec_len || offset + file->rec_len > EXT2_BLOCK_SIZE || file->name_len == 0){
-            break;
-        }
-
-        if(strncmp(filename, file->name, strlen(filename)) == 0){
-            return last_offset;
-        }
-
-        int min_rec_len = 8 + file->name_len;
-        if(min_rec_len % 4 != 0){
-            min_rec_len += 4 - ((8 + file->name_len) % 4);
-        }
-
-        if(offset == next_real_entry){
-            last_offset = offset;
-            next_real_entry += file->rec_len;
-        }
-
-        offset += min_rec_len;
-        file_caret += min_rec_len;
+/*
+Returns the offset of the live entry whose rec_len covers the removed entry
+named filename (name_len bytes) in block block_num, or -ENOENT.
+*/
+int find_prev_deleted_dir_entry(ext2_fs *fs, char *filename, int name_len, int block_num){
+    DirNameKey key;
+    int prev_offset;
+    dir_name_key_init(&key, filename, name_len);
+    if(dir_block_find_deleted(get_block(fs, block_num), &key, &prev_offset) < 0){
+        return -ENOENT;
     }
-    return -ENOENT;
+    return prev_offset;
 }
 
-int find_prev_dir_entry(unsigned char* disk, char *filename, int block_num){
-    unsigned char *file_caret = (disk + EXT2_BLOCK_SIZE * block_num);
-    struct ext2_dir_entry *file;
-    int offset = 0, last_offset = 0;
-    while(offset < EXT2_BLOCK_SIZE){
-        file = (struct ext2_dir_entry *)(file_caret);
-        if(strncmp(filename, file->name, strlen(filename)) == 0){
-            return last_offset;
-        }
-        last_offset = offset;
-        offset += file->rec_len;
-        file_caret += file->rec_len;
+/*
+Returns the offset of the entry before the one named filename (name_len bytes)
+in block block_num, or -ENOENT.
+*/
+int find_prev_dir_entry(ext2_fs *fs, char *filename, int name_len, int block_num){
+    DirNameKey key;
+    int prev_offset;
+    dir_name_key_init(&key, filename, name_len);
+    if(dir_block_find(get_block(fs, block_num), &key, &prev_offset) < 0){
+        return -ENOENT;
     }
-    return -ENOENT;
+    return prev_offset;
 }
 
 /*
-Recursively free the nodes and the filename strings along an entire linked list
-of path nodes.
+Unlinks the entry at offset inside directory block block_num of directory
+parent_inode_num by folding it into the previous entry's rec_len, or clearing
+its inode number if it is the first entry of the block. The bytes stay behind
+for ext2_restore. Drops the name from the dentry cache. The caller holds the
+directory's write lock, as for create_dir_entry.
 */
-void destroy_path_list(PathNode *path){
-    if(path->next){
-        destroy_path_list(path->next);
+void remove_dir_entry(ext2_fs *fs, int parent_inode_num, int block_num, int offset, char *name, int name_len){
+    struct ext2_dir_entry *dir_entry = (struct ext2_dir_entry *)(get_block(fs, block_num) + offset);
+    if(offset > 0){
+        int previous_entry_offset = find_prev_dir_entry(fs, name, name_len, block_num);
+        struct ext2_dir_entry *previous_dir_entry = (struct ext2_dir_entry *)(get_block(fs, block_num) + previous_entry_offset);
+        previous_dir_entry->rec_len += dir_entry->rec_len;
+    }else{//Special case
+        dir_entry->inode = 0;
     }
-    free(path->filename);
-    free(path);
-    return;
+    mark_blocks_dirty(fs, block_num, 1);
+    dcache_invalidate(&fs->dcache, parent_inode_num, name, name_len);
 }
 
 /*
 Initializes a new inode given the inode number and certain fields:
 mode, size, links count, blocks (sectors), block array, block array size.
 */
-void create_inode(unsigned char* disk, int inode_num, unsigned short mode, unsigned int size, unsigned short links, unsigned int sectors, unsigned int* blocks, int block_count){
-    struct ext2_group_desc *gd = get_group_descriptor(disk);
-    struct ext2_inode *inode = (struct ext2_inode *)(disk + EXT2_BLOCK_SIZE * gd->bg_inode_table + (inode_num - 1) * sizeof(struct ext2_inode));
+void create_inode(ext2_fs *fs, int inode_num, unsigned short mode, unsigned int size, unsigned short links, unsigned int sectors, unsigned int* blocks, int block_count){
+    struct ext2_inode *inode = get_inode(fs, inode_num);
 
     //Fill members according to specifications.
     inode->i_mode = mode;
@@ -687,125 +858,97 @@ void create_inode(unsigned char* disk, int inode_num, unsigned short mode, unsig
     if(last_block < 14){
         inode->i_block[last_block + 1] = 0;
     }
+    mark_dirty(fs, inode, sizeof(struct ext2_inode));
 
     return;
 }
 
 /*
-Creates a new directory entry in the latest directory block of the parent directory.
+Creates a new directory entry in the parent directory. Indexed directories
+place it in the leaf its hash maps to. With the dir_index feature on, a linear
+directory whose single block fills up is converted to an indexed one. The
+caller holds the parent's write lock.
 */
-int create_dir_entry(unsigned char* disk, int parent_inode_num, int inode, unsigned char name_len, char file_type, char* name){
-    struct ext2_inode *parent_inode = get_inode(disk, parent_inode_num);
-    int more_blocks = TRUE, found_space = FALSE;
-    int current_block = 0;
-    int offset = 0;
-    int last_direct_block_parent = 0;
-    for(int j = 0; j < 12; j++){
-        if(parent_inode->i_block[j] <= 0){
-            break;
+int create_dir_entry(ext2_fs *fs, int parent_inode_num, int inode, unsigned char name_len, char file_type, char* name){
+    struct ext2_inode *parent_inode = get_inode(fs, parent_inode_num);
+    if(htree_is_indexed(fs, parent_inode_num)){
+        int rec_len = htree_add_entry(fs, parent_inode_num, inode, name_len, file_type, name);
+        if(rec_len != DX_BAD_INDEX){
+            return rec_len;
         }
-        last_direct_block_parent = j;
+        //The index is damaged, drop it and keep using the directory linearly.
+        parent_inode->i_flags &= ~EXT2_INDEX_FL;
+        mark_dirty(fs, parent_inode, sizeof(struct ext2_inode));
     }
-
-    for(int j = last_direct_block_parent; j < 12; j++){
-        if(found_space){
-            //No need to check any more blocks.
-            more_blocks = FALSE;
-            break;
-        }else{
-            current_block = parent_inode->i_block[j];
-        }
-        if(current_block <= 0){
-            /*
-            If this happens there was no space on any of the previous blocks
-            so return ENOSPC to notify caller that they need to add a new block
-            to the parent inode and then try again (inefficient but simple)
-            */
-            return -ENOSPC;
-        }
-        unsigned char *file_caret = (disk + EXT2_BLOCK_SIZE * current_block);
-        struct ext2_dir_entry *file;
-        offset = 0;
-        int previous_dir_entry_size = 0;
-
-        int new_dir_entry_size = 8 + name_len;
-        if(new_dir_entry_size % 4 != 0){
-            new_dir_entry_size += 4 - ((8 + name_len) % 4);
+    int rec_len = create_linear_dir_entry(fs, parent_inode_num, inode, name_len, file_type, name);
+    if(rec_len == -ENOSPC && parent_inode->i_size == EXT2_BLOCK_SIZE && !(parent_inode->i_flags & EXT2_INDEX_FL)
+        && (get_super_block(fs)->s_feature_compat & EXT2_FEATURE_COMPAT_DIR_INDEX)){
+        if(htree_build(fs, parent_inode_num) == 0){
+            return htree_add_entry(fs, parent_inode_num, inode, name_len, file_type, name);
         }
+    }
+    return rec_len;
+}
 
-        while(offset < EXT2_BLOCK_SIZE){
-            file = (struct ext2_dir_entry *)(file_caret);
-            previous_dir_entry_size = 8 + file->name_len;
-            if(previous_dir_entry_size % 4 != 0){
-                previous_dir_entry_size += 4 - ((8 + file->name_len) % 4);
-            }
-            if((offset + file->rec_len >= EXT2_BLOCK_SIZE && EXT2_BLOCK_SIZE - (offset + previous_dir_entry_size + new_dir_entry_size) >= 0 )|| file->rec_len == 0){
-                //Handle special case where we are first file in the block.
-                if(file->rec_len > 0){
-                    //"Crop" original capstone file size.
-                    file->rec_len = previous_dir_entry_size;
-                    offset += file->rec_len;
-                }
-                found_space = TRUE;
-                break;
-            }
-            offset += file->rec_len;
-            file_caret += file->rec_len;
-        }
+/*
+Creates a new directory entry in the latest directory block of the parent directory.
+*/
+int create_linear_dir_entry(ext2_fs *fs, int parent_inode_num, int inode, unsigned char name_len, char file_type, char* name){
+    unsigned int block_count = count_file_blocks(fs, parent_inode_num);
+    if(block_count == 0){
+        return -ENOSPC;
     }
-    if(more_blocks && parent_inode->i_block[12] > 0){
-        //get indirect block and then for each num in there (only add to LAST indir block)
-        //do same as above
-        unsigned int *indirect_blocks = (unsigned int*)(disk + EXT2_BLOCK_SIZE * parent_inode->i_block[12]);
-        int last_indirect_block = 0;
-        for(int i = 0; i < EXT2_BLOCK_SIZE / sizeof(unsigned int); i++){
-            if(indirect_blocks[i] <= 0){
-                break;
-            }
-            last_indirect_block = i;
-        }
-        unsigned char *file_caret = (disk + EXT2_BLOCK_SIZE * indirect_blocks[last_indirect_block]);
-        struct ext2_dir_entry *file;
-        offset = 0;
-        int previous_dir_entry_size = 0;
-        int new_dir_entry_size = 8 + name_len;
-        if(new_dir_entry_size % 4 != 0){
-            new_dir_entry_size += 4 - ((8 + name_len) % 4);
+    //Only the last block is tried, earlier ones filled up before it was added.
+    int current_block = get_file_block(fs, parent_inode_num, block_count - 1);
+    unsigned char *file_caret = get_block(fs, current_block);
+    struct ext2_dir_entry *file;
+    int found_space = FALSE;
+    int offset = 0;
+    int previous_dir_entry_size = 0;
+
+    int new_dir_entry_size = 8 + name_len;
+    if(new_dir_entry_size % 4 != 0){
+        new_dir_entry_size += 4 - ((8 + name_len) % 4);
+    }
+
+    while(offset < EXT2_BLOCK_SIZE){
+        file = (struct ext2_dir_entry *)(file_caret);
+        previous_dir_entry_size = 8 + file->name_len;
+        if(previous_dir_entry_size % 4 != 0){
+            previous_dir_entry_size += 4 - ((8 + file->name_len) % 4);
         }
-        while(offset < EXT2_BLOCK_SIZE){
-            file = (struct ext2_dir_entry *)(file_caret);
-            previous_dir_entry_size = 8 + file->name_len;
-            if(previous_dir_entry_size % 4 != 0){
-                previous_dir_entry_size += 4 - ((8 + file->name_len) % 4);
-            }
-            if((offset + file->rec_len >= EXT2_BLOCK_SIZE && EXT2_BLOCK_SIZE - (offset + previous_dir_entry_size + new_dir_entry_size) >= 0 )|| file->rec_len == 0){
-                //Handle special case where we are first file in the block.
-                if(file->rec_len > 0){
-                    //"Crop" original capstone file size.
-                    file->rec_len = previous_dir_entry_size;
-                    offset += file->rec_len;
-                }
-                found_space = TRUE;
-                break;
+        if((offset + file->rec_len >= EXT2_BLOCK_SIZE && EXT2_BLOCK_SIZE - (offset + previous_dir_entry_size + new_dir_entry_size) >= 0 )|| file->rec_len == 0){
+            //Handle special case where we are first file in the block.
+            if(file->rec_len > 0){
+                //"Crop" original capstone file size.
+                file->rec_len = previous_dir_entry_size;
+                offset += file->rec_len;
             }
-            offset += file->rec_len;
-            file_caret += file->rec_len;
-        }
-        if(!found_space){
-            //Then we need a new block!
-            return -ENOSPC;
+            found_space = TRUE;
+            break;
         }
-    }else if((more_blocks && parent_inode->i_block[12] == 0) || !found_space){
+        offset += file->rec_len;
+        file_caret += file->rec_len;
+    }
+    if(!found_space){
+        /*
+        There is no space left in the last block, so return ENOSPC to notify
+        caller that they need to add a new block to the parent inode and then
+        try again (inefficient but simple)
+        */
         return -ENOSPC;
     }
 
-    struct ext2_dir_entry* new_dir_entry = (struct ext2_dir_entry*)(disk + EXT2_BLOCK_SIZE * current_block + offset);
+    struct ext2_dir_entry* new_dir_entry = (struct ext2_dir_entry*)(get_block(fs, current_block) + offset);
     new_dir_entry->inode = inode;
     //Fill in to the end of the directory block.
     new_dir_entry->rec_len = EXT2_BLOCK_SIZE - offset;
     new_dir_entry->name_len = name_len;
     new_dir_entry->file_type = file_type;
-    strncpy(new_dir_entry->name, name, name_len);
+    memcpy(new_dir_entry->name, name, name_len);
+    //The entry and the cropped one before it share this block.
+    mark_blocks_dirty(fs, current_block, 1);
+    dcache_insert(&fs->dcache, parent_inode_num, name, name_len, current_block, offset);
 
     //printf("Created dir_entry in block %d, offset %d with rec_len %d.\n", current_block, offset, new_dir_entry->rec_len);
     return new_dir_entry->rec_len;
@@ -813,276 +956,565 @@ int create_dir_entry(unsigned char* disk, int parent_inode_num, int inode, unsig
 
 /*
 Modifies either inode or block bitmap specified in bitmap_type, and sets bit at
-index to value.
+index to value. The bit lives in the bitmap of the group owning index.
 */
-void update_bitmap(unsigned char *disk, int index, int value, int bitmap_type){
+void update_bitmap(ext2_fs *fs, int index, int value, int bitmap_type){
     unsigned char* bitmap;
-    index--;
-    char mask = 1 << index % 8;
+    unsigned int bit;
     switch(bitmap_type){
         case INODE:
-            bitmap = get_inode_bitmap(disk);
-            if(!value){
-                bitmap[index/8] &= ~mask;
-            }else{
-                bitmap[index/8] |= mask;
-            }
+            bitmap = get_inode_bitmap(fs, inode_group(fs, index));
+            bit = (index - 1) % fs->geometry.inodes_per_group;
             break;
         case BLOCK:
-            bitmap = get_block_bitmap(disk);
-            if(!value){
-                bitmap[index/8] &= ~mask;
-            }else{
-                bitmap[index/8] |= mask;
-            }
+            bitmap = get_block_bitmap(fs, block_group(fs, index));
+            bit = (index - fs->geometry.first_data_block) % fs->geometry.blocks_per_group;
             break;
+        default:
+            return;
+    }
+    unsigned char mask = 1 << bit % 8;
+    if(!value){
+        __atomic_fetch_and(&bitmap[bit/8], (unsigned char)~mask, __ATOMIC_ACQ_REL);
+    }else{
+        __atomic_fetch_or(&bitmap[bit/8], mask, __ATOMIC_ACQ_REL);
     }
+    mark_dirty(fs, &bitmap[bit/8], 1);
 }
 
-int check_bitmap(unsigned char *disk, int index, int bitmap_type){
-    unsigned char* bitmap;
-    index--;
-    char mask = 1 << index % 8;
+/*
+Returns the counter shard of the calling thread. Threads are dealt shards in
+turn the first time they get here.
+*/
+static FreeCountShard* thread_free_shard(ext2_fs *fs){
+    static unsigned int next_shard;
+    static __thread int shard = -1;
+    if(shard < 0){
+        shard = __atomic_fetch_add(&next_shard, 1, __ATOMIC_RELAXED) % FREE_COUNT_SHARDS;
+    }
+    return &fs->free_shards[shard];
+}
+
+/*
+Adds block_delta and inode_delta to the superblock free counters, by way of
+the calling thread's shard.
+*/
+static void add_super_free_counts(ext2_fs *fs, long block_delta, long inode_delta){
+    FreeCountShard *shard = thread_free_shard(fs);
+    if(block_delta){
+        __atomic_fetch_add(&shard->blocks, block_delta, __ATOMIC_RELAXED);
+    }
+    if(inode_delta){
+        __atomic_fetch_add(&shard->inodes, inode_delta, __ATOMIC_RELAXED);
+    }
+}
+
+/*
+Adds delta to the free inode or block counters (bitmap_type) of both the
+superblock and the group descriptor owning index. The group counter changes
+atomically, the superblock one once folded.
+*/
+void update_free_count(ext2_fs *fs, int index, int delta, int bitmap_type){
+    struct ext2_group_desc *group_descriptor;
     switch(bitmap_type){
         case INODE:
-            bitmap = get_inode_bitmap(disk);
-            if(bitmap[index/8] & mask){
-                return 1;
-            }else{
-                return 0;
-            }
+            group_descriptor = get_group_descriptor(fs, inode_group(fs, index));
+            __atomic_add_fetch(&group_descriptor->bg_free_inodes_count, delta, __ATOMIC_RELAXED);
+            add_super_free_counts(fs, 0, delta);
             break;
         case BLOCK:
-            bitmap = get_block_bitmap(disk);
-            if(bitmap[index/8] & mask){
-                return 1;
-            }else{
-                return 0;
-            }
+            group_descriptor = get_group_descriptor(fs, block_group(fs, index));
+            __atomic_add_fetch(&group_descriptor->bg_free_blocks_count, delta, __ATOMIC_RELAXED);
+            add_super_free_counts(fs, delta, 0);
             break;
         default:
-            return -1;
-            break;
+            return;
     }
+    mark_dirty(fs, group_descriptor, sizeof(struct ext2_group_desc));
 }
 
 /*
-Add a new free block to the i_block list at inode, if a single indirection is
-required, then it will create an extra block to hold the pointers, and
-then the block where the data should go.
+Returns the number of free blocks: the superblock's count plus the changes
+still sitting in the shards.
 */
-int add_block(unsigned char* disk, int inode_num){
-    struct ext2_inode *inode = get_inode(disk, inode_num);
-    int ret_block_num = 0;
-    int i;
-    //Check for the last direct block.
-    for(i = 0; i < 12; i++){
-        if(inode->i_block[i] == 0){
-            break;
-        }
+long get_free_blocks_count(ext2_fs *fs){
+    long count = get_super_block(fs)->s_free_blocks_count;
+    for(int s = 0; s < FREE_COUNT_SHARDS; s++){
+        count += __atomic_load_n(&fs->free_shards[s].blocks, __ATOMIC_RELAXED);
     }
-    if(i >= 12){
-        //Get block for the actual data.
-        int new_block_num = get_free_block(disk);
-        if(new_block_num < 0){
-            return -ENOSPC;
-        }
-        update_bitmap(disk, new_block_num, 1, BLOCK);
-        ret_block_num = new_block_num;
-        int block_list = inode->i_block[i];
-
-        if(block_list <= 0){
-            //Must setup single indirection oursevles!
-            block_list = get_free_block(disk);
-            if(block_list < 0){
-                //Can't allocate any more blocks. Just give up!
-                return -ENOSPC;
-            }
-            inode->i_block[i] = block_list;
-            update_bitmap(disk, block_list, 1, BLOCK);
-
-            //Add our new data block as the first block in the indirect list.
-            unsigned int *indirect_blocks = (unsigned int*)(disk + EXT2_BLOCK_SIZE * block_list);
-            *indirect_blocks = new_block_num;
+    return count;
+}
 
-            //Zero out next block to stop list (if applicable)
-            indirect_blocks++;
-            *indirect_blocks = 0;
+/*
+Moves the changes collected in the shards into the superblock counters.
+*/
+void fold_free_counts(ext2_fs *fs){
+    long blocks = 0, inodes = 0;
+    for(int s = 0; s < FREE_COUNT_SHARDS; s++){
+        blocks += __atomic_exchange_n(&fs->free_shards[s].blocks, 0, __ATOMIC_RELAXED);
+        inodes += __atomic_exchange_n(&fs->free_shards[s].inodes, 0, __ATOMIC_RELAXED);
+    }
+    if(blocks == 0 && inodes == 0){
+        return;
+    }
+    struct ext2_super_block *super_block = get_super_block(fs);
+    __atomic_add_fetch(&super_block->s_free_blocks_count, blocks, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&super_block->s_free_inodes_count, inodes, __ATOMIC_RELAXED);
+    mark_dirty(fs, super_block, sizeof(struct ext2_super_block));
+}
 
-            struct ext2_group_desc *group_descriptor = get_group_descriptor(disk);
-            group_descriptor->bg_free_blocks_count -= 2;
+int check_bitmap(ext2_fs *fs, int index, int bitmap_type){
+    unsigned char* bitmap;
+    unsigned int bit;
+    switch(bitmap_type){
+        case INODE:
+            bitmap = get_inode_bitmap(fs, inode_group(fs, index));
+            bit = (index - 1) % fs->geometry.inodes_per_group;
+            break;
+        case BLOCK:
+            bitmap = get_block_bitmap(fs, block_group(fs, index));
+            bit = (index - fs->geometry.first_data_block) % fs->geometry.blocks_per_group;
+            break;
+        default:
+            return -1;
+    }
+    if(bitmap[bit/8] & (1 << bit % 8)){
+        return 1;
+    }else{
+        return 0;
+    }
+}
 
-            struct ext2_super_block* super_block = get_super_block(disk);
-            super_block->s_free_blocks_count -= 2;
+/*
+Locates the bitmap holding index (an inode or block number, per bitmap_type),
+the bit inside it and the number of bits that bitmap covers.
+*/
+static unsigned char* locate_bitmap(ext2_fs *fs, unsigned int index, int bitmap_type, unsigned int *bit, unsigned int *nbits){
+    int group;
+    switch(bitmap_type){
+        case INODE:
+            group = inode_group(fs, index);
+            *bit = (index - 1) % fs->geometry.inodes_per_group;
+            *nbits = fs->geometry.inodes_per_group;
+            return get_inode_bitmap(fs, group);
+        case BLOCK:
+            group = block_group(fs, index);
+            *bit = (index - fs->geometry.first_data_block) % fs->geometry.blocks_per_group;
+            *nbits = group_block_count(fs, group);
+            return get_block_bitmap(fs, group);
+    }
+    *bit = *nbits = 0;
+    return NULL;
+}
 
-            inode->i_blocks+= 4;
-            inode->i_size += EXT2_BLOCK_SIZE * 2;
-        }else{
-            //Just add to the end of the single indirection list.
-            unsigned int *indirect_blocks = (unsigned int*)(disk + EXT2_BLOCK_SIZE * block_list);
-            int allocated = FALSE;
-            for(int i = 0; i < EXT2_BLOCK_SIZE / sizeof(unsigned int); i++){
-                if(indirect_blocks[i] == 0){
-                    indirect_blocks[i] = new_block_num;
-                    allocated = TRUE;
-                    break;
-                }
-            }
-            if(!allocated){
-                //We are really out of luck! No more indirect space. GG.
-                return -ENOSPC;
+/*
+Sets (value 1) or clears (value 0) count consecutive bits of the inode or
+block bitmap starting at index, across group boundaries, a word at a time.
+The free counters move by the number of bits that actually changed: through
+counts if given, otherwise straight away. Returns that number.
+*/
+unsigned int update_bitmap_range(ext2_fs *fs, unsigned int index, unsigned int count, int value, int bitmap_type, FreeCounts *counts){
+    unsigned int changed_total = 0;
+    while(count > 0){
+        unsigned int bit, nbits;
+        unsigned char *bitmap = locate_bitmap(fs, index, bitmap_type, &bit, &nbits);
+        if(!bitmap || bit >= nbits){
+            break;
+        }
+        unsigned int run = nbits - bit < count ? nbits - bit : count;
+        unsigned int changed = value ? bitmap_set_range(bitmap, bit, run) : bitmap_clear_range(bitmap, bit, run);
+        mark_dirty(fs, bitmap + bit / 8, (bit + run - 1) / 8 - bit / 8 + 1);
+        if(changed > 0){
+            int delta = value ? -(int)changed : (int)changed;
+            if(counts){
+                add_free_count(counts, index, delta, bitmap_type);
+            }else{
+                update_free_count(fs, index, delta, bitmap_type);
             }
+        }
+        changed_total += changed;
+        index += run;
+        count -= run;
+    }
+    return changed_total;
+}
 
-            struct ext2_group_desc *group_descriptor = get_group_descriptor(disk);
-            group_descriptor->bg_free_blocks_count--;
-
-            struct ext2_super_block* super_block = get_super_block(disk);
-            super_block->s_free_blocks_count--;
-
-            inode->i_blocks+= 2;
-            inode->i_size += EXT2_BLOCK_SIZE;
+/*
+Returns 1 if any of the count bits of the inode or block bitmap starting at
+index is set, 0 otherwise.
+*/
+int check_bitmap_range(ext2_fs *fs, unsigned int index, unsigned int count, int bitmap_type){
+    while(count > 0){
+        unsigned int bit, nbits;
+        unsigned char *bitmap = locate_bitmap(fs, index, bitmap_type, &bit, &nbits);
+        if(!bitmap || bit >= nbits){
+            return 0;
         }
-    }else{
-        //Just slap in another direct block.
-        int new_block_num = get_free_block(disk);
-        ret_block_num = new_block_num;
-        if(new_block_num < 0){
-            return -ENOSPC;
+        unsigned int run = nbits - bit < count ? nbits - bit : count;
+        if(bitmap_find_one(bitmap, nbits, bit, bit + run) >= 0){
+            return 1;
         }
-        inode->i_block[i] = new_block_num;
-        //Add two sectors.
-        inode->i_blocks += 2;
-        inode->i_size += EXT2_BLOCK_SIZE;
-        update_bitmap(disk, new_block_num, 1, BLOCK);
+        index += run;
+        count -= run;
     }
-    return ret_block_num;
+    return 0;
 }
 
 /*
-Same as add block but for copying files, inlcudes custom size field.
+Returns 1 if any of the count bits of the inode or block bitmap starting at
+index is clear, 0 otherwise. Bits past the end of the bitmap count as set.
 */
-int add_block_file(unsigned char* disk, int inode_num, int size){
-    struct ext2_inode *inode = get_inode(disk, inode_num);
-    int ret_block_num = 0;
-    int i;
-    //Check for the last direct block.
-    for(i = 0; i < 12; i++){
-        if(inode->i_block[i] == 0){
-            break;
+int check_bitmap_range_clear(ext2_fs *fs, unsigned int index, unsigned int count, int bitmap_type){
+    while(count > 0){
+        unsigned int bit, nbits;
+        unsigned char *bitmap = locate_bitmap(fs, index, bitmap_type, &bit, &nbits);
+        if(!bitmap || bit >= nbits){
+            return 0;
         }
+        unsigned int run = nbits - bit < count ? nbits - bit : count;
+        //Searching only up to the end of the run, a hit before bit means it wrapped around.
+        if(bitmap_find_zero(bitmap, bit + run, bit) >= bit){
+            return 1;
+        }
+        index += run;
+        count -= run;
     }
-    if(i >= 12){
-        int block_list = inode->i_block[i];
-        if(block_list <= 0){
-            //Must setup single indirection oursevles!
-            block_list = get_free_block(disk);
-            if(block_list < 0){
-                //Can't allocate any more blocks. Just give up!
-                return -ENOSPC;
-            }
-            inode->i_block[i] = block_list;
-            update_bitmap(disk, block_list, 1, BLOCK);
+    return 0;
+}
 
-            //Get block for the actual data.
-            int new_block_num = get_free_block(disk);
-            if(new_block_num < 0){
-                return -ENOSPC;
+/*
+Sets count consecutive bits of the inode or block bitmap starting at index,
+across group boundaries, but only if every one of them is clear; another
+thread may be after the same bits. The free counters are charged through
+counts if given, otherwise straight away. Returns 0, or -EBUSY with the
+bitmap and counters as they were.
+*/
+int claim_bitmap_range(ext2_fs *fs, unsigned int index, unsigned int count, int bitmap_type, FreeCounts *counts){
+    unsigned int done = 0;
+    while(done < count){
+        unsigned int bit, nbits;
+        unsigned char *bitmap = locate_bitmap(fs, index + done, bitmap_type, &bit, &nbits);
+        unsigned int run = 0;
+        if(bitmap && bit < nbits){
+            run = nbits - bit < count - done ? nbits - bit : count - done;
+        }
+        if(run == 0 || !bitmap_claim_range(bitmap, bit, run)){
+            //Hand back the groups already claimed, nobody else can have touched them.
+            for(unsigned int undone = 0; undone < done; ){
+                bitmap = locate_bitmap(fs, index + undone, bitmap_type, &bit, &nbits);
+                run = nbits - bit < done - undone ? nbits - bit : done - undone;
+                bitmap_clear_range(bitmap, bit, run);
+                if(counts){
+                    add_free_count(counts, index + undone, run, bitmap_type);
+                }else{
+                    update_free_count(fs, index + undone, run, bitmap_type);
+                }
+                undone += run;
             }
-            update_bitmap(disk, new_block_num, 1, BLOCK);
-            ret_block_num = new_block_num;
+            return -EBUSY;
+        }
+        mark_dirty(fs, bitmap + bit / 8, (bit + run - 1) / 8 - bit / 8 + 1);
+        if(counts){
+            add_free_count(counts, index + done, -(int)run, bitmap_type);
+        }else{
+            update_free_count(fs, index + done, -(int)run, bitmap_type);
+        }
+        done += run;
+    }
+    return 0;
+}
 
-            //Add our new data block as the first block in the indirect list.
-            unsigned int *indirect_blocks = (unsigned int*)(disk + EXT2_BLOCK_SIZE * block_list);
-            *indirect_blocks = new_block_num;
+/*
+Starts an empty set of counter changes. If the per group arrays can't be had,
+changes go straight to disk instead.
+*/
+void init_free_counts(ext2_fs *fs, FreeCounts *counts){
+    counts->fs = fs;
+    counts->block_deltas = calloc(fs->geometry.group_count, sizeof(int));
+    counts->inode_deltas = calloc(fs->geometry.group_count, sizeof(int));
+    counts->blocks = 0;
+    counts->inodes = 0;
+}
 
-            //Zero out next block to stop list (if applicable)
-            indirect_blocks++;
-            *indirect_blocks = 0;
+/*
+Records delta free inodes or blocks (bitmap_type) for the group owning index.
+*/
+void add_free_count(FreeCounts *counts, int index, int delta, int bitmap_type){
+    if(!counts->block_deltas || !counts->inode_deltas){
+        update_free_count(counts->fs, index, delta, bitmap_type);
+        return;
+    }
+    switch(bitmap_type){
+        case INODE:
+            counts->inode_deltas[inode_group(counts->fs, index)] += delta;
+            counts->inodes += delta;
+            break;
+        case BLOCK:
+            counts->block_deltas[block_group(counts->fs, index)] += delta;
+            counts->blocks += delta;
+            break;
+    }
+}
 
-            struct ext2_group_desc *group_descriptor = get_group_descriptor(disk);
-            group_descriptor->bg_free_blocks_count -= 2;
+/*
+Writes the collected changes to the group descriptors that have any and to
+the superblock (through the shards), then releases counts.
+*/
+void apply_free_counts(FreeCounts *counts){
+    ext2_fs *fs = counts->fs;
+    for(unsigned int g = 0; g < fs->geometry.group_count; g++){
+        int block_delta = counts->block_deltas ? counts->block_deltas[g] : 0;
+        int inode_delta = counts->inode_deltas ? counts->inode_deltas[g] : 0;
+        if(block_delta == 0 && inode_delta == 0){
+            continue;
+        }
+        struct ext2_group_desc *group_descriptor = get_group_descriptor(fs, g);
+        __atomic_add_fetch(&group_descriptor->bg_free_blocks_count, block_delta, __ATOMIC_RELAXED);
+        __atomic_add_fetch(&group_descriptor->bg_free_inodes_count, inode_delta, __ATOMIC_RELAXED);
+        mark_dirty(fs, group_descriptor, sizeof(struct ext2_group_desc));
+    }
+    add_super_free_counts(fs, counts->blocks, counts->inodes);
+    free(counts->block_deltas);
+    free(counts->inode_deltas);
+    counts->block_deltas = NULL;
+    counts->inode_deltas = NULL;
+}
 
-            struct ext2_super_block* super_block = get_super_block(disk);
-            super_block->s_free_blocks_count -= 2;
+/*
+Adds a new free block to the end of the block map of inode inode_num, along
+with any index block it needs, and grows the size by a block. Returns the new
+block number, -ENOSPC, or -EFBIG if the block map is full.
+*/
+int add_block(ext2_fs *fs, int inode_num){
+    return add_block_file(fs, inode_num, EXT2_BLOCK_SIZE);
+}
 
-            //i_blocks doesn't count indirect apparently...but solutions include it?
-            inode->i_blocks+= 4;
-            inode->i_size += size;
-        }else{
-            //Get block for the actual data.
-            int new_block_num = get_free_block(disk);
-            if(new_block_num < 0){
-                return -ENOSPC;
+/*
+Same as add block but for copying files, inlcudes custom size field.
+*/
+int add_block_file(ext2_fs *fs, int inode_num, int size){
+    unsigned int new_block_num;
+    int result = allocate_file_blocks(fs, inode_num, count_file_blocks(fs, inode_num), 1, &new_block_num);
+    if(result < 0){
+        return result;
+    }
+    struct ext2_inode *inode = get_inode(fs, inode_num);
+    inode->i_size += size;
+    mark_dirty(fs, inode, sizeof(struct ext2_inode));
+    return new_block_num;
+}
+
+/*
+Reserves count blocks and writes their numbers to blocks. A single contiguous
+run is preferred; failing that the run length is halved until the request is
+covered by as few runs as the free space allows. Each run is taken from the
+goal group onwards, and counters are charged once per run. Runs are claimed
+with bitmap_claim_zero_run, so threads allocating at once never share a block.
+Returns count, or -ENOSPC with nothing allocated.
+*/
+int allocate_blocks(ext2_fs *fs, int count, unsigned int* blocks){
+    if(count <= 0){
+        return 0;
+    }
+    if(get_free_blocks_count(fs) < count){
+        return -ENOSPC;
+    }
+    int allocated = 0;
+    unsigned int run = count;
+    while(allocated < count){
+        if(run > count - allocated){
+            run = count - allocated;
+        }
+        if(run > fs->geometry.blocks_per_group){
+            run = fs->geometry.blocks_per_group;
+        }
+        int found = FALSE;
+        unsigned int goal = __atomic_load_n(&fs->geometry.block_goal_group, __ATOMIC_RELAXED);
+        for(unsigned int n = 0; n < fs->geometry.group_count; n++){
+            unsigned int group = (goal + n) % fs->geometry.group_count;
+            if(__atomic_load_n(&fs->geometry.group_descriptors[group].bg_free_blocks_count, __ATOMIC_RELAXED) < run){
+                continue;
             }
-            update_bitmap(disk, new_block_num, 1, BLOCK);
-            ret_block_num = new_block_num;
-
-            //Just add to the end of the single indirection list.
-            unsigned int *indirect_blocks = (unsigned int*)(disk + EXT2_BLOCK_SIZE * block_list);
-            int allocated = FALSE;
-            for(int i = 0; i < EXT2_BLOCK_SIZE / sizeof(unsigned int); i++){
-                if(indirect_blocks[i] == 0){
-                    indirect_blocks[i] = new_block_num;
-                    allocated = TRUE;
-                    break;
-                }
+            unsigned char *bitmap = get_block_bitmap(fs, group);
+            long bit = bitmap_claim_zero_run(bitmap, group_block_count(fs, group), __atomic_load_n(&fs->geometry.block_cursors[group], __ATOMIC_RELAXED), run);
+            if(bit < 0){
+                continue;
+            }
+            unsigned int first = fs->geometry.first_data_block + group * fs->geometry.blocks_per_group + bit;
+            for(unsigned int i = 0; i < run; i++){
+                blocks[allocated++] = first + i;
             }
-            if(!allocated){
-                //We are really out of luck! No more indirect space. GG.
+            mark_dirty(fs, bitmap + bit / 8, (bit + run - 1) / 8 - bit / 8 + 1);
+            update_free_count(fs, first, -(int)run, BLOCK);
+            __atomic_store_n(&fs->geometry.block_cursors[group], bit + run, __ATOMIC_RELAXED);
+            __atomic_store_n(&fs->geometry.block_goal_group, group, __ATOMIC_RELAXED);
+            found = TRUE;
+            break;
+        }
+        if(!found){
+            if(run == 1){
+                //The counters promised more than the bitmaps hold, give back what we took.
+                for(int i = 0; i < allocated; i++){
+                    update_bitmap_range(fs, blocks[i], 1, 0, BLOCK, NULL);
+                }
                 return -ENOSPC;
             }
+            run = (run + 1) / 2;
+        }
+    }
+    return allocated;
+}
 
-            struct ext2_group_desc *group_descriptor = get_group_descriptor(disk);
-            group_descriptor->bg_free_blocks_count--;
-
-            struct ext2_super_block* super_block = get_super_block(disk);
-            super_block->s_free_blocks_count--;
+/*
+Gives inode inode_num count more data blocks, for logical blocks start onwards,
+in one allocation and fills in its block map. The range must not be mapped
+yet; anything before it may be, or may be left as holes. The index blocks the
+range is missing are reserved along with the data, each placed right before
+the first data block it maps, where a sequential read reaches it. The data block numbers are written to
+blocks in file order, unless it is NULL. Returns 0, -EFBIG if the range goes past the triple
+indirect block, or -ENOSPC.
+*/
+int allocate_file_blocks(ext2_fs *fs, int inode_num, int start, int count, unsigned int* blocks){
+    struct ext2_inode *inode = get_inode(fs, inode_num);
+    if((unsigned long)start + count > EXT2_MAX_FILE_BLOCKS){
+        return -EFBIG;
+    }
+    if(inode->i_blocks == 0){
+        //No blocks yet, whatever a previous owner left in i_block is stale.
+        memset(inode->i_block, 0, sizeof(inode->i_block));
+    }
+    int index_blocks = index_blocks_missing(fs, inode_num, start, count);
+    unsigned int *reserved = malloc(sizeof(unsigned int) * (count + index_blocks));
+    if(!reserved){
+        return -ENOMEM;
+    }
+    int result = allocate_blocks(fs, count + index_blocks, reserved);
+    if(result < 0){
+        free(reserved);
+        return result;
+    }
 
-            inode->i_blocks+= 2;
-            inode->i_size += size;
+    int next = 0;
+    for(int i = 0; i < count; i++){
+        unsigned int offsets[4];
+        int depth = block_map_path(start + i, offsets);
+        unsigned int *slot = &inode->i_block[offsets[0]];
+        for(int level = 1; level <= depth; level++){
+            if(*slot == 0){
+                //First block under this index block, it goes in front of it.
+                *slot = reserved[next++];
+                memset(get_block(fs, *slot), 0, EXT2_BLOCK_SIZE);
+                mark_dirty(fs, slot, sizeof(unsigned int));
+                mark_blocks_dirty(fs, *slot, 1);
+            }
+            slot = (unsigned int*)get_block(fs, *slot) + offsets[level];
         }
-    }else{
-        //Just slap in another direct block.
-        int new_block_num = get_free_block(disk);
-        ret_block_num = new_block_num;
-        if(new_block_num < 0){
-            return -ENOSPC;
+        *slot = reserved[next++];
+        if(blocks){
+            blocks[i] = *slot;
         }
-        inode->i_block[i] = new_block_num;
-        //Add two sectors.
-        inode->i_blocks += 2;
-        inode->i_size += size;
-        update_bitmap(disk, new_block_num, 1, BLOCK);
+        mark_dirty(fs, slot, sizeof(unsigned int));
+    }
+    inode->i_blocks += (count + index_blocks) * 2;
+    mark_dirty(fs, inode, sizeof(struct ext2_inode));
+    free(reserved);
+    return 0;
+}
 
-        struct ext2_group_desc *group_descriptor = get_group_descriptor(disk);
-        group_descriptor->bg_free_blocks_count--;
+/*
+Marks every block in the block map of inode inode_num free again, index
+blocks included. The pointers themselves are left in place so ext2_restore can
+bring the file back.
+*/
+void release_file_blocks(ext2_fs *fs, int inode_num){
+    BlockMapIter iter;
+    BlockExtent extent;
+    FreeCounts counts;
+    init_free_counts(fs, &counts);
+    block_map_iter_init(&iter, fs, inode_num, BLOCK_MAP_INDEX);
+    while(block_map_next(&iter, &extent)){
+        update_bitmap_range(fs, extent.physical, extent.length, 0, BLOCK, &counts);
+    }
+    apply_free_counts(&counts);
+}
 
-        struct ext2_super_block* super_block = get_super_block(disk);
-        super_block->s_free_blocks_count--;
+/*
+Sets the size of inode inode_num. The upper 32 bits of a regular file's size
+live in i_dir_acl, and files of 2GB or more need the large_file feature.
+*/
+void set_file_size(ext2_fs *fs, int inode_num, unsigned long long size){
+    struct ext2_inode *inode = get_inode(fs, inode_num);
+    inode->i_size = (unsigned int)size;
+    inode->i_dir_acl = (unsigned int)(size >> 32);
+    mark_dirty(fs, inode, sizeof(struct ext2_inode));
+    struct ext2_super_block *super_block = get_super_block(fs);
+    if(size > 0x7fffffffULL && !(super_block->s_feature_ro_compat & EXT2_FEATURE_RO_COMPAT_LARGE_FILE)){
+        __atomic_fetch_or(&super_block->s_feature_ro_compat, EXT2_FEATURE_RO_COMPAT_LARGE_FILE, __ATOMIC_RELAXED);
+        mark_dirty(fs, super_block, sizeof(struct ext2_super_block));
     }
-    return ret_block_num;
 }
 
-int remove_last_block(unsigned char* disk, int inode_num){
-    struct ext2_inode *inode = get_inode(disk, inode_num);
-    int i, block_to_free;
-    //Check for the last direct block
-    for(i = 0; i < 12; i++){
-        if(inode->i_block[i] == 0){
-            block_to_free = inode->i_block[i-1];
-            inode->i_block[i-1] = 0;
+/*
+Returns the size of inode inode_num in bytes. Only regular files keep high
+bits in i_dir_acl, for directories it holds an ACL block.
+*/
+unsigned long long get_file_size(ext2_fs *fs, int inode_num){
+    struct ext2_inode *inode = get_inode(fs, inode_num);
+    unsigned long long size = inode->i_size;
+    if((inode->i_mode & 0xf000) == EXT2_S_IFREG){
+        size |= (unsigned long long)inode->i_dir_acl << 32;
+    }
+    return size;
+}
+
+/*
+Unmaps logical block index of inode inode_num and frees it, along with any
+index block left mapping nothing, turning it into a hole. Returns 0, or
+-ENOENT if it already is one.
+*/
+int punch_file_block(ext2_fs *fs, int inode_num, unsigned int index){
+    struct ext2_inode *inode = get_inode(fs, inode_num);
+    unsigned int offsets[4];
+    unsigned int *slots[4];
+    int depth = block_map_path(index, offsets);
+    if(depth < 0){
+        return -ENOENT;
+    }
+    slots[0] = &inode->i_block[offsets[0]];
+    for(int level = 1; level <= depth; level++){
+        if(*slots[level - 1] == 0){
+            return -ENOENT;
+        }
+        slots[level] = (unsigned int*)get_block(fs, *slots[level - 1]) + offsets[level];
+    }
+    if(*slots[depth] == 0){
+        return -ENOENT;
+    }
+    //Free bottom up: an index block goes once the pointer dropped was its last.
+    for(int level = depth; level >= 0; level--){
+        if(level < depth && !block_is_zero(get_block(fs, *slots[level]))){
             break;
         }
+        unsigned int block_to_free = *slots[level];
+        *slots[level] = 0;
+        mark_dirty(fs, slots[level], sizeof(unsigned int));
+        update_bitmap(fs, block_to_free, 0, BLOCK);
+        update_free_count(fs, block_to_free, 1, BLOCK);
+        inode->i_blocks -= 2;
     }
-
-    inode->i_blocks -= 2;
-
-    struct ext2_group_desc *group_descriptor = get_group_descriptor(disk);
-    group_descriptor->bg_free_blocks_count++;
-
-    struct ext2_super_block* super_block = get_super_block(disk);
-    super_block->s_free_blocks_count++;
-
-    update_bitmap(disk, block_to_free, 0, BLOCK);
+    mark_dirty(fs, inode, sizeof(struct ext2_inode));
     return 0;
 }
+
+/*
+Drops the last data block of inode inode_num, and any index block that no
+longer maps anything, returning them to the free pool. Returns 0, or -ENOENT
+if the file has no blocks.
+*/
+int remove_last_block(ext2_fs *fs, int inode_num){
+    unsigned int block_count = count_file_blocks(fs, inode_num);
+    if(block_count == 0){
+        return -ENOENT;
+    }
+    return punch_file_block(fs, inode_num, block_count - 1);
+}
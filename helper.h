@@ -7,8 +7,18 @@
 #include <sys/mman.h>
 #include <string.h>
 #include <errno.h>
+#include <pthread.h>
 
 #include "ext2.h"
+#include "bitmap.h"
+#include "dirblock.h"
+#include "dcache.h"
+//Open image handle taken by every function below, defined further down.
+typedef struct ext2_fs ext2_fs;
+
+#include "htree.h"
+#include "pathview.h"
+#include "blockmap.h"
 
 #ifndef HELPER_FUNCTIONS
 #define HELPER_FUNCTIONS
@@ -20,8 +30,42 @@
 #define    HARDLINK 0
 #define    SOFTLINK 1
 
-#define    INODE_COUNT 32
-#define    BLOCK_COUNT 128
+#define    EXT2_SUPER_MAGIC 0xEF53
+#define    EXT2_SUPER_BLOCK_OFFSET 1024
+
+/*
+Mapping hints for load_image, pick the ones matching how the tool walks the image.
+IMAGE_HINT_STATS also reports flush and copy statistics on stderr.
+IMAGE_HINT_THREADS sets up the directory locks, for handles shared between
+threads.
+IMAGE_HINT_READ_ONLY opens the file read only and maps it PROT_READ and
+MAP_PRIVATE, so nothing is ever written back and writers elsewhere aren't
+locked out. Any store into the image faults, and save_image and close_image
+leave the file alone.
+*/
+#define    IMAGE_HINT_NONE 0
+#define    IMAGE_HINT_POPULATE 1
+#define    IMAGE_HINT_SEQUENTIAL 2
+#define    IMAGE_HINT_RANDOM 4
+#define    IMAGE_HINT_STATS 8
+#define    IMAGE_HINT_THREADS 16
+#define    IMAGE_HINT_READ_ONLY 32
+
+/*
+Directories are locked through a table of reader/writer locks indexed by inode
+number, so the locks cost a fixed amount of memory whatever the image size.
+Two directories sharing a lock only ever wait on each other, as no operation
+holds more than one directory lock at a time.
+*/
+#define    DIR_LOCK_COUNT 1024
+//Superblock free counter changes are spread over this many per thread shards.
+#define    FREE_COUNT_SHARDS 64
+
+//Symbolic links a lookup follows one after another before failing with -ELOOP.
+#define    SYMLINK_MAX_HOPS 40
+
+#define    EXT2_FEATURE_RO_COMPAT_SPARSE_SUPER 0x0001
+#define    EXT2_FEATURE_RO_COMPAT_LARGE_FILE 0x0002
 
 /*
 Extra info for the MKDIR. Need to know whether the end file is missing but the rest
@@ -35,10 +79,75 @@ of the path is good, or if the path is just bad altogether.
 #define SUPER_BLOCK 6
 #define GROUP_DESC 7
 
-typedef struct path_node {
-    char* filename;
-    struct path_node *next;
-} PathNode;
+/*
+Layout of the mounted image, worked out from the superblock once at load so the
+inode/block to group maths doesn't go back to disk on every lookup.
+*/
+typedef struct fs_geometry {
+    unsigned int blocks_count;
+    unsigned int inodes_count;
+    unsigned int first_data_block;
+    unsigned int blocks_per_group;
+    unsigned int inodes_per_group;
+    unsigned int group_count;
+    unsigned int inode_size;
+    struct ext2_group_desc *group_descriptors;
+    //Group get_free_block starts searching from.
+    unsigned int block_goal_group;
+    //Per group next-fit cursors: the bit after the last one handed out.
+    unsigned int *block_cursors;
+    unsigned int *inode_cursors;
+} FsGeometry;
+
+/*
+Free blocks and inodes a group of threads has taken (negative) or given back
+since the changes were last folded into the superblock. One cache line each,
+so threads on different shards never share one.
+*/
+typedef struct free_count_shard {
+    long blocks;
+    long inodes;
+    char padding[48];
+} FreeCountShard;
+
+/*
+An image opened by load_image. Everything known about it lives here instead of
+in process globals, so one process can keep several images open, each with its
+own geometry, dirty map and directory cache. Released by close_image.
+*/
+struct ext2_fs {
+    //The whole file system, mapped shared.
+    unsigned char *disk;
+    int fd;
+    size_t size;
+    FsGeometry geometry;
+    //One bit per block of the image, set when the block has been modified since load.
+    unsigned char *dirty_map;
+    Dcache dcache;
+    int stats;
+    //Loaded with IMAGE_HINT_READ_ONLY.
+    int read_only;
+    //Per directory locks, NULL unless opened with IMAGE_HINT_THREADS.
+    pthread_rwlock_t *dir_locks;
+    /*
+    The superblock totals would have every allocating thread writing the same
+    cache line, so changes to them collect here until fold_free_counts.
+    */
+    FreeCountShard *free_shards;
+};
+
+/*
+Free counter changes collected over one operation, so each group descriptor
+and the superblock get written once, by apply_free_counts, instead of once
+per block.
+*/
+typedef struct free_counts {
+    ext2_fs *fs;
+    int *block_deltas;
+    int *inode_deltas;
+    long blocks;
+    long inodes;
+} FreeCounts;
 
 typedef struct search_result {
     int error_code;
@@ -51,46 +160,77 @@ typedef struct search_result {
     //If following are -1, then parent is root.
     int parent_block_num;
     int parent_offset;
+    //Directory holding the entry that was looked for.
+    int parent_inode_num;
 } SearchResult;
 
-int DISK_IMAGE_FILE_DESCRIPTOR;
-
-unsigned char* load_image(char*);
-int save_image(unsigned char*);
-
-int get_free_block(unsigned char*);
-int get_free_inode(unsigned char*);
-
-void update_bitmap(unsigned char*, int, int, int);
-int check_bitmap(unsigned char*, int, int);
-
-SearchResult find_dir_entry(unsigned char*, PathNode*, int);
-SearchResult find_deleted_dir_entry(unsigned char*, PathNode*);
-
-int search_dir_block(unsigned char*, char*, int);
-int search_deleted_dir_block(unsigned char*, char*, int);
-
-int find_prev_dir_entry(unsigned char*, char*, int);
-int find_prev_deleted_dir_entry(unsigned char*, char*, int);
-
-PathNode *create_path_list(char*);
-void destroy_path_list(PathNode*);
-
-void create_inode(unsigned char*, int, unsigned short, unsigned int, unsigned short, unsigned int, unsigned int*, int);
-void update_inode(unsigned char*, int, unsigned int, unsigned short, unsigned int);
-int create_dir_entry(unsigned char*, int, int, unsigned char, char, char*);
-int add_block(unsigned char*, int);
-int add_block_file(unsigned char*, int, int);
-int remove_last_block(unsigned char*, int);
-
-struct ext2_inode *get_inode(unsigned char*, int);
-struct ext2_super_block *get_super_block(unsigned char*);
-/*For this assignment we may assume there is only one group.*/
-struct ext2_group_desc *get_group_descriptor(unsigned char*);
-unsigned char* get_inode_bitmap(unsigned char*);
-unsigned char* get_block_bitmap(unsigned char*);
+ext2_fs* load_image(char*, int);
+int load_geometry(ext2_fs*);
+int save_image(ext2_fs*);
+void close_image(ext2_fs*);
+unsigned char* get_block(ext2_fs*, unsigned int);
+int block_is_zero(const unsigned char*);
+void mark_blocks_dirty(ext2_fs*, unsigned int, unsigned int);
+void mark_dirty(ext2_fs*, void*, size_t);
+int parse_stats_flag(int, char**, int*);
+
+void dir_lock_read(ext2_fs*, int);
+void dir_lock_write(ext2_fs*, int);
+void dir_unlock(ext2_fs*, int);
+
+int get_free_block(ext2_fs*);
+int get_free_inode(ext2_fs*);
+
+void update_bitmap(ext2_fs*, int, int, int);
+int check_bitmap(ext2_fs*, int, int);
+void update_free_count(ext2_fs*, int, int, int);
+unsigned int update_bitmap_range(ext2_fs*, unsigned int, unsigned int, int, int, FreeCounts*);
+int check_bitmap_range(ext2_fs*, unsigned int, unsigned int, int);
+int check_bitmap_range_clear(ext2_fs*, unsigned int, unsigned int, int);
+void init_free_counts(ext2_fs*, FreeCounts*);
+void add_free_count(FreeCounts*, int, int, int);
+void apply_free_counts(FreeCounts*);
+int claim_bitmap_range(ext2_fs*, unsigned int, unsigned int, int, FreeCounts*);
+long get_free_blocks_count(ext2_fs*);
+void fold_free_counts(ext2_fs*);
+
+int scan_dir_blocks(ext2_fs*, int, char*, int, int (*)(const unsigned char*, const DirNameKey*, int*), int*, int*);
+int lookup_dir_entry(ext2_fs*, int, char*, int, int*, int*);
+char* get_link_target(ext2_fs*, int, int*);
+SearchResult find_dir_entry(ext2_fs*, PathView*, int);
+SearchResult find_deleted_dir_entry(ext2_fs*, PathView*);
+
+int search_dir_block(ext2_fs*, char*, int);
+int search_deleted_dir_block(ext2_fs*, char*, int);
+
+int find_prev_dir_entry(ext2_fs*, char*, int, int);
+int find_prev_deleted_dir_entry(ext2_fs*, char*, int, int);
+
+void create_inode(ext2_fs*, int, unsigned short, unsigned int, unsigned short, unsigned int, unsigned int*, int);
+void update_inode(ext2_fs*, int, unsigned int, unsigned short, unsigned int);
+int create_dir_entry(ext2_fs*, int, int, unsigned char, char, char*);
+int create_linear_dir_entry(ext2_fs*, int, int, unsigned char, char, char*);
+void remove_dir_entry(ext2_fs*, int, int, int, char*, int);
+int add_block(ext2_fs*, int);
+int add_block_file(ext2_fs*, int, int);
+int remove_last_block(ext2_fs*, int);
+int punch_file_block(ext2_fs*, int, unsigned int);
+int allocate_blocks(ext2_fs*, int, unsigned int*);
+int allocate_file_blocks(ext2_fs*, int, int, int, unsigned int*);
+void release_file_blocks(ext2_fs*, int);
+void set_file_size(ext2_fs*, int, unsigned long long);
+unsigned long long get_file_size(ext2_fs*, int);
+
+struct ext2_inode *get_inode(ext2_fs*, int);
+struct ext2_super_block *get_super_block(ext2_fs*);
+struct ext2_group_desc *get_group_descriptor(ext2_fs*, int);
+unsigned char* get_inode_bitmap(ext2_fs*, int);
+unsigned char* get_block_bitmap(ext2_fs*, int);
+int inode_group(ext2_fs*, int);
+int block_group(ext2_fs*, int);
+unsigned int group_block_count(ext2_fs*, int);
 
 //Stuff ported from readimage.c
-void print_inode(unsigned char*, int);
+void print_inode(ext2_fs*, int);
 
 #endif
@@ -0,0 +1,817 @@
+#include "helper.h"
+
+//"." takes 12 bytes and the header of ".." another 12, then the dx_root_info.
+#define DX_ROOT_INFO_OFFSET 24
+#define DX_ROOT_ENTRIES_OFFSET 32
+//Node blocks start with an empty dir_entry spanning the whole block.
+#define DX_NODE_ENTRIES_OFFSET 8
+#define DX_ROOT_LIMIT ((EXT2_BLOCK_SIZE - DX_ROOT_ENTRIES_OFFSET) / sizeof(struct dx_entry))
+#define DX_NODE_LIMIT ((EXT2_BLOCK_SIZE - DX_NODE_ENTRIES_OFFSET) / sizeof(struct dx_entry))
+//Root plus one level of nodes, as in ext3.
+#define DX_MAX_LEVELS 2
+//The top bits of a dx_entry block are reserved.
+#define DX_BLOCK(entry) ((entry)->block & 0x0fffffff)
+//Above every real hash, so lookups never land in padding leaves.
+#define DX_EMPTY_LEAF_HASH 0xfffffffe
+
+typedef struct dx_frame {
+    struct dx_entry *entries;
+    struct dx_entry *at;
+    int block_num;
+} DxFrame;
+
+typedef struct dx_map_entry {
+    unsigned int hash;
+    int inode;
+    unsigned char name_len;
+    char file_type;
+    char *name;
+} DxMapEntry;
+
+static unsigned int rol32(unsigned int word, int shift){
+    return (word << shift) | (word >> (32 - shift));
+}
+
+#define DX_TEA_DELTA 0x9e3779b9
+
+static void tea_transform(unsigned int buf[4], const unsigned int in[4]){
+    unsigned int sum = 0;
+    unsigned int b0 = buf[0], b1 = buf[1];
+    unsigned int a = in[0], b = in[1], c = in[2], d = in[3];
+    for(int n = 0; n < 16; n++){
+        sum += DX_TEA_DELTA;
+        b0 += ((b1 << 4) + a) ^ (b1 + sum) ^ ((b1 >> 5) + b);
+        b1 += ((b0 << 4) + c) ^ (b0 + sum) ^ ((b0 >> 5) + d);
+    }
+    buf[0] += b0;
+    buf[1] += b1;
+}
+
+#define DX_F(x, y, z) ((z) ^ ((x) & ((y) ^ (z))))
+#define DX_G(x, y, z) (((x) & (y)) + (((x) ^ (y)) & (z)))
+#define DX_H(x, y, z) ((x) ^ (y) ^ (z))
+#define DX_ROUND(f, a, b, c, d, x, s) (a += f(b, c, d) + (x), a = rol32(a, s))
+#define DX_K2 013240474631U
+#define DX_K3 015666365641U
+
+/*
+The three rounds of MD4 with half the input words, as used by the dir_index
+half_md4 hash.
+*/
+static void half_md4_transform(unsigned int buf[4], const unsigned int in[8]){
+    unsigned int a = buf[0], b = buf[1], c = buf[2], d = buf[3];
+
+    DX_ROUND(DX_F, a, b, c, d, in[0], 3);
+    DX_ROUND(DX_F, d, a, b, c, in[1], 7);
+    DX_ROUND(DX_F, c, d, a, b, in[2], 11);
+    DX_ROUND(DX_F, b, c, d, a, in[3], 19);
+    DX_ROUND(DX_F, a, b, c, d, in[4], 3);
+    DX_ROUND(DX_F, d, a, b, c, in[5], 7);
+    DX_ROUND(DX_F, c, d, a, b, in[6], 11);
+    DX_ROUND(DX_F, b, c, d, a, in[7], 19);
+
+    DX_ROUND(DX_G, a, b, c, d, in[1] + DX_K2, 3);
+    DX_ROUND(DX_G, d, a, b, c, in[3] + DX_K2, 5);
+    DX_ROUND(DX_G, c, d, a, b, in[5] + DX_K2, 9);
+    DX_ROUND(DX_G, b, c, d, a, in[7] + DX_K2, 13);
+    DX_ROUND(DX_G, a, b, c, d, in[0] + DX_K2, 3);
+    DX_ROUND(DX_G, d, a, b, c, in[2] + DX_K2, 5);
+    DX_ROUND(DX_G, c, d, a, b, in[4] + DX_K2, 9);
+    DX_ROUND(DX_G, b, c, d, a, in[6] + DX_K2, 13);
+
+    DX_ROUND(DX_H, a, b, c, d, in[3] + DX_K3, 3);
+    DX_ROUND(DX_H, d, a, b, c, in[7] + DX_K3, 9);
+    DX_ROUND(DX_H, c, d, a, b, in[2] + DX_K3, 11);
+    DX_ROUND(DX_H, b, c, d, a, in[6] + DX_K3, 15);
+    DX_ROUND(DX_H, a, b, c, d, in[1] + DX_K3, 3);
+    DX_ROUND(DX_H, d, a, b, c, in[5] + DX_K3, 9);
+    DX_ROUND(DX_H, c, d, a, b, in[0] + DX_K3, 11);
+    DX_ROUND(DX_H, b, c, d, a, in[4] + DX_K3, 15);
+
+    buf[0] += a;
+    buf[1] += b;
+    buf[2] += c;
+    buf[3] += d;
+}
+
+/*
+Name characters are sign extended unless the filesystem says otherwise, which
+is what the hash versions without the _UNSIGNED suffix mean.
+*/
+static unsigned int name_char(const char *name, int i, int is_unsigned){
+    return is_unsigned ? (unsigned int)(unsigned char)name[i] : (unsigned int)(int)(signed char)name[i];
+}
+
+static unsigned int legacy_hash(const char *name, int len, int is_unsigned){
+    unsigned int hash, hash0 = 0x12a3fe2d, hash1 = 0x37abe8f9;
+    for(int i = 0; i < len; i++){
+        hash = hash1 + (hash0 ^ (name_char(name, i, is_unsigned) * 7152373));
+        if(hash & 0x80000000){
+            hash -= 0x7fffffff;
+        }
+        hash1 = hash0;
+        hash0 = hash;
+    }
+    return hash0 << 1;
+}
+
+/*
+Packs up to num words of the name into buf, padding with a pattern derived from
+the full length of the name.
+*/
+static void str2hashbuf(const char *name, int len, unsigned int *buf, int num, int is_unsigned){
+    unsigned int pad = (unsigned int)len | ((unsigned int)len << 8);
+    pad |= pad << 16;
+    unsigned int value = pad;
+    if(len > num * 4){
+        len = num * 4;
+    }
+    for(int i = 0; i < len; i++){
+        value = name_char(name, i, is_unsigned) + (value << 8);
+        if(i % 4 == 3){
+            *buf++ = value;
+            value = pad;
+            num--;
+        }
+    }
+    if(--num >= 0){
+        *buf++ = value;
+    }
+    while(--num >= 0){
+        *buf++ = pad;
+    }
+}
+
+/*
+Hashes the name with the given DX_HASH_* version and seed (four words, all zero
+meaning the default). The low bit is always clear, it is reserved for marking
+hash collisions that continue into the next leaf.
+*/
+unsigned int dx_hash(const char *name, int len, int version, const unsigned int *seed){
+    unsigned int buf[4] = {0x67452301, 0xefcdab89, 0x98badcfe, 0x10325476};
+    unsigned int in[8];
+    unsigned int hash = 0;
+    int is_unsigned = version >= DX_HASH_LEGACY_UNSIGNED;
+    if(seed && (seed[0] | seed[1] | seed[2] | seed[3])){
+        memcpy(buf, seed, sizeof(buf));
+    }
+    switch(version){
+        case DX_HASH_LEGACY:
+        case DX_HASH_LEGACY_UNSIGNED:
+            hash = legacy_hash(name, len, is_unsigned);
+            break;
+        case DX_HASH_HALF_MD4:
+        case DX_HASH_HALF_MD4_UNSIGNED:
+            for(int done = 0; done < len; done += 32){
+                str2hashbuf(name + done, len - done, in, 8, is_unsigned);
+                half_md4_transform(buf, in);
+            }
+            hash = buf[1];
+            break;
+        case DX_HASH_TEA:
+        case DX_HASH_TEA_UNSIGNED:
+            for(int done = 0; done < len; done += 16){
+                str2hashbuf(name + done, len - done, in, 4, is_unsigned);
+                tea_transform(buf, in);
+            }
+            hash = buf[0];
+            break;
+    }
+    hash &= ~1u;
+    //The largest hash is reserved as the end of directory marker for readdir.
+    if(hash == 0xfffffffe){
+        hash = 0xfffffffc;
+    }
+    return hash;
+}
+
+/*
+Maps the hash version stored in a dx_root to the one to compute with, taking
+the superblock's signedness flag into account.
+*/
+static int dx_fs_hash_version(ext2_fs *fs, int version){
+    if(EXT2_SUPER_FLAGS(get_super_block(fs)) & EXT2_FLAGS_UNSIGNED_HASH){
+        return version + DX_HASH_LEGACY_UNSIGNED;
+    }
+    return version;
+}
+
+static struct dx_countlimit *dx_countlimit(struct dx_entry *entries){
+    return (struct dx_countlimit *)entries;
+}
+
+static struct dx_root_info *dx_root_info(ext2_fs *fs, int root_block){
+    return (struct dx_root_info *)(get_block(fs, root_block) + DX_ROOT_INFO_OFFSET);
+}
+
+/*
+Returns TRUE if directory dir_inode_num carries an index the tools can use.
+*/
+int htree_is_indexed(ext2_fs *fs, int dir_inode_num){
+    if(!(get_super_block(fs)->s_feature_compat & EXT2_FEATURE_COMPAT_DIR_INDEX)){
+        return FALSE;
+    }
+    return (get_inode(fs, dir_inode_num)->i_flags & EXT2_INDEX_FL) != 0;
+}
+
+/*
+Descends from the root of directory dir_inode_num towards the leaf covering the
+hash of name, filling in one frame per index level and the hash version in use.
+Returns the number of frames, or DX_BAD_INDEX if anything on the way does not
+look like an index.
+*/
+static int dx_probe(ext2_fs *fs, int dir_inode_num, const char *name, int len, unsigned int *hash, int *hash_version, DxFrame *frames){
+    int block_num = get_file_block(fs, dir_inode_num, 0);
+    if(block_num == 0){
+        return DX_BAD_INDEX;
+    }
+    struct dx_root_info *info = dx_root_info(fs, block_num);
+    if(info->reserved_zero != 0 || info->info_length != 8 || info->hash_version > DX_HASH_TEA
+        || info->indirect_levels >= DX_MAX_LEVELS){
+        return DX_BAD_INDEX;
+    }
+    *hash_version = dx_fs_hash_version(fs, info->hash_version);
+    *hash = dx_hash(name, len, *hash_version, get_super_block(fs)->s_hash_seed);
+
+    struct dx_entry *entries = (struct dx_entry *)(get_block(fs, block_num) + DX_ROOT_ENTRIES_OFFSET);
+    unsigned int limit = DX_ROOT_LIMIT;
+    for(int level = 0; ; level++){
+        struct dx_countlimit *countlimit = dx_countlimit(entries);
+        if(countlimit->limit != limit || countlimit->count == 0 || countlimit->count > limit){
+            return DX_BAD_INDEX;
+        }
+        //Find the last entry whose hash is at most ours, entry 0 covers the rest.
+        int low = 1, high = countlimit->count - 1;
+        while(low <= high){
+            int middle = (low + high) / 2;
+            if(entries[middle].hash > *hash){
+                high = middle - 1;
+            }else{
+                low = middle + 1;
+            }
+        }
+        frames[level].entries = entries;
+        frames[level].at = entries + low - 1;
+        frames[level].block_num = block_num;
+        if(level == info->indirect_levels){
+            return level + 1;
+        }
+        block_num = get_file_block(fs, dir_inode_num, DX_BLOCK(frames[level].at));
+        if(block_num == 0){
+            return DX_BAD_INDEX;
+        }
+        entries = (struct dx_entry *)(get_block(fs, block_num) + DX_NODE_ENTRIES_OFFSET);
+        limit = DX_NODE_LIMIT;
+    }
+}
+
+/*
+Moves the frames on to the next leaf if names hashing to hash may continue
+there, which the index marks by setting the low bit of the next entry's hash.
+Returns TRUE if it moved.
+*/
+static int dx_next_leaf(ext2_fs *fs, int dir_inode_num, DxFrame *frames, int levels, unsigned int hash){
+    int level = levels - 1;
+    while(++frames[level].at >= frames[level].entries + dx_countlimit(frames[level].entries)->count){
+        if(level == 0){
+            return FALSE;
+        }
+        level--;
+    }
+    if((frames[level].at->hash & ~1u) != hash){
+        return FALSE;
+    }
+    for(; level < levels - 1; level++){
+        int block_num = get_file_block(fs, dir_inode_num, DX_BLOCK(frames[level].at));
+        if(block_num == 0){
+            return FALSE;
+        }
+        frames[level + 1].block_num = block_num;
+        frames[level + 1].entries = (struct dx_entry *)(get_block(fs, block_num) + DX_NODE_ENTRIES_OFFSET);
+        frames[level + 1].at = frames[level + 1].entries;
+    }
+    return TRUE;
+}
+
+/*
+Looks up name in indexed directory dir_inode_num, only searching the leaf (or
+leaves, on hash collisions) its hash maps to. Fills in the block and offset of
+the entry and returns 0, returns -ENOENT if it is not there, or DX_BAD_INDEX.
+*/
+int htree_lookup(ext2_fs *fs, int dir_inode_num, char *name, int name_len, int *block_num, int *offset){
+    DxFrame frames[DX_MAX_LEVELS];
+    DirNameKey key;
+    unsigned int hash;
+    int hash_version;
+    int levels = dx_probe(fs, dir_inode_num, name, name_len, &hash, &hash_version, frames);
+    if(levels < 0){
+        return levels;
+    }
+    dir_name_key_init(&key, name, name_len);
+    do{
+        int leaf = get_file_block(fs, dir_inode_num, DX_BLOCK(frames[levels - 1].at));
+        if(leaf == 0){
+            return DX_BAD_INDEX;
+        }
+        int found = dir_block_find(get_block(fs, leaf), &key, NULL);
+        if(found >= 0){
+            *block_num = leaf;
+            *offset = found;
+            return 0;
+        }
+    }while(dx_next_leaf(fs, dir_inode_num, frames, levels, hash));
+    return -ENOENT;
+}
+
+/*
+Adds a block to the end of directory dir_inode_num holding a single empty entry.
+Returns the block number and sets logical to its position in the directory.
+*/
+static int dx_append_block(ext2_fs *fs, int dir_inode_num, unsigned int *logical){
+    int block_num = add_block(fs, dir_inode_num);
+    if(block_num <= 0){
+        return -ENOSPC;
+    }
+    *logical = get_inode(fs, dir_inode_num)->i_size / EXT2_BLOCK_SIZE - 1;
+    unsigned char *block = get_block(fs, block_num);
+    memset(block, 0, EXT2_BLOCK_SIZE);
+    ((struct ext2_dir_entry *)block)->rec_len = EXT2_BLOCK_SIZE;
+    mark_blocks_dirty(fs, block_num, 1);
+    return block_num;
+}
+
+/*
+Writes a new entry into the first gap of directory block block_num big enough
+to hold it. Returns the offset of the entry, or -ENOSPC.
+*/
+static int dx_insert_into_leaf(ext2_fs *fs, int block_num, int inode, unsigned char name_len, char file_type, char *name){
+    unsigned char *block = get_block(fs, block_num);
+    int needed = dir_rec_len(name_len);
+    int offset = 0;
+    while(offset < EXT2_BLOCK_SIZE){
+        struct ext2_dir_entry *entry = (struct ext2_dir_entry *)(block + offset);
+        int next = dir_block_next(block, offset);
+        if(next < 0){
+            return -ENOSPC;
+        }
+        int used = entry->inode ? dir_rec_len(entry->name_len) : 0;
+        if(entry->rec_len - used >= needed){
+            struct ext2_dir_entry *new_entry = entry;
+            if(used){
+                offset += used;
+                new_entry = (struct ext2_dir_entry *)(block + offset);
+                new_entry->rec_len = entry->rec_len - used;
+                entry->rec_len = used;
+            }
+            new_entry->inode = inode;
+            new_entry->name_len = name_len;
+            new_entry->file_type = file_type;
+            memcpy(new_entry->name, name, name_len);
+            mark_blocks_dirty(fs, block_num, 1);
+            return offset;
+        }
+        offset = next;
+    }
+    return -ENOSPC;
+}
+
+/*
+Rewrites directory block block_num to hold exactly the count entries of map,
+packed from the start of the block, and tells the dentry cache where they went.
+*/
+static void dx_write_leaf(ext2_fs *fs, int dir_inode_num, int block_num, DxMapEntry *map, int count){
+    unsigned char *block = get_block(fs, block_num);
+    struct ext2_dir_entry *entry = (struct ext2_dir_entry *)block;
+    int offset = 0;
+    memset(block, 0, EXT2_BLOCK_SIZE);
+    entry->rec_len = EXT2_BLOCK_SIZE;
+    for(int i = 0; i < count; i++){
+        entry = (struct ext2_dir_entry *)(block + offset);
+        entry->inode = map[i].inode;
+        entry->rec_len = dir_rec_len(map[i].name_len);
+        entry->name_len = map[i].name_len;
+        entry->file_type = map[i].file_type;
+        memcpy(entry->name, map[i].name, map[i].name_len);
+        dcache_insert(&fs->dcache, dir_inode_num, map[i].name, map[i].name_len, block_num, offset);
+        offset += entry->rec_len;
+    }
+    if(count > 0){
+        //The last entry owns the rest of the block.
+        entry->rec_len = EXT2_BLOCK_SIZE - (offset - entry->rec_len);
+    }
+    mark_blocks_dirty(fs, block_num, 1);
+}
+
+static int dx_map_compare(const void *a, const void *b){
+    const DxMapEntry *x = a, *y = b;
+    if(x->hash != y->hash){
+        return x->hash < y->hash ? -1 : 1;
+    }
+    int common = x->name_len < y->name_len ? x->name_len : y->name_len;
+    int order = memcmp(x->name, y->name, common);
+    return order ? order : x->name_len - y->name_len;
+}
+
+/*
+Collects the live entries of a directory block into map, hashing each name, and
+returns how many there were. Names point into the block.
+*/
+static int dx_map_leaf(ext2_fs *fs, int block_num, int hash_version, DxMapEntry *map){
+    unsigned int *seed = get_super_block(fs)->s_hash_seed;
+    unsigned char *block = get_block(fs, block_num);
+    int count = 0, offset = 0;
+    while(offset < EXT2_BLOCK_SIZE){
+        struct ext2_dir_entry *entry = (struct ext2_dir_entry *)(block + offset);
+        int next = dir_block_next(block, offset);
+        if(next < 0){
+            break;
+        }
+        if(entry->inode != 0 && entry->name_len > 0){
+            map[count].hash = dx_hash(entry->name, entry->name_len, hash_version, seed);
+            map[count].inode = entry->inode;
+            map[count].name_len = entry->name_len;
+            map[count].file_type = entry->file_type;
+            map[count].name = entry->name;
+            count++;
+        }
+        offset = next;
+    }
+    return count;
+}
+
+/*
+Moves the upper half, by hash, of the entries in leaf block leaf_num into a new
+block at the end of the directory. Returns the new block number, sets logical
+to its place in the directory and split_hash to the first hash it holds, with
+the low bit set if that hash also continues in the old leaf.
+*/
+static int dx_split_leaf(ext2_fs *fs, int dir_inode_num, int leaf_num, int hash_version, unsigned int *logical, unsigned int *split_hash){
+    unsigned char copy[EXT2_BLOCK_SIZE];
+    DxMapEntry map[EXT2_BLOCK_SIZE / 12];
+    memcpy(copy, get_block(fs, leaf_num), EXT2_BLOCK_SIZE);
+    int count = dx_map_leaf(fs, leaf_num, hash_version, map);
+    if(count < 2){
+        return -ENOSPC;
+    }
+    //Point the names at the copy, both blocks get rewritten.
+    for(int i = 0; i < count; i++){
+        map[i].name = (char *)copy + (map[i].name - (char *)get_block(fs, leaf_num));
+    }
+    qsort(map, count, sizeof(DxMapEntry), dx_map_compare);
+
+    int total = 0, kept = 0, split = 0;
+    for(int i = 0; i < count; i++){
+        total += dir_rec_len(map[i].name_len);
+    }
+    while(split < count - 1 && kept + dir_rec_len(map[split].name_len) <= total / 2){
+        kept += dir_rec_len(map[split].name_len);
+        split++;
+    }
+    if(split == 0){
+        split = 1;
+    }
+
+    int new_leaf_num = dx_append_block(fs, dir_inode_num, logical);
+    if(new_leaf_num < 0){
+        return new_leaf_num;
+    }
+    *split_hash = map[split].hash;
+    if(map[split - 1].hash == map[split].hash){
+        *split_hash |= 1;
+    }
+    dx_write_leaf(fs, dir_inode_num, leaf_num, map, split);
+    dx_write_leaf(fs, dir_inode_num, new_leaf_num, map + split, count - split);
+    return new_leaf_num;
+}
+
+/*
+Inserts a (hash, logical block) entry into frame right after the one it is at.
+The caller makes sure there is room.
+*/
+static void dx_insert_index(ext2_fs *fs, DxFrame *frame, unsigned int hash, unsigned int logical){
+    struct dx_countlimit *countlimit = dx_countlimit(frame->entries);
+    struct dx_entry *end = frame->entries + countlimit->count;
+    memmove(frame->at + 2, frame->at + 1, (end - (frame->at + 1)) * sizeof(struct dx_entry));
+    frame->at[1].hash = hash;
+    frame->at[1].block = logical;
+    countlimit->count++;
+    mark_blocks_dirty(fs, frame->block_num, 1);
+}
+
+/*
+Starts a dx_node block at the end of the directory holding count entries.
+Returns its block number, or -ENOSPC.
+*/
+static int dx_new_node(ext2_fs *fs, int dir_inode_num, struct dx_entry *entries, int count, unsigned int *logical){
+    int node_num = dx_append_block(fs, dir_inode_num, logical);
+    if(node_num < 0){
+        return node_num;
+    }
+    struct dx_entry *node_entries = (struct dx_entry *)(get_block(fs, node_num) + DX_NODE_ENTRIES_OFFSET);
+    memcpy(node_entries, entries, count * sizeof(struct dx_entry));
+    dx_countlimit(node_entries)->limit = DX_NODE_LIMIT;
+    dx_countlimit(node_entries)->count = count;
+    return node_num;
+}
+
+/*
+Makes sure the lowest index block in frames can take one more entry, adding a
+level under the root or splitting the full node as needed. The frames are kept
+pointing at the same place. Returns 0, -ENOSPC, or -EFBIG once the whole index
+is full.
+*/
+static int dx_make_room(ext2_fs *fs, int dir_inode_num, DxFrame *frames, int *levels){
+    DxFrame *frame = &frames[*levels - 1];
+    struct dx_countlimit *countlimit = dx_countlimit(frame->entries);
+    unsigned int logical;
+    if(countlimit->count < countlimit->limit){
+        return 0;
+    }
+    if(*levels == 1){
+        //Push every root entry down into a single node under the root.
+        int node_num = dx_new_node(fs, dir_inode_num, frame->entries, countlimit->count, &logical);
+        if(node_num < 0){
+            return node_num;
+        }
+        struct dx_entry *node_entries = (struct dx_entry *)(get_block(fs, node_num) + DX_NODE_ENTRIES_OFFSET);
+        frames[1].entries = node_entries;
+        frames[1].at = node_entries + (frame->at - frame->entries);
+        frames[1].block_num = node_num;
+        countlimit->count = 1;
+        frame->entries[0].block = logical;
+        frame->at = frame->entries;
+        dx_root_info(fs, frame->block_num)->indirect_levels = 1;
+        mark_blocks_dirty(fs, frame->block_num, 1);
+        *levels = 2;
+        return 0;
+    }
+    if(dx_countlimit(frames[0].entries)->count >= DX_ROOT_LIMIT){
+        return -EFBIG;
+    }
+    //Split the node, its upper half becomes a new node listed in the root.
+    int keep = countlimit->count / 2;
+    int move = countlimit->count - keep;
+    unsigned int split_hash = frame->entries[keep].hash;
+    int node_num = dx_new_node(fs, dir_inode_num, frame->entries + keep, move, &logical);
+    if(node_num < 0){
+        return node_num;
+    }
+    countlimit->count = keep;
+    mark_blocks_dirty(fs, frame->block_num, 1);
+    dx_insert_index(fs, &frames[0], split_hash, logical);
+    if(frame->at - frame->entries >= keep){
+        struct dx_entry *node_entries = (struct dx_entry *)(get_block(fs, node_num) + DX_NODE_ENTRIES_OFFSET);
+        frame->at = node_entries + (frame->at - frame->entries - keep);
+        frame->entries = node_entries;
+        frame->block_num = node_num;
+        frames[0].at++;
+    }
+    return 0;
+}
+
+/*
+Adds an entry for name to indexed directory dir_inode_num, splitting the leaf
+its hash maps to when that leaf is full. Returns the rec_len of the new entry
+like create_dir_entry, a negative errno, or DX_BAD_INDEX.
+*/
+int htree_add_entry(ext2_fs *fs, int dir_inode_num, int inode, unsigned char name_len, char file_type, char *name){
+    DxFrame frames[DX_MAX_LEVELS];
+    unsigned int hash;
+    int hash_version;
+    int levels = dx_probe(fs, dir_inode_num, name, name_len, &hash, &hash_version, frames);
+    if(levels < 0){
+        return levels;
+    }
+    int leaf_num = get_file_block(fs, dir_inode_num, DX_BLOCK(frames[levels - 1].at));
+    if(leaf_num == 0){
+        return DX_BAD_INDEX;
+    }
+    int offset = dx_insert_into_leaf(fs, leaf_num, inode, name_len, file_type, name);
+    if(offset == -ENOSPC){
+        int error = dx_make_room(fs, dir_inode_num, frames, &levels);
+        if(error < 0){
+            return error;
+        }
+        unsigned int logical, split_hash;
+        int new_leaf_num = dx_split_leaf(fs, dir_inode_num, leaf_num, hash_version, &logical, &split_hash);
+        if(new_leaf_num < 0){
+            return new_leaf_num;
+        }
+        dx_insert_index(fs, &frames[levels - 1], split_hash, logical);
+        if(hash >= split_hash){
+            leaf_num = new_leaf_num;
+        }
+        offset = dx_insert_into_leaf(fs, leaf_num, inode, name_len, file_type, name);
+    }
+    if(offset < 0){
+        return offset;
+    }
+    dcache_insert(&fs->dcache, dir_inode_num, name, name_len, leaf_num, offset);
+    return ((struct ext2_dir_entry *)(get_block(fs, leaf_num) + offset))->rec_len;
+}
+
+/*
+Number of leaves needed to hold the count entries of map, in order, when each
+leaf is filled to at most capacity bytes.
+*/
+static int dx_count_leaves(DxMapEntry *map, int count, int capacity){
+    int leaves = count ? 1 : 0, used = 0;
+    for(int i = 0; i < count; i++){
+        int size = dir_rec_len(map[i].name_len);
+        if(used + size > capacity){
+            leaves++;
+            used = 0;
+        }
+        used += size;
+    }
+    return leaves;
+}
+
+static int dx_count_nodes(int leaves){
+    if(leaves <= DX_ROOT_LIMIT){
+        return 0;
+    }
+    return (leaves + DX_NODE_LIMIT - 1) / DX_NODE_LIMIT;
+}
+
+/*
+Converts linear directory dir_inode_num into an indexed one. Its entries are
+sorted by hash and spread evenly over the leaves, blocks 1 to L; any dx_node
+blocks come after them. Existing blocks are reused and more are added if the
+index needs them. Returns 0 or a negative errno, leaving the directory linear
+on failure.
+*/
+int htree_build(ext2_fs *fs, int dir_inode_num){
+    struct ext2_super_block *super_block = get_super_block(fs);
+    struct ext2_inode *dir_inode = get_inode(fs, dir_inode_num);
+    if(htree_is_indexed(fs, dir_inode_num)){
+        return 0;
+    }
+    int base_version = super_block->s_def_hash_version <= DX_HASH_TEA ? super_block->s_def_hash_version : DX_HASH_HALF_MD4;
+    int hash_version = dx_fs_hash_version(fs, base_version);
+    unsigned int block_count = dir_inode->i_size / EXT2_BLOCK_SIZE;
+    if(block_count == 0){
+        return -EINVAL;
+    }
+
+    //Gather the live entries, copying the names out since every block is rewritten.
+    DxMapEntry *map = malloc(sizeof(DxMapEntry) * block_count * (EXT2_BLOCK_SIZE / 12));
+    char *names = malloc((size_t)block_count * EXT2_BLOCK_SIZE);
+    if(!map || !names){
+        free(map);
+        free(names);
+        return -ENOMEM;
+    }
+    int count = 0, parent_inode_num = dir_inode_num;
+    char *name_caret = names;
+    for(unsigned int b = 0; b < block_count; b++){
+        int block_num = get_file_block(fs, dir_inode_num, b);
+        if(block_num == 0){
+            break;
+        }
+        int found = dx_map_leaf(fs, block_num, hash_version, map + count);
+        for(int i = count; i < count + found; i++){
+            memcpy(name_caret, map[i].name, map[i].name_len);
+            map[i].name = name_caret;
+            name_caret += map[i].name_len;
+        }
+        count += found;
+    }
+    int kept = 0;
+    for(int i = 0; i < count; i++){
+        if(map[i].name_len == 2 && strncmp(map[i].name, "..", 2) == 0){
+            parent_inode_num = map[i].inode;
+        }else if(!(map[i].name_len == 1 && map[i].name[0] == '.')){
+            map[kept++] = map[i];
+        }
+    }
+    count = kept;
+    qsort(map, count, sizeof(DxMapEntry), dx_map_compare);
+
+    //Use every block the directory already has, adding blocks only if needed.
+    int leaves = dx_count_leaves(map, count, EXT2_BLOCK_SIZE);
+    if(leaves == 0){
+        leaves = 1;
+    }
+    while(1 + leaves + dx_count_nodes(leaves) < block_count){
+        leaves++;
+    }
+    int nodes = dx_count_nodes(leaves);
+    if(nodes > DX_ROOT_LIMIT){
+        free(map);
+        free(names);
+        return -EFBIG;
+    }
+    //Allocated before the directory grows, so running out of memory leaves it untouched.
+    struct dx_entry *index = malloc(sizeof(struct dx_entry) * leaves);
+    if(!index){
+        free(map);
+        free(names);
+        return -ENOMEM;
+    }
+    unsigned int needed = 1 + leaves + nodes;
+    //One spare for a possible indirect block.
+    if(needed > block_count && needed - block_count + 1 > get_free_blocks_count(fs)){
+        free(index);
+        free(map);
+        free(names);
+        return -ENOSPC;
+    }
+    while(block_count < needed){
+        unsigned int logical;
+        if(dx_append_block(fs, dir_inode_num, &logical) < 0){
+            free(index);
+            free(map);
+            free(names);
+            return -ENOSPC;
+        }
+        block_count++;
+    }
+
+    //Smallest fill that still fits all the entries into the leaves.
+    int low = 12, high = EXT2_BLOCK_SIZE;
+    while(low < high){
+        int middle = (low + high) / 2;
+        if(dx_count_leaves(map, count, middle) <= leaves){
+            high = middle;
+        }else{
+            low = middle + 1;
+        }
+    }
+    int capacity = low;
+
+    int next = 0;
+    for(int l = 0; l < leaves; l++){
+        int first = next, used = 0;
+        while(next < count && used + dir_rec_len(map[next].name_len) <= capacity){
+            used += dir_rec_len(map[next].name_len);
+            next++;
+        }
+        index[l].block = 1 + l;
+        if(first == next){
+            index[l].hash = DX_EMPTY_LEAF_HASH;
+        }else{
+            index[l].hash = map[first].hash;
+            if(first > 0 && map[first - 1].hash == map[first].hash){
+                index[l].hash |= 1;
+            }
+        }
+        dx_write_leaf(fs, dir_inode_num, get_file_block(fs, dir_inode_num, 1 + l), map + first, next - first);
+    }
+
+    int root_num = get_file_block(fs, dir_inode_num, 0);
+    unsigned char *root = get_block(fs, root_num);
+    memset(root, 0, EXT2_BLOCK_SIZE);
+    struct ext2_dir_entry *dot = (struct ext2_dir_entry *)root;
+    dot->inode = dir_inode_num;
+    dot->rec_len = 12;
+    dot->name_len = 1;
+    dot->file_type = EXT2_FT_DIR;
+    dot->name[0] = '.';
+    struct ext2_dir_entry *dotdot = (struct ext2_dir_entry *)(root + 12);
+    dotdot->inode = parent_inode_num;
+    dotdot->rec_len = EXT2_BLOCK_SIZE - 12;
+    dotdot->name_len = 2;
+    dotdot->file_type = EXT2_FT_DIR;
+    dotdot->name[0] = '.';
+    dotdot->name[1] = '.';
+    struct dx_root_info *info = (struct dx_root_info *)(root + DX_ROOT_INFO_OFFSET);
+    info->hash_version = base_version;
+    info->info_length = 8;
+    info->indirect_levels = nodes ? 1 : 0;
+    struct dx_entry *root_entries = (struct dx_entry *)(root + DX_ROOT_ENTRIES_OFFSET);
+    if(nodes == 0){
+        memcpy(root_entries, index, leaves * sizeof(struct dx_entry));
+        dx_countlimit(root_entries)->count = leaves;
+    }else{
+        int per_node = (leaves + nodes - 1) / nodes;
+        for(int n = 0; n < nodes; n++){
+            int first = n * per_node;
+            int in_node = leaves - first < per_node ? leaves - first : per_node;
+            int node_num = get_file_block(fs, dir_inode_num, 1 + leaves + n);
+            unsigned char *node = get_block(fs, node_num);
+            memset(node, 0, EXT2_BLOCK_SIZE);
+            ((struct ext2_dir_entry *)node)->rec_len = EXT2_BLOCK_SIZE;
+            struct dx_entry *node_entries = (struct dx_entry *)(node + DX_NODE_ENTRIES_OFFSET);
+            memcpy(node_entries, index + first, in_node * sizeof(struct dx_entry));
+            dx_countlimit(node_entries)->limit = DX_NODE_LIMIT;
+            dx_countlimit(node_entries)->count = in_node;
+            mark_blocks_dirty(fs, node_num, 1);
+            root_entries[n].hash = index[first].hash;
+            root_entries[n].block = 1 + leaves + n;
+        }
+        dx_countlimit(root_entries)->count = nodes;
+    }
+    dx_countlimit(root_entries)->limit = DX_ROOT_LIMIT;
+    mark_blocks_dirty(fs, root_num, 1);
+
+    dir_inode->i_flags |= EXT2_INDEX_FL;
+    mark_dirty(fs, dir_inode, sizeof(struct ext2_inode));
+    super_block->s_feature_compat |= EXT2_FEATURE_COMPAT_DIR_INDEX;
+    mark_dirty(fs, super_block, sizeof(struct ext2_super_block));
+
+    free(index);
+    free(map);
+    free(names);
+    return 0;
+}
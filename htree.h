@@ -0,0 +1,55 @@
+#ifndef HTREE_FUNCTIONS
+#define HTREE_FUNCTIONS
+
+/*
+Hashed directory index (HTree), on-disk compatible with the dir_index feature.
+Logical block 0 of an indexed directory holds the "." and ".." entries followed
+by the dx_root; its entries map hash ranges to leaf blocks, or to dx_node blocks
+when the tree has a second level. Leaves are ordinary directory blocks, so code
+that walks a directory block by block keeps working on indexed directories.
+*/
+
+#define EXT2_FEATURE_COMPAT_DIR_INDEX 0x0020
+#define EXT2_INDEX_FL 0x00001000
+
+//s_flags lives in the superblock padding of ext2.h.
+#define EXT2_SUPER_FLAGS(sb) ((sb)->s_reserved[22])
+#define EXT2_FLAGS_SIGNED_HASH 0x0001
+#define EXT2_FLAGS_UNSIGNED_HASH 0x0002
+
+#define DX_HASH_LEGACY 0
+#define DX_HASH_HALF_MD4 1
+#define DX_HASH_TEA 2
+#define DX_HASH_LEGACY_UNSIGNED 3
+#define DX_HASH_HALF_MD4_UNSIGNED 4
+#define DX_HASH_TEA_UNSIGNED 5
+
+//Returned when the index is damaged, callers fall back to a linear scan.
+#define DX_BAD_INDEX -EIO
+
+struct dx_root_info {
+    unsigned int   reserved_zero;
+    unsigned char  hash_version;
+    unsigned char  info_length;   /* 8 */
+    unsigned char  indirect_levels;
+    unsigned char  unused_flags;
+};
+
+//Overlays the hash field of the first dx_entry of every index block.
+struct dx_countlimit {
+    unsigned short limit;
+    unsigned short count;
+};
+
+struct dx_entry {
+    unsigned int   hash;
+    unsigned int   block;         /* Logical block in the directory */
+};
+
+unsigned int dx_hash(const char*, int, int, const unsigned int*);
+int htree_is_indexed(ext2_fs*, int);
+int htree_lookup(ext2_fs*, int, char*, int, int*, int*);
+int htree_add_entry(ext2_fs*, int, int, unsigned char, char, char*);
+int htree_build(ext2_fs*, int);
+
+#endif
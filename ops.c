@@ -0,0 +1,1665 @@
+#define _GNU_SOURCE
+#include <time.h>
+#include <dirent.h>
+#include <sys/uio.h>
+
+#include "ops.h"
+#include "walk.h"
+
+//Pipes and stdin are buffered this many blocks at a time, since their size isn't known up front.
+#define STREAM_CHUNK_BLOCKS 1024
+
+//Exports hand writev at most this many iovecs at once (IOV_MAX on Linux).
+#define EXPORT_IOVECS 1024
+//Holes written to a pipe come from this many shared zero bytes per iovec.
+#define EXPORT_ZERO_BYTES 65536
+
+/*
+Finds where a new entry named by dest goes. If dest is an existing directory,
+or a symbolic link to one, the entry goes inside it under source_name and
+*dest is replaced by that longer path. Returns the inode number of the
+directory to add the entry to, or a negative errno.
+*/
+static int locate_new_entry(ext2_fs *fs, PathView **dest, PathComponent *source_name){
+    SearchResult result = find_dir_entry(fs, *dest, FALSE);
+
+    if(result.error_code >= 0 && result.file_type != EXT2_FT_DIR){
+        return -EEXIST;
+    }else if((result.error_code >= 0 && result.file_type == EXT2_FT_DIR) || result.extra_info == JUST_ROOT){
+        //The dest is just a dir, use the same name as the source, which must not exist yet.
+        if(!source_name){
+            return -EISDIR;
+        }
+        //A symbolic link to a directory names the directory by its target.
+        PathView *dir_path = *dest;
+        if(result.softlink_path){
+            dir_path = path_view_create(result.softlink_path);
+        }
+        PathView *new_path = path_view_join(dir_path, source_name);
+        if(dir_path != *dest){
+            path_view_destroy(dir_path);
+        }
+        path_view_destroy(*dest);
+        *dest = new_path;
+        result = find_dir_entry(fs, *dest, FALSE);
+        if(result.error_code >= 0){
+            return -EEXIST;
+        }
+        if(result.extra_info != MISSING_FILE){
+            return result.error_code;
+        }
+    }else if(result.extra_info != MISSING_FILE){
+        //Bad path: some directory on the way doesn't exist.
+        return result.error_code;
+    }
+    return result.parent_inode_num;
+}
+
+/*
+Adds an entry for inode to directory parent_inode_num, growing the directory
+by a block if the entry doesn't fit. The name is checked again under the
+directory's write lock, another thread may have taken it since the path was
+resolved. Returns 0 or a negative errno.
+*/
+static int add_dir_entry(ext2_fs *fs, int parent_inode_num, int inode, PathComponent *name, char file_type){
+    int block_num, offset;
+    dir_lock_write(fs, parent_inode_num);
+    if(lookup_dir_entry(fs, parent_inode_num, name->name, name->len, &block_num, &offset) == 0){
+        dir_unlock(fs, parent_inode_num);
+        return -EEXIST;
+    }
+    int dir_result = create_dir_entry(fs, parent_inode_num, inode, name->len, file_type, name->name);
+    if(dir_result == -ENOSPC){
+        dir_result = add_block(fs, parent_inode_num);
+        if(dir_result >= 0){
+            dir_result = create_dir_entry(fs, parent_inode_num, inode, name->len, file_type, name->name);
+        }
+    }
+    dir_unlock(fs, parent_inode_num);
+    return dir_result < 0 ? dir_result : 0;
+}
+
+/*
+Adds one to the links count of inode_num unless it already dropped to 0,
+which means another thread just removed the file. Returns 0 or -ENOENT.
+*/
+static int add_link(ext2_fs *fs, int inode_num){
+    struct ext2_inode *inode = get_inode(fs, inode_num);
+    unsigned short links = __atomic_load_n(&inode->i_links_count, __ATOMIC_RELAXED);
+    do{
+        if(links == 0){
+            return -ENOENT;
+        }
+    }while(!__atomic_compare_exchange_n(&inode->i_links_count, &links, links + 1, 1, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED));
+    mark_dirty(fs, inode, sizeof(struct ext2_inode));
+    return 0;
+}
+
+/*
+Returns inode_num to the free pool, marked deleted so nothing mistakes it for
+a live file.
+*/
+static void release_inode(ext2_fs *fs, int inode_num){
+    struct ext2_inode *inode = get_inode(fs, inode_num);
+    if((inode->i_mode & 0xf000) == EXT2_S_IFDIR){
+        dcache_invalidate_dir(&fs->dcache, inode_num);
+    }
+    inode->i_links_count = 0;
+    inode->i_dtime = (unsigned)time(NULL);
+    mark_dirty(fs, inode, sizeof(struct ext2_inode));
+    update_bitmap(fs, inode_num, 0, INODE);
+    update_free_count(fs, inode_num, 1, INODE);
+}
+
+/*
+Creates directory path. With index set the directory gets a hash index, and an
+existing directory is converted to one instead of failing with EEXIST.
+*/
+int make_directory(ext2_fs *fs, char *path_string, int index){
+    PathView *path = path_view_create(path_string);
+    if(!path){
+        return -ENOMEM;
+    }
+    SearchResult result = find_dir_entry(fs, path, FALSE);
+    int dir_inode_num = 0;
+    if(path->count == 0){
+        //The path resolves to /, which already exists.
+        dir_inode_num = EXT2_ROOT_INO;
+    }else if(result.error_code >= 0 && result.file_type == EXT2_FT_DIR){
+        dir_inode_num = result.inode_num;
+    }
+    if(index && dir_inode_num){
+        path_view_destroy(path);
+        dir_lock_write(fs, dir_inode_num);
+        int index_result = htree_build(fs, dir_inode_num);
+        dir_unlock(fs, dir_inode_num);
+        if(index_result < 0){
+            fprintf(stderr, "%s: error %d could not index directory.\n", path_string, index_result);
+        }
+        return index_result;
+    }
+    if(path->count == 0 || result.error_code >= 0){
+        fprintf(stderr, "%s: error %d directory already exists.\n", path_string, -EEXIST);
+        path_view_destroy(path);
+        return -EEXIST;
+    }
+    if(result.extra_info != MISSING_FILE){
+        fprintf(stderr, "%s: error %d bad path given.\n", path_string, result.error_code);
+        path_view_destroy(path);
+        return result.error_code;
+    }
+
+    int block = get_free_block(fs);
+    if(block < 0){
+        fprintf(stderr, "%s: error %d insufficient space.\n", path_string, block);
+        path_view_destroy(path);
+        return block;
+    }
+    int inode = get_free_inode(fs);
+    if(inode < 0){
+        fprintf(stderr, "%s: error %d insufficient space.\n", path_string, inode);
+        update_bitmap(fs, block, 0, BLOCK);
+        update_free_count(fs, block, 1, BLOCK);
+        path_view_destroy(path);
+        return inode;
+    }
+
+    //Create an inode for the new directory.
+    create_inode(fs, inode, EXT2_S_IFDIR, EXT2_BLOCK_SIZE, 2, 2, (unsigned int *) &block, 1);
+
+    /*
+    Fill in the new directory before it is linked in, nobody else can see it
+    yet. No need to worry about insufficient space here because we know the
+    new dir block is empty.
+    */
+    int parent_inode_num = result.parent_inode_num;
+    char* current_name = ".";
+    char* parent_name = "..";
+    memset(get_block(fs, block), 0, EXT2_BLOCK_SIZE);
+    create_dir_entry(fs, inode, inode, strlen(current_name), EXT2_FT_DIR, current_name);
+    create_dir_entry(fs, inode, parent_inode_num, strlen(parent_name), EXT2_FT_DIR, parent_name);
+    int index_result = 0;
+    if(index){
+        index_result = htree_build(fs, inode);
+        if(index_result < 0){
+            fprintf(stderr, "%s: error %d could not index directory.\n", path_string, index_result);
+        }
+    }
+
+    //The new directory's name is the last component of the path.
+    int add_result = add_dir_entry(fs, parent_inode_num, inode, path_view_last(path), EXT2_FT_DIR);
+    if(add_result < 0){
+        if(add_result == -EEXIST){
+            fprintf(stderr, "%s: error %d directory already exists.\n", path_string, add_result);
+        }else{
+            fprintf(stderr, "%s: error %d insufficient space.\n", path_string, add_result);
+        }
+        release_file_blocks(fs, inode);
+        release_inode(fs, inode);
+        path_view_destroy(path);
+        return add_result;
+    }
+
+    struct ext2_inode *parent_inode = get_inode(fs, parent_inode_num);
+    __atomic_add_fetch(&parent_inode->i_links_count, 1, __ATOMIC_RELAXED);
+    mark_dirty(fs, parent_inode, sizeof(struct ext2_inode));
+
+    struct ext2_group_desc *group_descriptor = get_group_descriptor(fs, inode_group(fs, inode));
+    __atomic_add_fetch(&group_descriptor->bg_used_dirs_count, 1, __ATOMIC_RELAXED);
+    mark_dirty(fs, group_descriptor, sizeof(struct ext2_group_desc));
+
+    path_view_destroy(path);
+    return index_result;
+}
+
+/*
+Reads until length bytes arrived or the source ran dry. Returns the number of
+bytes read, or -1 on a read error.
+*/
+static ssize_t read_fully(int fd, unsigned char *buffer, size_t length){
+    size_t done = 0;
+    while(done < length){
+        ssize_t bytes_read = read(fd, buffer + done, length - done);
+        if(bytes_read < 0){
+            if(errno == EINTR){
+                continue;
+            }
+            return -1;
+        }
+        if(bytes_read == 0){
+            break;
+        }
+        done += bytes_read;
+    }
+    return done;
+}
+
+/*
+Copies length bytes of the source, from its current offset, into the run of
+image blocks starting at block. The kernel does the copy with copy_file_range
+while it can; otherwise the data is read straight into the mapping. Bytes past
+length up to the end of the run are zeroed. Returns 0 or -1 on error.
+*/
+static int copy_run(ext2_fs *fs, int source_fd, unsigned int block, int run, size_t length, int *use_copy_range){
+    unsigned char *data = get_block(fs, block);
+    size_t done = 0;
+    while(*use_copy_range && done < length){
+        loff_t image_offset = (loff_t)block * EXT2_BLOCK_SIZE + done;
+        ssize_t copied = copy_file_range(source_fd, NULL, fs->fd, &image_offset, length - done, 0);
+        if(copied <= 0){
+            //Unsupported between these files (or a short source), finish with plain reads.
+            *use_copy_range = FALSE;
+            break;
+        }
+        done += copied;
+    }
+    if(done < length){
+        ssize_t bytes_read = read_fully(source_fd, data + done, length - done);
+        if(bytes_read < 0 || (size_t)bytes_read != length - done){
+            return -1;
+        }
+    }
+    //Don't leave a previous owner's bytes after the end of the file.
+    memset(data + length, 0, (size_t)run * EXT2_BLOCK_SIZE - length);
+    mark_blocks_dirty(fs, block, run);
+    return 0;
+}
+
+/*
+Copies length bytes from the source into the blocks of inode inode_num, one
+contiguous run at a time, with the next run prefetched. Each run is read from
+its own offset in the source, so the map may have holes. Blocks that come out
+all zeros, which only happens when the source wasn't read for them before its
+blocks were allocated, are punched back out of the map. Returns 0 or -1 on
+error.
+*/
+static int copy_into_file(ext2_fs *fs, int source_fd, int inode_num, size_t length, int *use_copy_range){
+    BlockMapIter iter;
+    BlockExtent extent;
+    block_map_iter_init(&iter, fs, inode_num, BLOCK_MAP_PREFETCH);
+    while(block_map_next(&iter, &extent)){
+        size_t done = (size_t)extent.logical * EXT2_BLOCK_SIZE;
+        if(done >= length){
+            break;
+        }
+        size_t wanted = (size_t)extent.length * EXT2_BLOCK_SIZE;
+        if(wanted > length - done){
+            wanted = length - done;
+        }
+        if(lseek(source_fd, done, SEEK_SET) < 0
+            || copy_run(fs, source_fd, extent.physical, extent.length, wanted, use_copy_range) < 0){
+            return -1;
+        }
+        for(unsigned int b = 0; b < extent.length; b++){
+            if(block_is_zero(get_block(fs, extent.physical + b))){
+                punch_file_block(fs, inode_num, extent.logical + b);
+            }
+        }
+    }
+    return 0;
+}
+
+typedef struct source_run {
+    unsigned long long first;
+    unsigned long long length;
+} SourceRun;
+
+/*
+The blocks of a source file that need allocating, as runs of logical blocks,
+and how many blocks they add up to.
+*/
+typedef struct source_runs {
+    SourceRun *runs;
+    int count;
+    int capacity;
+    unsigned long long blocks;
+} SourceRuns;
+
+/*
+Adds length blocks from first on to runs, extending the last run if they
+follow on from it. Returns 0 or -ENOMEM.
+*/
+static int add_source_run(SourceRuns *runs, unsigned long long first, unsigned long long length){
+    runs->blocks += length;
+    SourceRun *last = runs->count > 0 ? &runs->runs[runs->count - 1] : NULL;
+    if(last && last->first + last->length == first){
+        last->length += length;
+        return 0;
+    }
+    if(runs->count == runs->capacity){
+        int capacity = runs->capacity ? runs->capacity * 2 : 16;
+        SourceRun *grown = realloc(runs->runs, sizeof(SourceRun) * capacity);
+        if(!grown){
+            return -ENOMEM;
+        }
+        runs->runs = grown;
+        runs->capacity = capacity;
+    }
+    runs->runs[runs->count++] = (SourceRun){first, length};
+    return 0;
+}
+
+/*
+Reads blocks first to last of the source, size bytes long, a chunk at a time
+and adds the runs of blocks holding anything but zeros to runs. Returns 0 or
+a negative errno.
+*/
+static int scan_source_range(SourceRuns *runs, int source_fd, unsigned char *chunk, unsigned long long first, unsigned long long last, unsigned long long size){
+    if(lseek(source_fd, first * EXT2_BLOCK_SIZE, SEEK_SET) < 0){
+        return -EIO;
+    }
+    while(first < last){
+        int count = last - first < STREAM_CHUNK_BLOCKS ? last - first : STREAM_CHUNK_BLOCKS;
+        size_t wanted = (size_t)count * EXT2_BLOCK_SIZE;
+        if(first * EXT2_BLOCK_SIZE + wanted > size){
+            wanted = size - first * EXT2_BLOCK_SIZE;
+        }
+        ssize_t bytes_read = read_fully(source_fd, chunk, wanted);
+        if(bytes_read < 0 || (size_t)bytes_read != wanted){
+            return -EIO;
+        }
+        memset(chunk + wanted, 0, (size_t)count * EXT2_BLOCK_SIZE - wanted);
+        int b = 0;
+        while(b < count){
+            if(block_is_zero(chunk + (size_t)b * EXT2_BLOCK_SIZE)){
+                b++;
+                continue;
+            }
+            int run = 1;
+            while(b + run < count && !block_is_zero(chunk + (size_t)(b + run) * EXT2_BLOCK_SIZE)){
+                run++;
+            }
+            if(add_source_run(runs, first + b, run) < 0){
+                return -ENOMEM;
+            }
+            b += run;
+        }
+        first += count;
+    }
+    return 0;
+}
+
+/*
+Works out which blocks a size byte copy of source_fd needs. A sparse source
+(one with fewer bytes allocated than its size) is walked with SEEK_DATA and
+SEEK_HOLE, so its holes stay holes; anything else is one extent. With
+skip_zeros set each extent is also read, and blocks of nothing but zeros are
+left out, so a file of zeros takes no space. Returns 0 or a negative errno.
+*/
+static int find_source_runs(SourceRuns *runs, int source_fd, unsigned long long size, int sparse, int skip_zeros){
+    unsigned long long blocks = (size + EXT2_BLOCK_SIZE - 1) / EXT2_BLOCK_SIZE;
+    unsigned char *chunk = NULL;
+    memset(runs, 0, sizeof(SourceRuns));
+    if(skip_zeros && blocks > 0){
+        chunk = malloc((size_t)STREAM_CHUNK_BLOCKS * EXT2_BLOCK_SIZE);
+        if(!chunk){
+            return -ENOMEM;
+        }
+    }
+    off_t data = 0;
+    unsigned long long next = 0;
+    int result = 0;
+    while(result == 0 && next < blocks){
+        unsigned long long first = next, last = blocks;
+        if(sparse){
+            data = lseek(source_fd, data, SEEK_DATA);
+            if(data < 0 && errno == ENXIO){
+                //Only a hole is left.
+                break;
+            }
+            //With no hole reporting here, whatever is left is data.
+            off_t hole = data < 0 ? (off_t)size : lseek(source_fd, data, SEEK_HOLE);
+            if(hole < 0 || (unsigned long long)hole > size){
+                hole = size;
+            }
+            //An extent starting mid block shares that block with the previous one.
+            if(data >= 0 && (unsigned long long)data / EXT2_BLOCK_SIZE > first){
+                first = data / EXT2_BLOCK_SIZE;
+            }
+            last = (hole + EXT2_BLOCK_SIZE - 1) / EXT2_BLOCK_SIZE;
+            data = hole;
+        }
+        if(last > first){
+            result = skip_zeros ? scan_source_range(runs, source_fd, chunk, first, last, size) : add_source_run(runs, first, last - first);
+            next = last;
+        }
+    }
+    free(chunk);
+    if(result < 0){
+        free(runs->runs);
+        runs->runs = NULL;
+    }
+    return result;
+}
+
+/*
+Gives inode inode_num the blocks of runs, one allocation per run, so runs
+that follow each other in the file get blocks that do too. Returns 0 or a
+negative errno.
+*/
+static int allocate_source_runs(ext2_fs *fs, int inode_num, SourceRuns *runs){
+    for(int r = 0; r < runs->count; r++){
+        int result = allocate_file_blocks(fs, inode_num, runs->runs[r].first, runs->runs[r].length, NULL);
+        if(result < 0){
+            return result;
+        }
+    }
+    return 0;
+}
+
+/*
+Returns the number of data blocks a copy of the file described by source_stat
+takes: all of them for a dense file, no more than it has allocated for a
+sparse one.
+*/
+static unsigned long long source_data_blocks(struct stat *source_stat){
+    unsigned long long blocks = ((unsigned long long)source_stat->st_size + EXT2_BLOCK_SIZE - 1) / EXT2_BLOCK_SIZE;
+    unsigned long long allocated = ((unsigned long long)source_stat->st_blocks * 512 + EXT2_BLOCK_SIZE - 1) / EXT2_BLOCK_SIZE;
+    return allocated < blocks ? allocated : blocks;
+}
+
+static int source_is_sparse(struct stat *source_stat){
+    return S_ISREG(source_stat->st_mode) && (unsigned long long)source_stat->st_blocks * 512 < (unsigned long long)source_stat->st_size;
+}
+
+/*
+Buffers the source a chunk at a time, allocating exactly what each chunk
+needs, until EOF. Sets *file_size to the bytes copied. Returns 0 or a negative
+errno.
+*/
+static int stream_into_file(ext2_fs *fs, int source_fd, int inode_num, size_t *file_size){
+    unsigned char *chunk = malloc((size_t)STREAM_CHUNK_BLOCKS * EXT2_BLOCK_SIZE);
+    unsigned int blocks[STREAM_CHUNK_BLOCKS];
+    int logical = 0;
+    int copy_result = 0;
+    ssize_t chunk_size;
+    if(!chunk){
+        return -ENOMEM;
+    }
+    while((chunk_size = read_fully(source_fd, chunk, (size_t)STREAM_CHUNK_BLOCKS * EXT2_BLOCK_SIZE)) > 0){
+        int count = (chunk_size + EXT2_BLOCK_SIZE - 1) / EXT2_BLOCK_SIZE;
+        memset(chunk + chunk_size, 0, (size_t)count * EXT2_BLOCK_SIZE - chunk_size);
+        //Runs of blocks with data get allocated, blocks of zeros are left as holes.
+        int b = 0;
+        while(b < count && copy_result == 0){
+            if(block_is_zero(chunk + (size_t)b * EXT2_BLOCK_SIZE)){
+                b++;
+                continue;
+            }
+            int run = 1;
+            while(b + run < count && !block_is_zero(chunk + (size_t)(b + run) * EXT2_BLOCK_SIZE)){
+                run++;
+            }
+            copy_result = allocate_file_blocks(fs, inode_num, logical + b, run, blocks);
+            for(int r = 0; copy_result == 0 && r < run; r++){
+                memcpy(get_block(fs, blocks[r]), chunk + (size_t)(b + r) * EXT2_BLOCK_SIZE, EXT2_BLOCK_SIZE);
+                mark_blocks_dirty(fs, blocks[r], 1);
+            }
+            b += run;
+        }
+        if(copy_result < 0){
+            break;
+        }
+        logical += count;
+        *file_size += chunk_size;
+        if(chunk_size < (ssize_t)STREAM_CHUNK_BLOCKS * EXT2_BLOCK_SIZE){
+            break;
+        }
+    }
+    if(chunk_size < 0){
+        copy_result = -EIO;
+    }
+    free(chunk);
+    return copy_result;
+}
+
+/*
+Copies the local file source ("-" for stdin) to dest in the image. If dest is
+a directory the copy goes inside it under the source's name.
+*/
+int copy_file(ext2_fs *fs, char *source, char *dest){
+    //"-" reads the file from stdin.
+    int source_file_descriptor;
+    if(strcmp(source, "-") == 0){
+        source_file_descriptor = STDIN_FILENO;
+    }else{
+        source_file_descriptor = open(source, O_RDONLY);
+    }
+    struct stat source_stat;
+    if(source_file_descriptor < 0 || fstat(source_file_descriptor, &source_stat) < 0){
+        fprintf(stderr, "%s: error %d unable to open source file.\n", source, ENOENT);
+        if(source_file_descriptor > STDIN_FILENO){
+            close(source_file_descriptor);
+        }
+        return -ENOENT;
+    }
+
+    PathView *path = path_view_create(dest);
+    PathView *source_path = path_view_create(source);
+    int parent_inode_num = locate_new_entry(fs, &path, path_view_last(source_path));
+    path_view_destroy(source_path);
+    if(parent_inode_num < 0){
+        path_view_destroy(path);
+        if(source_file_descriptor != STDIN_FILENO){
+            close(source_file_descriptor);
+        }
+        return parent_inode_num;
+    }
+
+    struct timespec copy_start, copy_end;
+    clock_gettime(CLOCK_MONOTONIC, &copy_start);
+
+    //Regular files are sized by fstat, so nothing gets allocated for a file that can't fit.
+    int streamed = !S_ISREG(source_stat.st_mode);
+    size_t file_size = 0;
+    SourceRuns runs = {NULL, 0, 0, 0};
+    int copy_result = 0;
+    if(!streamed){
+        file_size = source_stat.st_size;
+        if((file_size + EXT2_BLOCK_SIZE - 1) / EXT2_BLOCK_SIZE > EXT2_MAX_FILE_BLOCKS){
+            copy_result = -EFBIG;
+        }else{
+            //The zero blocks are found before anything is allocated, so they never need space.
+            copy_result = find_source_runs(&runs, source_file_descriptor, file_size, source_is_sparse(&source_stat), TRUE);
+            //Blocks may come from any group, so only the file system wide count matters.
+            if(copy_result == 0 && get_free_blocks_count(fs) < (long)(runs.blocks + index_blocks_needed(runs.blocks))){
+                copy_result = -ENOSPC;
+            }
+        }
+    }
+    int inode = copy_result == 0 ? get_free_inode(fs) : copy_result;
+    if(inode < 0){
+        free(runs.runs);
+        if(inode == -EFBIG){
+            fprintf(stderr, "%s: error %d file too large.\n", source, inode);
+        }else if(inode == -EIO){
+            fprintf(stderr, "%s: error reading source file.\n", source);
+        }else if(inode == -ENOMEM){
+            fprintf(stderr, "%s: error %d out of memory.\n", source, inode);
+        }else{
+            fprintf(stderr, "%s: error %d insufficient space.\n", dest, inode);
+        }
+        path_view_destroy(path);
+        if(source_file_descriptor != STDIN_FILENO){
+            close(source_file_descriptor);
+        }
+        return inode;
+    }
+    //Create an inode for the new file, start it out at size 0, link 1, and no blocks.
+    int phony_block = 0;
+    create_inode(fs, inode, EXT2_S_IFREG, 0, 1, 0, (unsigned int *) &phony_block, 1);
+
+    int use_copy_range = !streamed;
+    if(!streamed){
+        //Reserve every data block (and the index blocks) up front, then copy in a single pass.
+        copy_result = allocate_source_runs(fs, inode, &runs);
+        free(runs.runs);
+        if(copy_result == 0 && copy_into_file(fs, source_file_descriptor, inode, file_size, &use_copy_range) < 0){
+            copy_result = -EIO;
+        }
+    }else{
+        copy_result = stream_into_file(fs, source_file_descriptor, inode, &file_size);
+    }
+    if(source_file_descriptor != STDIN_FILENO){
+        close(source_file_descriptor);
+    }
+    if(copy_result == 0){
+        set_file_size(fs, inode, file_size);
+        copy_result = add_dir_entry(fs, parent_inode_num, inode, path_view_last(path), EXT2_FT_REG_FILE);
+    }
+    if(copy_result < 0){
+        if(copy_result == -EIO){
+            fprintf(stderr, "%s: error reading source file.\n", source);
+        }else if(copy_result == -EFBIG){
+            fprintf(stderr, "%s: error %d file too large.\n", source, copy_result);
+        }else if(copy_result == -EEXIST){
+            fprintf(stderr, "%s: error %d file already exists.\n", dest, copy_result);
+        }else{
+            fprintf(stderr, "%s: error %d insufficient space.\n", dest, copy_result);
+        }
+        //Hand back everything this file took.
+        release_file_blocks(fs, inode);
+        release_inode(fs, inode);
+        path_view_destroy(path);
+        return copy_result;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &copy_end);
+    if(fs->stats){
+        double elapsed = (copy_end.tv_sec - copy_start.tv_sec) + (copy_end.tv_nsec - copy_start.tv_nsec) / 1e9;
+        fprintf(stderr, "copied %zu bytes in %.3f s (%.1f MB/s)%s\n", file_size, elapsed,
+            elapsed > 0 ? file_size / elapsed / (1024 * 1024) : 0.0, use_copy_range ? " via copy_file_range" : "");
+    }
+    path_view_destroy(path);
+    return 0;
+}
+
+/*
+One file, directory or symbolic link of a host tree being imported. Nodes are
+kept in breadth-first order, so the children of a directory are the
+child_count nodes from first_child on.
+*/
+typedef struct import_node {
+    char *host_path;
+    char *name;
+    int name_len;
+    int parent;
+    char file_type;
+    off_t size;
+    //Regular file with fewer bytes allocated than its size, see find_source_runs.
+    int sparse;
+    unsigned long long data_blocks;
+    int first_child;
+    int child_count;
+    int subdirs;
+    int inode_num;
+} ImportNode;
+
+typedef struct import_plan {
+    ImportNode *nodes;
+    int count;
+    int capacity;
+    //File nodes, biggest first, and the next one a copy worker should take.
+    int *files;
+    int file_count;
+    int next_file;
+    int failed;
+    ext2_fs *fs;
+} ImportPlan;
+
+/*
+Appends a node for host_path (taken over by the plan) to the plan. Returns its
+index, or -ENOMEM.
+*/
+static int import_add_node(ImportPlan *plan, char *host_path, int parent, struct stat *host_stat){
+    if(plan->count == plan->capacity){
+        int capacity = plan->capacity ? plan->capacity * 2 : 256;
+        ImportNode *nodes = realloc(plan->nodes, sizeof(ImportNode) * capacity);
+        if(!nodes){
+            free(host_path);
+            return -ENOMEM;
+        }
+        plan->nodes = nodes;
+        plan->capacity = capacity;
+    }
+    ImportNode *node = &plan->nodes[plan->count];
+    memset(node, 0, sizeof(ImportNode));
+    node->host_path = host_path;
+    node->name = strrchr(host_path, '/') ? strrchr(host_path, '/') + 1 : host_path;
+    node->name_len = strlen(node->name);
+    node->parent = parent;
+    node->size = host_stat->st_size;
+    if(S_ISDIR(host_stat->st_mode)){
+        node->file_type = EXT2_FT_DIR;
+    }else if(S_ISLNK(host_stat->st_mode)){
+        node->file_type = EXT2_FT_SYMLINK;
+    }else{
+        node->file_type = EXT2_FT_REG_FILE;
+        node->sparse = source_is_sparse(host_stat);
+        node->data_blocks = source_data_blocks(host_stat);
+    }
+    return plan->count++;
+}
+
+/*
+Walks the host tree under the directory at plan node 0, breadth first, adding
+a node for everything in it. Anything other than regular files, directories
+and symbolic links is skipped with a warning, as are names too long for ext2.
+Returns 0 or a negative errno.
+*/
+static int import_walk(ImportPlan *plan){
+    for(int n = 0; n < plan->count; n++){
+        if(plan->nodes[n].file_type != EXT2_FT_DIR){
+            continue;
+        }
+        DIR *dir = opendir(plan->nodes[n].host_path);
+        if(!dir){
+            fprintf(stderr, "%s: error %d unable to open source directory.\n", plan->nodes[n].host_path, errno);
+            return -errno;
+        }
+        plan->nodes[n].first_child = plan->count;
+        struct dirent *host_entry;
+        while((host_entry = readdir(dir))){
+            if(strcmp(host_entry->d_name, ".") == 0 || strcmp(host_entry->d_name, "..") == 0){
+                continue;
+            }
+            struct stat host_stat;
+            char *host_path;
+            if(asprintf(&host_path, "%s/%s", plan->nodes[n].host_path, host_entry->d_name) < 0){
+                closedir(dir);
+                return -ENOMEM;
+            }
+            if(lstat(host_path, &host_stat) < 0 || strlen(host_entry->d_name) > EXT2_NAME_LEN
+                || !(S_ISREG(host_stat.st_mode) || S_ISDIR(host_stat.st_mode) || S_ISLNK(host_stat.st_mode))){
+                fprintf(stderr, "%s: skipped, not a regular file, directory or symbolic link ext2 can hold.\n", host_path);
+                free(host_path);
+                continue;
+            }
+            int child = import_add_node(plan, host_path, n, &host_stat);
+            if(child < 0){
+                closedir(dir);
+                return child;
+            }
+            plan->nodes[n].child_count++;
+            if(plan->nodes[child].file_type == EXT2_FT_DIR){
+                plan->nodes[n].subdirs++;
+            }
+        }
+        closedir(dir);
+    }
+    return 0;
+}
+
+/*
+Packs the entries of directory node dir, "." and ".." first, into as few
+blocks as they fit in. With write set they are written into the directory's
+blocks, each block's last entry stretched to its end; otherwise they are only
+counted. Returns the number of blocks needed.
+*/
+static int import_pack_dir(ImportPlan *plan, int dir, int parent_inode_num, int write){
+    ext2_fs *fs = plan->fs;
+    ImportNode *node = &plan->nodes[dir];
+    unsigned char *data = NULL;
+    int block = -1, offset = EXT2_BLOCK_SIZE, last_offset = 0;
+    for(int i = -2; i < node->child_count; i++){
+        ImportNode *child = i >= 0 ? &plan->nodes[node->first_child + i] : NULL;
+        char *name = child ? child->name : (i == -2 ? "." : "..");
+        int name_len = child ? child->name_len : (int)strlen(name);
+        int rec_len = dir_rec_len(name_len);
+        if(offset + rec_len > EXT2_BLOCK_SIZE){
+            block++;
+            offset = 0;
+            if(write){
+                unsigned int block_num = get_file_block(fs, node->inode_num, block);
+                data = get_block(fs, block_num);
+                memset(data, 0, EXT2_BLOCK_SIZE);
+                mark_blocks_dirty(fs, block_num, 1);
+            }
+        }
+        if(write){
+            if(offset > 0){
+                ((struct ext2_dir_entry *)(data + last_offset))->rec_len = offset - last_offset;
+            }
+            struct ext2_dir_entry *entry = (struct ext2_dir_entry *)(data + offset);
+            entry->inode = child ? child->inode_num : (i == -2 ? node->inode_num : parent_inode_num);
+            entry->rec_len = EXT2_BLOCK_SIZE - offset;
+            entry->name_len = name_len;
+            entry->file_type = child ? child->file_type : EXT2_FT_DIR;
+            memcpy(entry->name, name, name_len);
+            last_offset = offset;
+        }
+        offset += rec_len;
+    }
+    return block + 1;
+}
+
+/*
+Gives node n an inode and every block it will need: the data blocks of a
+file, a block holding the target of a symbolic link, or the packed entry
+blocks of a directory. Returns 0 or a negative errno.
+*/
+static int import_allocate(ImportPlan *plan, int n){
+    ext2_fs *fs = plan->fs;
+    ImportNode *node = &plan->nodes[n];
+    int inode = get_free_inode(fs);
+    if(inode < 0){
+        return inode;
+    }
+    node->inode_num = inode;
+    int phony_block = 0;
+    if(node->file_type == EXT2_FT_DIR){
+        int blocks = import_pack_dir(plan, n, 0, FALSE);
+        create_inode(fs, inode, EXT2_S_IFDIR, blocks * EXT2_BLOCK_SIZE, 2 + node->subdirs, 0, (unsigned int *) &phony_block, 1);
+        return allocate_file_blocks(fs, inode, 0, blocks, NULL);
+    }
+    if(node->file_type == EXT2_FT_SYMLINK){
+        char target[EXT2_BLOCK_SIZE];
+        ssize_t length = readlink(node->host_path, target, sizeof(target) - 1);
+        if(length < 0){
+            return -errno;
+        }
+        create_inode(fs, inode, EXT2_S_IFLNK, 0, 1, 0, (unsigned int *) &phony_block, 1);
+        int block = add_block_file(fs, inode, length);
+        if(block < 0){
+            return block;
+        }
+        unsigned char *data = get_block(fs, block);
+        memset(data, 0, EXT2_BLOCK_SIZE);
+        memcpy(data, target, length);
+        mark_blocks_dirty(fs, block, 1);
+        return 0;
+    }
+    unsigned long long blocks = ((unsigned long long)node->size + EXT2_BLOCK_SIZE - 1) / EXT2_BLOCK_SIZE;
+    if(blocks > EXT2_MAX_FILE_BLOCKS){
+        return -EFBIG;
+    }
+    create_inode(fs, inode, EXT2_S_IFREG, 0, 1, 0, (unsigned int *) &phony_block, 1);
+    //Only sparse files need opening here, to find where their data is. Zero
+    //blocks are punched out by the copy workers, reading every file here would
+    //leave them nothing to do in parallel.
+    int source_fd = node->sparse ? open(node->host_path, O_RDONLY) : -1;
+    if(node->sparse && source_fd < 0){
+        return -errno;
+    }
+    SourceRuns runs;
+    int result = find_source_runs(&runs, source_fd, node->size, node->sparse, FALSE);
+    if(source_fd >= 0){
+        close(source_fd);
+    }
+    if(result == 0){
+        result = allocate_source_runs(fs, inode, &runs);
+        free(runs.runs);
+    }
+    if(result == 0){
+        set_file_size(fs, inode, node->size);
+    }
+    return result;
+}
+
+/*
+Returns the number of blocks the whole plan needs, index blocks included.
+*/
+static unsigned long long import_blocks_needed(ImportPlan *plan){
+    unsigned long long total = 0;
+    for(int n = 0; n < plan->count; n++){
+        ImportNode *node = &plan->nodes[n];
+        unsigned long long blocks = 1;
+        if(node->file_type == EXT2_FT_DIR){
+            blocks = import_pack_dir(plan, n, 0, FALSE);
+        }else if(node->file_type == EXT2_FT_REG_FILE){
+            blocks = node->data_blocks;
+        }
+        total += blocks + (blocks <= EXT2_MAX_FILE_BLOCKS ? index_blocks_needed(blocks) : 0);
+    }
+    return total;
+}
+
+/*
+Hands back the inodes and blocks of every node allocated so far.
+*/
+static void import_release(ImportPlan *plan){
+    for(int n = 0; n < plan->count; n++){
+        if(plan->nodes[n].inode_num > 0){
+            release_file_blocks(plan->fs, plan->nodes[n].inode_num);
+            release_inode(plan->fs, plan->nodes[n].inode_num);
+        }
+    }
+}
+
+static int import_compare_size(const void *a, const void *b, void *arg){
+    ImportNode *nodes = arg;
+    off_t x = nodes[*(const int *)a].size, y = nodes[*(const int *)b].size;
+    return x > y ? -1 : x < y;
+}
+
+/*
+Copy worker: takes files off the plan, biggest first, until there are none
+left. Every file already has its blocks, so workers only ever write data
+blocks of their own and need no locks.
+*/
+static void *import_copy_worker(void *arg){
+    ImportPlan *plan = arg;
+    int f;
+    while((f = __atomic_fetch_add(&plan->next_file, 1, __ATOMIC_RELAXED)) < plan->file_count){
+        ImportNode *node = &plan->nodes[plan->files[f]];
+        int use_copy_range = TRUE;
+        int source_fd = open(node->host_path, O_RDONLY);
+        if(source_fd < 0 || copy_into_file(plan->fs, source_fd, node->inode_num, node->size, &use_copy_range) < 0){
+            fprintf(stderr, "%s: error reading source file.\n", node->host_path);
+            __atomic_store_n(&plan->failed, TRUE, __ATOMIC_RELAXED);
+        }
+        if(source_fd >= 0){
+            close(source_fd);
+        }
+    }
+    return NULL;
+}
+
+/*
+Runs the copy workers over every file of the plan, threads of them (the
+calling thread being one). Returns 0, or -EIO if any file couldn't be read.
+*/
+static int import_copy(ImportPlan *plan, int threads){
+    plan->files = malloc(sizeof(int) * (plan->count > 0 ? plan->count : 1));
+    if(!plan->files){
+        return -ENOMEM;
+    }
+    for(int n = 0; n < plan->count; n++){
+        if(plan->nodes[n].file_type == EXT2_FT_REG_FILE){
+            plan->files[plan->file_count++] = n;
+        }
+    }
+    qsort_r(plan->files, plan->file_count, sizeof(int), import_compare_size, plan->nodes);
+    if(threads > plan->file_count){
+        threads = plan->file_count > 0 ? plan->file_count : 1;
+    }
+    pthread_t *workers = malloc(sizeof(pthread_t) * threads);
+    int started = 0;
+    while(workers && started < threads - 1 && pthread_create(&workers[started], NULL, import_copy_worker, plan) == 0){
+        started++;
+    }
+    import_copy_worker(plan);
+    for(int w = 0; w < started; w++){
+        pthread_join(workers[w], NULL);
+    }
+    free(workers);
+    return plan->failed ? -EIO : 0;
+}
+
+/*
+Imports the host directory tree source into the image at dest, like cp -r: if
+dest is an existing directory the tree goes inside it under the source's
+name. Runs in three steps. The host tree is walked and every inode and block
+is allocated in one serial pass, directory blocks being written once, fully
+packed. Then threads workers copy the file data into the mapping in parallel.
+Only then is the new tree linked into dest, so a failure leaves the image as
+it was. A source that isn't a directory is copied as by copy_file.
+*/
+int import_tree(ext2_fs *fs, char *source, char *dest, int threads){
+    struct stat source_stat;
+    if(lstat(source, &source_stat) < 0){
+        fprintf(stderr, "%s: error %d unable to open source file.\n", source, ENOENT);
+        return -ENOENT;
+    }
+    if(!S_ISDIR(source_stat.st_mode)){
+        return copy_file(fs, source, dest);
+    }
+    PathView *path = path_view_create(dest);
+    PathView *source_path = path_view_create(source);
+    int parent_inode_num = locate_new_entry(fs, &path, path_view_last(source_path));
+    path_view_destroy(source_path);
+    if(parent_inode_num < 0){
+        path_view_destroy(path);
+        return parent_inode_num;
+    }
+
+    struct timespec plan_start, copy_start, copy_end;
+    clock_gettime(CLOCK_MONOTONIC, &plan_start);
+    ImportPlan plan;
+    memset(&plan, 0, sizeof(plan));
+    plan.fs = fs;
+    char *root_path = strdup(source);
+    int result = root_path ? import_add_node(&plan, root_path, -1, &source_stat) : -ENOMEM;
+    if(result >= 0){
+        result = import_walk(&plan);
+    }
+    if(result == 0 && import_blocks_needed(&plan) > (unsigned long long)get_free_blocks_count(fs)){
+        result = -ENOSPC;
+    }
+    for(int n = 0; result == 0 && n < plan.count; n++){
+        result = import_allocate(&plan, n);
+    }
+    //Every inode number is known now, so the directories can be written.
+    int indexing = (get_super_block(fs)->s_feature_compat & EXT2_FEATURE_COMPAT_DIR_INDEX) != 0;
+    for(int n = 0; result == 0 && n < plan.count; n++){
+        if(plan.nodes[n].file_type == EXT2_FT_DIR){
+            int dir_parent = n == 0 ? parent_inode_num : plan.nodes[plan.nodes[n].parent].inode_num;
+            if(import_pack_dir(&plan, n, dir_parent, TRUE) > 1 && indexing){
+                //Big directories get an index, as create_dir_entry gives them once they outgrow a block.
+                htree_build(fs, plan.nodes[n].inode_num);
+            }
+        }
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &copy_start);
+    if(result == 0){
+        result = import_copy(&plan, threads > 0 ? threads : 1);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &copy_end);
+    if(result == 0){
+        result = add_dir_entry(fs, parent_inode_num, plan.nodes[0].inode_num, path_view_last(path), EXT2_FT_DIR);
+    }
+
+    if(result < 0){
+        if(result == -ENOSPC){
+            fprintf(stderr, "%s: error %d insufficient space.\n", dest, result);
+        }else if(result == -EEXIST){
+            fprintf(stderr, "%s: error %d file already exists.\n", dest, result);
+        }else if(result == -EFBIG){
+            fprintf(stderr, "%s: error %d file too large.\n", source, result);
+        }else if(result != -EIO){
+            fprintf(stderr, "%s: error %d import failed.\n", source, result);
+        }
+        import_release(&plan);
+    }else{
+        struct ext2_inode *parent_inode = get_inode(fs, parent_inode_num);
+        __atomic_add_fetch(&parent_inode->i_links_count, 1, __ATOMIC_RELAXED);
+        mark_dirty(fs, parent_inode, sizeof(struct ext2_inode));
+        unsigned long long bytes = 0;
+        int dirs = 0;
+        for(int n = 0; n < plan.count; n++){
+            if(plan.nodes[n].file_type == EXT2_FT_DIR){
+                struct ext2_group_desc *group_descriptor = get_group_descriptor(fs, inode_group(fs, plan.nodes[n].inode_num));
+                __atomic_add_fetch(&group_descriptor->bg_used_dirs_count, 1, __ATOMIC_RELAXED);
+                mark_dirty(fs, group_descriptor, sizeof(struct ext2_group_desc));
+                dirs++;
+            }else if(plan.nodes[n].file_type == EXT2_FT_REG_FILE){
+                bytes += plan.nodes[n].size;
+            }
+        }
+        if(fs->stats){
+            double plan_time = (copy_start.tv_sec - plan_start.tv_sec) + (copy_start.tv_nsec - plan_start.tv_nsec) / 1e9;
+            double copy_time = (copy_end.tv_sec - copy_start.tv_sec) + (copy_end.tv_nsec - copy_start.tv_nsec) / 1e9;
+            fprintf(stderr, "imported %d files and %d directories, %llu bytes: planned in %.3f s, copied in %.3f s (%.1f MB/s) by %d threads\n",
+                plan.file_count, dirs, bytes, plan_time, copy_time, copy_time > 0 ? bytes / copy_time / (1024 * 1024) : 0.0, threads);
+        }
+    }
+    for(int n = 0; n < plan.count; n++){
+        free(plan.nodes[n].host_path);
+    }
+    free(plan.nodes);
+    free(plan.files);
+    path_view_destroy(path);
+    return result;
+}
+
+/*
+Links dest to source. A hard link (type HARDLINK) adds another entry for the
+source's inode, which must not be a directory; a symbolic link (SOFTLINK) is a
+new inode holding the source path. If dest is a directory the link goes inside
+it under the source's name.
+*/
+int make_link(ext2_fs *fs, char *source, char *dest, int type){
+    //A symbolic link's target, with its terminator, has to fit in one block.
+    int source_len = strlen(source);
+    if(type == SOFTLINK && source_len >= EXT2_BLOCK_SIZE){
+        fprintf(stderr, "%s: error %d link target too long.\n", source, -ENAMETOOLONG);
+        return -ENAMETOOLONG;
+    }
+    PathView *source_path = path_view_create(source);
+    SearchResult source_result;
+    if(type == HARDLINK){
+        source_result = find_dir_entry(fs, source_path, TRUE);
+        if(source_result.error_code < 0 || source_result.file_type == EXT2_FT_DIR){
+            path_view_destroy(source_path);
+            if(source_result.file_type == EXT2_FT_DIR){
+                return -EISDIR;
+            }
+            return source_result.error_code;
+        }
+    }
+
+    PathView *dest_path = path_view_create(dest);
+    int parent_inode_num = locate_new_entry(fs, &dest_path, path_view_last(source_path));
+    path_view_destroy(source_path);
+    if(parent_inode_num < 0){
+        path_view_destroy(dest_path);
+        return parent_inode_num;
+    }
+
+    int inode;
+    char file_type;
+    if(type == HARDLINK){
+        inode = source_result.inode_num;
+        file_type = source_result.file_type;
+        if(add_link(fs, inode) < 0){
+            //The source went away since it was looked up.
+            path_view_destroy(dest_path);
+            return -ENOENT;
+        }
+    }else{
+        inode = get_free_inode(fs);
+        if(inode < 0){
+            fprintf(stderr, "%s: error %d insufficient space.\n", dest, inode);
+            path_view_destroy(dest_path);
+            return inode;
+        }
+        int phony_block = 0;
+        create_inode(fs, inode, EXT2_S_IFLNK, 0, 1, 0, (unsigned int *) &phony_block, 1);
+
+        int block_id = add_block_file(fs, inode, source_len);
+        if(block_id < 0){
+            fprintf(stderr, "%s: error %d insufficient space.\n", dest, block_id);
+            release_inode(fs, inode);
+            path_view_destroy(dest_path);
+            return block_id;
+        }
+        unsigned char *data_block = get_block(fs, block_id);
+        memcpy(data_block, source, source_len);
+        data_block[source_len] = '\0';
+        mark_blocks_dirty(fs, block_id, 1);
+        file_type = EXT2_FT_SYMLINK;
+    }
+
+    //The link's name is the last component of the path.
+    int add_result = add_dir_entry(fs, parent_inode_num, inode, path_view_last(dest_path), file_type);
+    path_view_destroy(dest_path);
+    if(add_result < 0){
+        if(add_result == -EEXIST){
+            fprintf(stderr, "%s: error %d file already exists.\n", dest, add_result);
+        }else{
+            fprintf(stderr, "%s: error %d insufficient space.\n", dest, add_result);
+        }
+        if(type == HARDLINK){
+            struct ext2_inode *inode_obj = get_inode(fs, inode);
+            __atomic_sub_fetch(&inode_obj->i_links_count, 1, __ATOMIC_RELAXED);
+        }else{
+            release_file_blocks(fs, inode);
+            release_inode(fs, inode);
+        }
+        return add_result;
+    }
+    return 0;
+}
+
+/*
+Removes the entry for path, and the file itself along with its last link.
+Directories are refused with EISDIR.
+*/
+int remove_file(ext2_fs *fs, char *path_string){
+    PathView *path = path_view_create(path_string);
+    SearchResult result = find_dir_entry(fs, path, TRUE);
+
+    if(result.error_code < 0 || result.file_type == EXT2_FT_DIR){
+        path_view_destroy(path);
+        if(result.file_type == EXT2_FT_DIR){
+            return -EISDIR;
+        }
+        return result.error_code;
+    }
+
+    //Get filename of file to delete, and find it again now that nobody else can move it.
+    PathComponent *name = path_view_last(path);
+    int block_num, offset;
+    dir_lock_write(fs, result.parent_inode_num);
+    if(lookup_dir_entry(fs, result.parent_inode_num, name->name, name->len, &block_num, &offset) < 0
+        || ((struct ext2_dir_entry *)(get_block(fs, block_num) + offset))->inode != result.inode_num){
+        dir_unlock(fs, result.parent_inode_num);
+        path_view_destroy(path);
+        return -ENOENT;
+    }
+    remove_dir_entry(fs, result.parent_inode_num, block_num, offset, name->name, name->len);
+    dir_unlock(fs, result.parent_inode_num);
+    path_view_destroy(path);
+
+    struct ext2_inode *file_inode = get_inode(fs, result.inode_num);
+    mark_dirty(fs, file_inode, sizeof(struct ext2_inode));
+    //Whoever drops the last link frees the file.
+    if(__atomic_sub_fetch(&file_inode->i_links_count, 1, __ATOMIC_ACQ_REL) == 0){
+        //Zero out the old blocks of this file in the block bitmap, while the
+        //inode is still ours: once released another thread may reuse it.
+        release_file_blocks(fs, result.inode_num);
+        release_inode(fs, result.inode_num);
+    }
+    return 0;
+}
+
+/*
+Marks every block of the restored file inode_num as in use again, as long as
+none of them has been taken by someone else since. Index blocks come before
+the blocks they map, so a reused one is caught before its pointers matter.
+Returns 0, or -ENOENT with nothing claimed.
+*/
+static int claim_blocks(ext2_fs *fs, int inode_num){
+    BlockMapIter iter;
+    BlockExtent extent;
+    FreeCounts counts;
+    int claimed = 0;
+    init_free_counts(fs, &counts);
+    block_map_iter_init(&iter, fs, inode_num, BLOCK_MAP_INDEX);
+    while(block_map_next(&iter, &extent)){
+        if(claim_bitmap_range(fs, extent.physical, extent.length, BLOCK, &counts) < 0){
+            //Give back the extents claimed before this one.
+            block_map_iter_init(&iter, fs, inode_num, BLOCK_MAP_INDEX);
+            while(claimed > 0 && block_map_next(&iter, &extent)){
+                update_bitmap_range(fs, extent.physical, extent.length, 0, BLOCK, &counts);
+                claimed--;
+            }
+            apply_free_counts(&counts);
+            return -ENOENT;
+        }
+        claimed++;
+    }
+    apply_free_counts(&counts);
+    return 0;
+}
+
+/*
+Brings back the removed file path, as long as neither its inode nor any of its
+blocks has been reused since.
+*/
+int restore_file(ext2_fs *fs, char *path_string){
+    PathView *path = path_view_create(path_string);
+    //Check if it has even been deleted:
+    SearchResult result = find_dir_entry(fs, path, TRUE);
+    if(result.error_code >= 0){
+        path_view_destroy(path);
+        fprintf(stderr, "%s: file has not been deleted.\n", path_string);
+        return -EEXIST;
+    }
+
+    result = find_deleted_dir_entry(fs, path);
+    if(result.error_code < 0 || result.file_type == EXT2_FT_DIR){
+        path_view_destroy(path);
+        if(result.file_type == EXT2_FT_DIR){
+            fprintf(stderr, "%s: not regular file.\n", path_string);
+            return -EISDIR;
+        }
+        fprintf(stderr, "%s: file not found.\n", path_string);
+        return result.error_code;
+    }
+
+    //Look again under the write lock, the directory may have changed in between.
+    PathComponent *name = path_view_last(path);
+    int parent_inode_num = result.parent_inode_num;
+    int block_num, offset, inode_num = 0;
+    dir_lock_write(fs, parent_inode_num);
+    if(scan_dir_blocks(fs, parent_inode_num, name->name, name->len, dir_block_find_deleted, &block_num, &offset) == 0){
+        inode_num = ((struct ext2_dir_entry *)(get_block(fs, block_num) + offset))->inode;
+    }
+    //Then the inode has been reused, or any of its blocks has. Can't recover.
+    if(inode_num == 0 || get_inode(fs, inode_num)->i_dtime == 0
+        || claim_bitmap_range(fs, inode_num, 1, INODE, NULL) < 0){
+        dir_unlock(fs, parent_inode_num);
+        path_view_destroy(path);
+        fprintf(stderr, "%s: unable to recover file.\n", path_string);
+        return -ENOENT;
+    }
+    if(claim_blocks(fs, inode_num) < 0){
+        release_inode(fs, inode_num);
+        dir_unlock(fs, parent_inode_num);
+        path_view_destroy(path);
+        fprintf(stderr, "%s: unable to recover file.\n", path_string);
+        return -ENOENT;
+    }
+
+    //At this point all the previous structures are intact and ours. Begin to recover file:
+    int previous_dir_entry_offset = find_prev_deleted_dir_entry(fs, name->name, name->len, block_num);
+    struct ext2_dir_entry *previous_dir_entry = (struct ext2_dir_entry *)(get_block(fs, block_num) + previous_dir_entry_offset);
+
+    //Restore record lengths:
+    int min_len = 8 + previous_dir_entry->name_len;
+    previous_dir_entry->rec_len = min_len + (offset - previous_dir_entry_offset - min_len);
+    mark_blocks_dirty(fs, block_num, 1);
+    dcache_invalidate(&fs->dcache, parent_inode_num, name->name, name->len);
+    dir_unlock(fs, parent_inode_num);
+
+    //Restore inode:
+    struct ext2_inode *file_inode = get_inode(fs, inode_num);
+    file_inode->i_dtime = 0;
+    __atomic_add_fetch(&file_inode->i_links_count, 1, __ATOMIC_RELAXED);
+    mark_dirty(fs, file_inode, sizeof(struct ext2_inode));
+
+    path_view_destroy(path);
+    return 0;
+}
+
+/*
+Returns the inode number path leads to, following a symbolic link at the end,
+or a negative errno.
+*/
+int lookup_inode(ext2_fs *fs, char *path_string){
+    PathView *path = path_view_create(path_string);
+    if(!path){
+        return -ENOMEM;
+    }
+    SearchResult result = find_dir_entry(fs, path, FALSE);
+    int count = path->count;
+    path_view_destroy(path);
+    if(count == 0){
+        return EXT2_ROOT_INO;
+    }
+    if(result.error_code < 0){
+        return result.error_code;
+    }
+    return result.inode_num;
+}
+
+/*
+Reads up to length bytes of regular file inode_num starting at offset into
+buffer. Holes read as zeros. Returns the number of bytes read, 0 at or past
+the end of the file, or a negative errno.
+*/
+ssize_t read_file(ext2_fs *fs, int inode_num, unsigned long long offset, unsigned char *buffer, size_t length){
+    struct ext2_inode *inode = get_inode(fs, inode_num);
+    if((inode->i_mode & 0xf000) == EXT2_S_IFDIR){
+        return -EISDIR;
+    }
+    if((inode->i_mode & 0xf000) != EXT2_S_IFREG){
+        return -EINVAL;
+    }
+    unsigned long long size = get_file_size(fs, inode_num);
+    if(offset >= size){
+        return 0;
+    }
+    if(length > size - offset){
+        length = size - offset;
+    }
+    size_t done = 0;
+    while(done < length){
+        unsigned long long position = offset + done;
+        unsigned int within = position % EXT2_BLOCK_SIZE;
+        size_t chunk = EXT2_BLOCK_SIZE - within;
+        if(chunk > length - done){
+            chunk = length - done;
+        }
+        unsigned int block = get_file_block(fs, inode_num, position / EXT2_BLOCK_SIZE);
+        if(block == 0 || block >= fs->geometry.blocks_count){
+            memset(buffer + done, 0, chunk);
+        }else{
+            memcpy(buffer + done, get_block(fs, block) + within, chunk);
+        }
+        done += chunk;
+    }
+    return done;
+}
+
+static const unsigned char export_zeros[EXPORT_ZERO_BYTES];
+
+typedef struct export_stats {
+    unsigned long long bytes;
+    long files;
+    long calls;
+} ExportStats;
+
+/*
+Writes the count iovecs at iov to fd, in as many writev calls as short writes
+make it take. Returns 0 or a negative errno.
+*/
+static int write_iovecs(int fd, struct iovec *iov, int count, ExportStats *stats){
+    while(count > 0){
+        ssize_t written = writev(fd, iov, count);
+        if(written < 0){
+            if(errno == EINTR){
+                continue;
+            }
+            return -errno;
+        }
+        stats->calls++;
+        stats->bytes += written;
+        while(count > 0 && (size_t)written >= iov->iov_len){
+            written -= iov->iov_len;
+            iov++;
+            count--;
+        }
+        if(count > 0){
+            iov->iov_base = (unsigned char*)iov->iov_base + written;
+            iov->iov_len -= written;
+        }
+    }
+    return 0;
+}
+
+/*
+Writes regular file inode_num to dest_fd with nothing copied on the way: each
+extent of its block map becomes an iovec pointing straight into the mapped
+image, and they go out EXPORT_IOVECS at a time through writev. Holes are
+skipped with lseek when dest_fd is a regular file, so the copy stays sparse,
+and are written from export_zeros when it isn't. Returns 0 or a negative errno.
+*/
+static int export_data(ext2_fs *fs, int inode_num, int dest_fd, ExportStats *stats){
+    struct stat dest_stat;
+    int seek_holes = fstat(dest_fd, &dest_stat) == 0 && S_ISREG(dest_stat.st_mode) && !(fcntl(dest_fd, F_GETFL) & O_APPEND);
+    unsigned long long size = get_file_size(fs, inode_num);
+    unsigned long long position = 0;
+    struct iovec iov[EXPORT_IOVECS];
+    int count = 0, result = 0, mapped = TRUE;
+    BlockMapIter iter;
+    BlockExtent extent;
+    block_map_iter_init(&iter, fs, inode_num, BLOCK_MAP_PREFETCH);
+    while(result == 0 && position < size){
+        mapped = mapped && block_map_next(&iter, &extent);
+        unsigned long long start = mapped ? (unsigned long long)extent.logical * EXT2_BLOCK_SIZE : size;
+        if(start > size){
+            start = size;
+        }
+        //The hole up to the next extent, or to the end of the file.
+        if(start > position && seek_holes){
+            result = write_iovecs(dest_fd, iov, count, stats);
+            count = 0;
+            if(result == 0 && lseek(dest_fd, start - position, SEEK_CUR) < 0){
+                result = -errno;
+            }
+            position = start;
+        }
+        while(result == 0 && position < start){
+            if(count == EXPORT_IOVECS){
+                result = write_iovecs(dest_fd, iov, count, stats);
+                count = 0;
+            }
+            size_t length = start - position < EXPORT_ZERO_BYTES ? start - position : EXPORT_ZERO_BYTES;
+            iov[count++] = (struct iovec){(void*)export_zeros, length};
+            position += length;
+        }
+        if(result < 0 || position >= size){
+            break;
+        }
+        if(count == EXPORT_IOVECS){
+            result = write_iovecs(dest_fd, iov, count, stats);
+            count = 0;
+        }
+        size_t length = (size_t)extent.length * EXT2_BLOCK_SIZE;
+        if(length > size - position){
+            length = size - position;
+        }
+        iov[count++] = (struct iovec){get_block(fs, extent.physical), length};
+        position += length;
+    }
+    if(result == 0){
+        result = write_iovecs(dest_fd, iov, count, stats);
+    }
+    //A hole at the end was only seeked over, the file has to be stretched to it.
+    off_t end = seek_holes && result == 0 ? lseek(dest_fd, 0, SEEK_CUR) : 0;
+    if(end > 0 && fstat(dest_fd, &dest_stat) == 0 && dest_stat.st_size < end && ftruncate(dest_fd, end) < 0){
+        result = -errno;
+    }
+    stats->files++;
+    return result;
+}
+
+/*
+Copies the target of symbolic link inode_num into target, NUL terminated.
+Links made by other tools keep short targets in i_block itself, the rest are
+in the link's first block.
+*/
+static void read_link_target(ext2_fs *fs, int inode_num, char *target){
+    struct ext2_inode *inode = get_inode(fs, inode_num);
+    size_t length = inode->i_size < EXT2_BLOCK_SIZE ? inode->i_size : EXT2_BLOCK_SIZE - 1;
+    if(inode->i_blocks == 0){
+        if(length > sizeof(inode->i_block)){
+            length = sizeof(inode->i_block);
+        }
+        memcpy(target, inode->i_block, length);
+    }else{
+        memcpy(target, get_block(fs, inode->i_block[0]), length);
+    }
+    target[length] = '\0';
+}
+
+/*
+Opens the local file a file of the image named source_path goes to: dest, or
+dest/<its name> if dest is a directory. Returns the descriptor or a negative
+errno.
+*/
+static int open_export_dest(char *source_path, char *dest, int mode){
+    struct stat dest_stat;
+    char *path = dest;
+    if(stat(dest, &dest_stat) == 0 && S_ISDIR(dest_stat.st_mode)){
+        char *name = strrchr(source_path, '/') ? strrchr(source_path, '/') + 1 : source_path;
+        if(asprintf(&path, "%s/%s", dest, name) < 0){
+            return -ENOMEM;
+        }
+    }
+    int dest_fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, mode);
+    if(path != dest){
+        free(path);
+    }
+    return dest_fd < 0 ? -errno : dest_fd;
+}
+
+static void report_export(ext2_fs *fs, ExportStats *stats, struct timespec *start){
+    struct timespec end;
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    if(fs->stats){
+        double elapsed = (end.tv_sec - start->tv_sec) + (end.tv_nsec - start->tv_nsec) / 1e9;
+        fprintf(stderr, "exported %ld files, %llu bytes written in %.3f s (%.1f MB/s), %ld writev calls\n", stats->files, stats->bytes,
+            elapsed, elapsed > 0 ? stats->bytes / elapsed / (1024 * 1024) : 0.0, stats->calls);
+    }
+}
+
+/*
+Copies regular file source out of the image to the local file dest, or to
+stdout if dest is "-". If dest is a directory the copy goes inside it under
+the source's name. Returns 0 or a negative errno.
+*/
+int export_file(ext2_fs *fs, char *source, char *dest){
+    int inode_num = lookup_inode(fs, source);
+    if(inode_num < 0){
+        fprintf(stderr, "%s: error %d no such file.\n", source, inode_num);
+        return inode_num;
+    }
+    struct ext2_inode *inode = get_inode(fs, inode_num);
+    if((inode->i_mode & 0xf000) != EXT2_S_IFREG){
+        int error = (inode->i_mode & 0xf000) == EXT2_S_IFDIR ? -EISDIR : -EINVAL;
+        fprintf(stderr, "%s: error %d not a regular file.\n", source, error);
+        return error;
+    }
+    int dest_fd = strcmp(dest, "-") == 0 ? STDOUT_FILENO : open_export_dest(source, dest, inode->i_mode & 0777);
+    if(dest_fd < 0){
+        fprintf(stderr, "%s: error %d unable to open dest file.\n", dest, dest_fd);
+        return dest_fd;
+    }
+    struct timespec export_start;
+    clock_gettime(CLOCK_MONOTONIC, &export_start);
+    ExportStats stats = {0};
+    int result = export_data(fs, inode_num, dest_fd, &stats);
+    if(dest_fd != STDOUT_FILENO){
+        close(dest_fd);
+    }
+    if(result < 0){
+        fprintf(stderr, "%s: error %d writing dest file.\n", dest, result);
+        return result;
+    }
+    report_export(fs, &stats, &export_start);
+    return 0;
+}
+
+/*
+What an export_tree walk carries along: the local directory the tree goes
+to, the stats, and the first error hit.
+*/
+typedef struct export_walk {
+    char *root_path;
+    ExportStats *stats;
+    int result;
+} ExportWalk;
+
+/*
+Visitor exporting one entry of the tree to the local path under its parent's,
+which is the parent's cookie: regular files, symbolic links and directories,
+the path of a directory becoming its cookie. Anything else is skipped with a
+message. Errors are remembered and the walk carries on, but for -ENOMEM.
+*/
+static int export_entry(ext2_fs *fs, WalkEntry *entry, void *arg){
+    ExportWalk *export = arg;
+    char *child_path;
+    if(asprintf(&child_path, "%s/%.*s", (char*)entry->parent_cookie, entry->name_len, entry->name) < 0){
+        return -ENOMEM;
+    }
+    int child_result = 0;
+    struct ext2_inode *child = get_inode(fs, entry->inode);
+    if(entry->file_type == EXT2_FT_DIR){
+        if(mkdir(child_path, 0700) == 0 || errno == EEXIST){
+            entry->cookie = child_path;
+            return WALK_CONTINUE;
+        }
+        child_result = -errno;
+        fprintf(stderr, "%s: error %d unable to create directory.\n", child_path, child_result);
+    }else if(entry->file_type == EXT2_FT_REG_FILE){
+        int dest_fd = open(child_path, O_WRONLY | O_CREAT | O_TRUNC, child->i_mode & 0777);
+        child_result = dest_fd < 0 ? -errno : export_data(fs, entry->inode, dest_fd, export->stats);
+        if(dest_fd >= 0){
+            close(dest_fd);
+        }
+    }else if(entry->file_type == EXT2_FT_SYMLINK){
+        char target[EXT2_BLOCK_SIZE];
+        read_link_target(fs, entry->inode, target);
+        child_result = symlink(target, child_path) < 0 ? -errno : 0;
+    }else{
+        fprintf(stderr, "%s: skipped, not a regular file, directory or symbolic link.\n", child_path);
+    }
+    if(child_result < 0 && entry->file_type != EXT2_FT_DIR){
+        fprintf(stderr, "%s: error %d unable to export.\n", child_path, child_result);
+    }
+    if(child_result < 0 && export->result == 0){
+        export->result = child_result;
+    }
+    free(child_path);
+    return WALK_SKIP;
+}
+
+/*
+Called once a directory's whole subtree is exported. Only now does it get
+its mode: one without write permission couldn't have been filled.
+*/
+static void export_leave(ext2_fs *fs, unsigned int inode_num, void *cookie, void *arg){
+    ExportWalk *export = arg;
+    chmod(cookie, get_inode(fs, inode_num)->i_mode & 0777);
+    if(cookie != export->root_path){
+        free(cookie);
+    }
+}
+
+/*
+Recreates directory inode_num of the image as the local directory host_path,
+then everything under it, walking the tree depth first. A directory already
+at host_path is exported into. Returns 0 or the first negative errno hit,
+carrying on with the rest of the tree after one.
+*/
+static int export_dir(ext2_fs *fs, int inode_num, char *host_path, ExportStats *stats){
+    struct stat host_stat;
+    if(mkdir(host_path, 0700) < 0){
+        //fprintf may itself set errno.
+        int error = -errno;
+        if(error == -EEXIST && (stat(host_path, &host_stat) < 0 || !S_ISDIR(host_stat.st_mode))){
+            error = -ENOTDIR;
+        }
+        if(error != -EEXIST){
+            fprintf(stderr, "%s: error %d unable to create directory.\n", host_path, error);
+            return error;
+        }
+    }
+    ExportWalk export = {host_path, stats, 0};
+    TreeWalk walk = {.order = WALK_DFS, .flags = WALK_ONCE, .visit = export_entry, .leave = export_leave, .arg = &export};
+    int result = tree_walk(fs, inode_num, &walk, host_path);
+    return result < 0 ? result : export.result;
+}
+
+/*
+Copies directory source of the image, and everything under it, out to the
+local directory dest. If dest already is a directory the tree goes inside it
+under the source's name (the image's root is merged into it instead). A
+source that isn't a directory is exported as by export_file. Returns 0 or a
+negative errno.
+*/
+int export_tree(ext2_fs *fs, char *source, char *dest){
+    int inode_num = lookup_inode(fs, source);
+    if(inode_num < 0){
+        fprintf(stderr, "%s: error %d no such file or directory.\n", source, inode_num);
+        return inode_num;
+    }
+    if((get_inode(fs, inode_num)->i_mode & 0xf000) != EXT2_S_IFDIR){
+        return export_file(fs, source, dest);
+    }
+    char *host_path = dest;
+    struct stat dest_stat;
+    PathView *source_path = path_view_create(source);
+    PathComponent *name = source_path ? path_view_last(source_path) : NULL;
+    if(name && stat(dest, &dest_stat) == 0 && S_ISDIR(dest_stat.st_mode)){
+        //export_dir creates it, or merges into it if an earlier export left it there.
+        if(asprintf(&host_path, "%s/%.*s", dest, name->len, name->name) < 0){
+            path_view_destroy(source_path);
+            return -ENOMEM;
+        }
+    }
+    path_view_destroy(source_path);
+    struct timespec export_start;
+    clock_gettime(CLOCK_MONOTONIC, &export_start);
+    ExportStats stats = {0};
+    int result = export_dir(fs, inode_num, host_path, &stats);
+    report_export(fs, &stats, &export_start);
+    if(host_path != dest){
+        free(host_path);
+    }
+    return result;
+}
@@ -0,0 +1,37 @@
+#ifndef OPS_FUNCTIONS
+#define OPS_FUNCTIONS
+
+#include "helper.h"
+
+/*
+The operations behind the command line tools, run against an image opened
+with load_image. Each returns 0 or a negative errno and leaves flushing to the
+caller, so any number of them can share one load_image and one save_image
+(ext2_batch), with the allocator cursors and directory caches staying warm
+in between. Failures are also described on stderr, as the tools always did.
+
+This header is the entry point of libext2ops (libext2ops.a and .so). A
+service can keep any number of images open at once, each behind its own
+ext2_fs handle, and close them with close_image.
+
+A handle opened with IMAGE_HINT_THREADS can be used by several threads at
+once. Blocks and inodes are claimed in the bitmaps atomically, free counters
+are updated atomically per group and through per thread shards for the
+superblock, and each directory is guarded by a reader/writer lock, so
+operations in different directories run in parallel and ones in the same
+directory take turns adding and removing entries. save_image and close_image
+must wait until no operation is running.
+*/
+
+int make_directory(ext2_fs*, char*, int);
+int copy_file(ext2_fs*, char*, char*);
+int import_tree(ext2_fs*, char*, char*, int);
+int make_link(ext2_fs*, char*, char*, int);
+int remove_file(ext2_fs*, char*);
+int restore_file(ext2_fs*, char*);
+int lookup_inode(ext2_fs*, char*);
+ssize_t read_file(ext2_fs*, int, unsigned long long, unsigned char*, size_t);
+int export_file(ext2_fs*, char*, char*);
+int export_tree(ext2_fs*, char*, char*);
+
+#endif
@@ -0,0 +1,103 @@
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include "pathview.h"
+
+/*
+Upper bound on the number of components in the first length bytes of path:
+one more than its number of slashes.
+*/
+int path_view_capacity(const char *path, int length){
+    int capacity = 1;
+    const char *slash = path;
+    const char *end = path + length;
+    while((slash = memchr(slash, '/', end - slash)) != NULL){
+        capacity++;
+        slash++;
+    }
+    return capacity;
+}
+
+/*
+Splits the first length bytes of path into view, which must have room for
+path_view_capacity(path, length) components. Returns the component count, or
+-ENAMETOOLONG if the view is too small.
+*/
+int path_view_parse(PathView *view, char *path, int length){
+    int start = 0;
+    view->count = 0;
+    while(start < length){
+        char *slash = memchr(path + start, '/', length - start);
+        int end = slash ? slash - path : length;
+        int len = end - start;
+        if(len == 0 || (len == 1 && path[start] == '.')){
+            //Repeated slash or "." leaves the position unchanged.
+        }else if(len == 2 && path[start] == '.' && path[start + 1] == '.'){
+            if(view->count > 0){
+                view->count--;
+            }
+        }else{
+            if(view->count >= view->capacity){
+                return -ENAMETOOLONG;
+            }
+            view->components[view->count].name = path + start;
+            view->components[view->count].len = len;
+            view->count++;
+        }
+        start = end + 1;
+    }
+    return view->count;
+}
+
+/*
+Parses the first length bytes of path into a newly allocated view. Returns NULL
+if memory runs out.
+*/
+PathView *path_view_create_len(char *path, int length){
+    int capacity = path_view_capacity(path, length);
+    PathView *view = malloc(PATH_VIEW_BYTES(capacity));
+    if(!view){
+        return NULL;
+    }
+    view->capacity = capacity;
+    path_view_parse(view, path, length);
+    return view;
+}
+
+/*
+Parses the NUL terminated path into a newly allocated view.
+*/
+PathView *path_view_create(char *path){
+    return path_view_create_len(path, strlen(path));
+}
+
+/*
+Returns a new view for name inside directory dir. name keeps pointing at the
+string it came from, which may differ from dir's.
+*/
+PathView *path_view_join(const PathView *dir, const PathComponent *name){
+    PathView *view = malloc(PATH_VIEW_BYTES(dir->count + 1));
+    if(!view){
+        return NULL;
+    }
+    view->capacity = dir->count + 1;
+    view->count = dir->count + 1;
+    memcpy(view->components, dir->components, dir->count * sizeof(PathComponent));
+    view->components[dir->count] = *name;
+    return view;
+}
+
+/*
+Returns the final component of view, or NULL if view is the root.
+*/
+PathComponent *path_view_last(PathView *view){
+    if(view->count == 0){
+        return NULL;
+    }
+    return &view->components[view->count - 1];
+}
+
+void path_view_destroy(PathView *view){
+    free(view);
+}
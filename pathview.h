@@ -0,0 +1,39 @@
+#ifndef PATHVIEW_FUNCTIONS
+#define PATHVIEW_FUNCTIONS
+
+/*
+Zero-copy parsed paths. A PathView is one allocation holding the component
+array, and every component points straight into the string it was parsed from
+(argv, a symbolic link's block in the image) instead of owning a copy, so that
+string has to outlive the view. Names are not NUL terminated, use len.
+
+Parsing normalises the path: empty components from repeated or trailing
+slashes and "." are dropped, and ".." drops the component before it, stopping
+at the root. The root itself parses to a view with no components. The last
+component is components[count - 1], and the parent directory is the first
+count - 1 components.
+*/
+
+typedef struct path_component {
+    char *name;
+    int len;
+} PathComponent;
+
+typedef struct path_view {
+    int count;
+    int capacity;
+    PathComponent components[];
+} PathView;
+
+//Bytes needed for a view that can hold capacity components.
+#define PATH_VIEW_BYTES(capacity) (sizeof(PathView) + (capacity) * sizeof(PathComponent))
+
+int path_view_capacity(const char*, int);
+int path_view_parse(PathView*, char*, int);
+PathView *path_view_create(char*);
+PathView *path_view_create_len(char*, int);
+PathView *path_view_join(const PathView*, const PathComponent*);
+PathComponent *path_view_last(PathView*);
+void path_view_destroy(PathView*);
+
+#endif
@@ -0,0 +1,291 @@
+#include "walk.h"
+
+/*
+A directory waiting to be read, and what its entries inherit from the path
+that led to it.
+*/
+typedef struct walk_dir {
+    unsigned int inode;
+    int depth;
+    int hops;
+    void *cookie;
+    //First block of the directory, what WALK_BLOCK_ORDER sorts by.
+    unsigned int key;
+} WalkDir;
+
+/*
+A directory being read: the place in its block map and in its current block
+to carry on from.
+*/
+typedef struct walk_frame {
+    WalkDir dir;
+    BlockMapIter iter;
+    BlockExtent extent;
+    unsigned int block;
+    unsigned char *data;
+    int offset;
+} WalkFrame;
+
+static void walk_frame_init(ext2_fs *fs, WalkFrame *frame, WalkDir *dir){
+    frame->dir = *dir;
+    block_map_iter_init(&frame->iter, fs, dir->inode, BLOCK_MAP_PREFETCH);
+    frame->extent.physical = frame->extent.length = 0;
+    frame->block = 0;
+    frame->data = NULL;
+    frame->offset = 0;
+}
+
+/*
+Moves frame on to the next live entry of its directory, "." and ".." only
+with WALK_DOTS in flags, skipping the rest of a block once its entries stop
+making sense. Returns 1 with *block and *offset set, or 0 at the end of the
+directory.
+*/
+static int walk_next_entry(ext2_fs *fs, WalkFrame *frame, int flags, unsigned int *block, int *offset){
+    for(;;){
+        while(frame->data && frame->offset < EXT2_BLOCK_SIZE){
+            int at = frame->offset;
+            int next = dir_block_next(frame->data, at);
+            if(next < 0){
+                break;
+            }
+            frame->offset = next;
+            struct ext2_dir_entry *entry = (struct ext2_dir_entry *)(frame->data + at);
+            if(entry->inode == 0 || entry->name_len == 0 || entry->inode > fs->geometry.inodes_count
+               || (!(flags & WALK_DOTS) && dir_entry_is_dot(entry))){
+                continue;
+            }
+            *block = frame->block;
+            *offset = at;
+            return TRUE;
+        }
+        if(frame->data){
+            frame->block++;
+        }
+        if(frame->block >= frame->extent.physical + frame->extent.length){
+            if(!block_map_next(&frame->iter, &frame->extent)){
+                return FALSE;
+            }
+            frame->block = frame->extent.physical;
+        }
+        frame->data = get_block(fs, frame->block);
+        frame->offset = 0;
+    }
+}
+
+/*
+Returns the directory symbolic link inode_num leads to, following any further
+links up to SYMLINK_MAX_HOPS, or a negative errno: -ENOTDIR if it leads to
+something else.
+*/
+int resolve_link_dir(ext2_fs *fs, unsigned int inode_num){
+    int length;
+    char *target = get_link_target(fs, inode_num, &length);
+    PathView *view = path_view_create_len(target, length);
+    if(!view){
+        return -ENOMEM;
+    }
+    SearchResult result = find_dir_entry(fs, view, FALSE);
+    path_view_destroy(view);
+    if(result.extra_info == JUST_ROOT){
+        return EXT2_ROOT_INO;
+    }
+    if(result.error_code < 0){
+        return result.error_code;
+    }
+    return result.file_type == EXT2_FT_DIR ? result.inode_num : -ENOTDIR;
+}
+
+/*
+Hands the entry at offset in block of directory dir to the visitor and works
+out whether the walk goes into it. Returns WALK_CONTINUE with *child filled
+in if it does, WALK_SKIP if not, or WALK_STOP or a negative errno to end the
+walk.
+*/
+static int walk_visit(ext2_fs *fs, TreeWalk *walk, WalkDir *dir, unsigned int block, int offset, unsigned char *entered, WalkDir *child){
+    struct ext2_dir_entry *dir_entry = (struct ext2_dir_entry *)(get_block(fs, block) + offset);
+    WalkEntry entry = {dir_entry->inode, dir->inode, block, offset, dir_entry->name, dir_entry->name_len, dir_entry->file_type,
+                       dir->depth + 1, dir->cookie, NULL};
+    int result = walk->visit ? walk->visit(fs, &entry, walk->arg) : WALK_CONTINUE;
+    if(result != WALK_CONTINUE || dir_entry_is_dot(dir_entry)){
+        return result == WALK_CONTINUE ? WALK_SKIP : result;
+    }
+    int target = entry.inode, hops = dir->hops;
+    if(entry.file_type == EXT2_FT_SYMLINK && (walk->flags & WALK_FOLLOW_LINKS)){
+        int max_hops = walk->max_hops > 0 ? walk->max_hops : SYMLINK_MAX_HOPS;
+        target = hops < max_hops ? resolve_link_dir(fs, entry.inode) : -ELOOP;
+        hops++;
+    }else if(entry.file_type != EXT2_FT_DIR){
+        target = -ENOTDIR;
+    }
+    if(target > 0 && entered){
+        unsigned char mask = 1 << (target % 8);
+        if(entered[target / 8] & mask){
+            target = -ELOOP;
+        }else{
+            entered[target / 8] |= mask;
+        }
+    }
+    if(target <= 0){
+        if(entry.cookie && walk->leave){
+            walk->leave(fs, entry.inode, entry.cookie, walk->arg);
+        }
+        return WALK_SKIP;
+    }
+    *child = (WalkDir){target, entry.depth, hops, entry.cookie, get_inode(fs, target)->i_block[0]};
+    return WALK_CONTINUE;
+}
+
+/*
+Depth first: a frame per directory on the current path, the deepest read
+until it runs out before its parent carries on.
+*/
+static int walk_depth(ext2_fs *fs, TreeWalk *walk, WalkDir *root, unsigned char *entered){
+    int depth = 0, capacity = 16, result = 0;
+    WalkFrame *stack = malloc(sizeof(WalkFrame) * capacity);
+    if(!stack){
+        return -ENOMEM;
+    }
+    walk_frame_init(fs, &stack[depth++], root);
+    walk->dirs = walk->max_pending = 1;
+    while(depth > 0){
+        WalkFrame *frame = &stack[depth - 1];
+        unsigned int block;
+        int offset;
+        if(!walk_next_entry(fs, frame, walk->flags, &block, &offset)){
+            if(walk->leave){
+                walk->leave(fs, frame->dir.inode, frame->dir.cookie, walk->arg);
+            }
+            depth--;
+            continue;
+        }
+        WalkDir child;
+        result = walk_visit(fs, walk, &frame->dir, block, offset, entered, &child);
+        if(result < 0 || result == WALK_STOP){
+            break;
+        }
+        if(result == WALK_SKIP){
+            continue;
+        }
+        if(depth == capacity){
+            WalkFrame *grown = realloc(stack, sizeof(WalkFrame) * capacity * 2);
+            if(!grown){
+                result = -ENOMEM;
+                if(walk->leave){
+                    walk->leave(fs, child.inode, child.cookie, walk->arg);
+                }
+                break;
+            }
+            stack = grown;
+            capacity *= 2;
+        }
+        walk_frame_init(fs, &stack[depth++], &child);
+        walk->dirs++;
+        if(depth > walk->max_pending){
+            walk->max_pending = depth;
+        }
+    }
+    //Cut short: the directories still open are left innermost first.
+    while(depth > 0 && walk->leave){
+        depth--;
+        walk->leave(fs, stack[depth].dir.inode, stack[depth].dir.cookie, walk->arg);
+    }
+    free(stack);
+    return result < 0 ? result : 0;
+}
+
+static int compare_walk_dirs(const void *a, const void *b){
+    const WalkDir *x = a, *y = b;
+    return x->key < y->key ? -1 : x->key > y->key;
+}
+
+/*
+Breadth first: a queue of the directories found but not read yet, each level
+sorted by first block with WALK_BLOCK_ORDER before it is read.
+*/
+static int walk_breadth(ext2_fs *fs, TreeWalk *walk, WalkDir *root, unsigned char *entered){
+    int head = 0, tail = 0, level_end = 0, capacity = 64, result = 0;
+    WalkDir *queue = malloc(sizeof(WalkDir) * capacity);
+    if(!queue){
+        return -ENOMEM;
+    }
+    queue[tail++] = *root;
+    walk->dirs = walk->max_pending = 0;
+    while(head < tail && result == 0){
+        if(head == level_end){
+            if(walk->flags & WALK_BLOCK_ORDER){
+                qsort(queue + head, tail - head, sizeof(WalkDir), compare_walk_dirs);
+            }
+            level_end = tail;
+        }
+        WalkFrame frame;
+        walk_frame_init(fs, &frame, &queue[head++]);
+        walk->dirs++;
+        unsigned int block;
+        int offset;
+        while(walk_next_entry(fs, &frame, walk->flags, &block, &offset)){
+            WalkDir child;
+            result = walk_visit(fs, walk, &frame.dir, block, offset, entered, &child);
+            if(result < 0 || result == WALK_STOP){
+                break;
+            }
+            if(result == WALK_SKIP){
+                result = 0;
+                continue;
+            }
+            if(tail == capacity){
+                //Reuse the space of directories already read before growing.
+                if(head > capacity / 2){
+                    memmove(queue, queue + head, sizeof(WalkDir) * (tail - head));
+                    tail -= head;
+                    level_end -= head;
+                    head = 0;
+                }else{
+                    WalkDir *grown = realloc(queue, sizeof(WalkDir) * capacity * 2);
+                    if(!grown){
+                        result = -ENOMEM;
+                        if(walk->leave){
+                            walk->leave(fs, child.inode, child.cookie, walk->arg);
+                        }
+                        break;
+                    }
+                    queue = grown;
+                    capacity *= 2;
+                }
+            }
+            queue[tail++] = child;
+            if(tail - head > walk->max_pending){
+                walk->max_pending = tail - head;
+            }
+        }
+        if(walk->leave){
+            walk->leave(fs, frame.dir.inode, frame.dir.cookie, walk->arg);
+        }
+    }
+    //Cut short: directories never read still hand their cookies back.
+    for(; head < tail && walk->leave; head++){
+        walk->leave(fs, queue[head].inode, queue[head].cookie, walk->arg);
+    }
+    free(queue);
+    return result < 0 ? result : 0;
+}
+
+/*
+Walks the tree under directory root_inode as set up in walk, root_cookie
+being the root's cookie. Returns 0 once every directory has been read or the
+visitor said WALK_STOP, or the negative errno that ended the walk.
+*/
+int tree_walk(ext2_fs *fs, unsigned int root_inode, TreeWalk *walk, void *root_cookie){
+    unsigned char *entered = NULL;
+    if(walk->flags & WALK_ONCE){
+        entered = calloc(fs->geometry.inodes_count / 8 + 1, 1);
+        if(!entered){
+            return -ENOMEM;
+        }
+        entered[root_inode / 8] |= 1 << (root_inode % 8);
+    }
+    WalkDir root = {root_inode, 0, 0, root_cookie, get_inode(fs, root_inode)->i_block[0]};
+    int result = walk->order == WALK_BFS ? walk_breadth(fs, walk, &root, entered) : walk_depth(fs, walk, &root, entered);
+    free(entered);
+    return result;
+}
@@ -0,0 +1,73 @@
+#ifndef WALK_FUNCTIONS
+#define WALK_FUNCTIONS
+
+#include "helper.h"
+
+/*
+Iterative walk over a directory tree of the image. Nothing recurses: the
+directories still to be read sit on a heap allocated stack (depth first) or
+queue (breadth first), so a deep tree or a loop costs memory, never C stack.
+Depth first keeps a frame per directory on the current path, each resuming
+its directory where it left off; breadth first keeps the directories of the
+next level, and with WALK_BLOCK_ORDER sorts each level by the directory's
+first block so the image is read front to back.
+
+visit is called for every live entry but "." and ".." (those too, though
+never gone into, with WALK_DOTS), parents before their children. After it
+returns WALK_CONTINUE the walk goes into the entry if its file_type is
+EXT2_FT_DIR, so a visitor can steer it by changing file_type;
+WALK_SKIP leaves a directory's contents out, WALK_STOP or a negative errno
+ends the walk. A visitor may set cookie for a directory it lets the walk go
+into: the directory's entries get it as parent_cookie, and leave gets it back
+once the walk is done with the directory (its whole subtree depth first, its
+own entries breadth first), the place to free it.
+
+WALK_ONCE goes into each directory once however many entries name it, which
+is what stops a loop. WALK_FOLLOW_LINKS also goes into symbolic links that
+resolve to a directory, at most max_hops links deep along any path
+(SYMLINK_MAX_HOPS if it is 0).
+*/
+
+#define WALK_DFS 0
+#define WALK_BFS 1
+
+#define WALK_ONCE 1
+#define WALK_FOLLOW_LINKS 2
+#define WALK_BLOCK_ORDER 4
+#define WALK_DOTS 8
+
+//Visitor results.
+#define WALK_CONTINUE 0
+#define WALK_SKIP 1
+#define WALK_STOP 2
+
+typedef struct walk_entry {
+    unsigned int inode;
+    unsigned int parent;
+    //Where the entry sits in its directory.
+    unsigned int block;
+    unsigned int offset;
+    char *name;
+    int name_len;
+    int file_type;
+    int depth;
+    void *parent_cookie;
+    void *cookie;
+} WalkEntry;
+
+typedef struct tree_walk {
+    int order;
+    int flags;
+    int max_hops;
+    int (*visit)(ext2_fs*, WalkEntry*, void*);
+    void (*leave)(ext2_fs*, unsigned int, void*, void*);
+    void *arg;
+    //Filled in by the walk: directories read and the most held at once.
+    long dirs;
+    long max_pending;
+} TreeWalk;
+
+int tree_walk(ext2_fs*, unsigned int, TreeWalk*, void*);
+int resolve_link_dir(ext2_fs*, unsigned int);
+
+#endif